@@ -11,9 +11,46 @@
 #include <angles/angles.h>
 #include <geometry_msgs/Twist.h>
 #include <std_msgs/Bool.h>
+#include <atomic>
+#include <memory>
+#include <engineer_middleware/reachability_map.h>
+#include <engineer_middleware/pose_servo.h>
+#include <engineer_middleware/exchanger_filter.h>
+#include <engineer_middleware/search_planner.h>
 
 namespace auto_exchange
 {
+// Time of the state machines, ROS time unless a driver steps them faster than real time with its own clock
+class Clock
+{
+public:
+  virtual ~Clock() = default;
+  virtual ros::Time now() const
+  {
+    return ros::Time::now();
+  }
+};
+
+class ManualClock : public Clock
+{
+public:
+  ros::Time now() const override
+  {
+    return now_;
+  }
+  void set(const ros::Time& now)
+  {
+    now_ = now;
+  }
+  void advance(const ros::Duration& duration)
+  {
+    now_ += duration;
+  }
+
+private:
+  ros::Time now_;
+};
+
 class JointInfo
 {
 public:
@@ -87,18 +124,21 @@ public:
   ProgressBase(XmlRpc::XmlRpcValue& progress, tf2_ros::Buffer& tf_buffer, ros::NodeHandle& nh)
     : tf_buffer_(tf_buffer), nh_(nh)
   {
+    // Everything is read here, run() is called from servo loops and must not talk to the master
     time_out_ = xmlRpcGetDouble(progress, "time_out", 1e10);
-    if (nh_.hasParam("internal_time_out"))
+    if (progress.hasMember("internal_time_out"))
     {
+      ROS_ASSERT(progress["internal_time_out"].getType() == XmlRpc::XmlRpcValue::TypeArray);
       internal_time_out_.resize((int)progress["internal_time_out"].size(), 1.);
       for (int i = 0; i < (int)progress["internal_time_out"].size(); ++i)
-        internal_time_out_[i] = (progress["internal_time_out"][i]);
+        internal_time_out_[i] = xmlRpcGetDouble(progress["internal_time_out"], i);
     }
   }
   virtual void init()
   {
     enter_flag_ = false;
     is_finish_ = false;
+    is_time_out_ = false;
     is_recorded_time_ = false;
     is_recorded_internal_time_ = false;
   }
@@ -109,7 +149,7 @@ public:
     if (!is_finish_)
     {
       checkTimeout();
-      if (nh_.hasParam("internal_time_out"))
+      if (!internal_time_out_.empty())
       {
         checkInternalTimeout();
       }
@@ -129,18 +169,27 @@ public:
   {
     return is_time_out_;
   }
-  bool getProcess() const
+  int getProcess() const
   {
     return process_;
   }
+  virtual void setClock(const Clock& clock)
+  {
+    clock_ = &clock;
+  }
+  // Exchanger poses come from the filter when there is one, otherwise straight from TF
+  void setExchangerFilter(ExchangerFilter* exchanger_filter)
+  {
+    exchanger_filter_ = exchanger_filter;
+  }
   void checkTimeout()
   {
     if (!is_recorded_time_)
     {
       is_recorded_time_ = true;
-      start_time_ = ros::Time::now();
+      start_time_ = clock_->now();
     }
-    if ((ros::Time::now() - start_time_).toSec() > time_out_)
+    if ((clock_->now() - start_time_).toSec() > time_out_)
     {
       ROS_ERROR("Progress timeout, should be finish in %f seconds", time_out_);
       is_recorded_time_ = false;
@@ -153,10 +202,13 @@ public:
     if (!is_recorded_internal_time_ || last_process_ != process_)
     {
       is_recorded_internal_time_ = true;
-      internal_start_time_ = ros::Time::now();
+      internal_start_time_ = clock_->now();
       last_process_ = process_;
     }
-    if ((ros::Time::now() - internal_start_time_).toSec() > internal_time_out_[process_])
+    // Processes without an entry have no internal timeout
+    if (process_ >= (int)internal_time_out_.size())
+      return;
+    if ((clock_->now() - internal_start_time_).toSec() > internal_time_out_[process_])
     {
       ROS_ERROR("Inside progress timeout, should be finish in %f seconds", internal_time_out_[process_]);
       //      ROS_INFO_STREAM("dt:  " <<  (ros::Time::now() - internal_start_time_).toSec());
@@ -169,7 +221,49 @@ public:
   }
 
 protected:
+  // An internal_time_out longer than the processes was written for the former processes of the state. Each process
+  // gets the sum of the former entries it replaced, groups[i] being their indexes for process i.
+  void translateInternalTimeout(const std::string& name, const std::vector<std::vector<int>>& groups)
+  {
+    if ((int)internal_time_out_.size() <= process_num_)
+      return;
+    ROS_ERROR("internal_time_out of %s has %zu entries for the former processes, translated to %d, update the config",
+              name.c_str(), internal_time_out_.size(), process_num_);
+    std::vector<double> translated;
+    for (const auto& group : groups)
+    {
+      double time_out = 0.;
+      bool has_entry = false;
+      for (int i : group)
+        if (i < (int)internal_time_out_.size())
+        {
+          time_out += internal_time_out_[i];
+          has_entry = true;
+        }
+      translated.push_back(has_entry ? time_out : 1e10);
+    }
+    internal_time_out_ = translated;
+  }
+  // Throws tf2::TransformException like lookupTransform
+  geometry_msgs::TransformStamped lookupExchanger(const std::string& frame)
+  {
+    geometry_msgs::TransformStamped transform;
+    if (!exchanger_filter_)
+      return tf_buffer_.lookupTransform(frame, "exchanger", ros::Time(0));
+    if (!exchanger_filter_->predict(frame, clock_->now(), transform))
+      throw tf2::LookupException("No exchanger in the filter yet");
+    return transform;
+  }
+
+  static const Clock& rosClock()
+  {
+    static Clock clock;
+    return clock;
+  }
+
   tf2_ros::Buffer& tf_buffer_;
+  const Clock* clock_{ &rosClock() };
+  ExchangerFilter* exchanger_filter_{};
   int process_{}, last_process_{}, process_num_{};
   bool is_finish_{ false }, is_recorded_time_{ false }, enter_flag_{ false }, is_recorded_internal_time_{ false },
       is_time_out_{ false };
@@ -198,8 +292,16 @@ public:
     search_range_ = xmlRpcGetDouble(find, "search_range", 0.3);
     ROS_ASSERT(find["yaw"].getType() == XmlRpc::XmlRpcValue::TypeStruct);
     ROS_ASSERT(find["pitch"].getType() == XmlRpc::XmlRpcValue::TypeStruct);
-    yaw_ = new JointInfo(find["yaw"]);
-    pitch_ = new JointInfo(find["pitch"]);
+    yaw_ = std::make_unique<JointInfo>(find["yaw"]);
+    pitch_ = std::make_unique<JointInfo>(find["pitch"]);
+    // Consecutive detections before the exchanger counts as found
+    confirm_detections_ = (int)xmlRpcGetDouble(find, "confirm_detections", 1);
+    if (find.hasMember("planner"))
+      planner_ = std::make_unique<SearchPlanner>(find["planner"], (yaw_->min_position_ + yaw_->offset_) * search_range_,
+                                                 (yaw_->max_position_ + yaw_->offset_) * search_range_,
+                                                 (pitch_->min_position_ + pitch_->offset_) * search_range_,
+                                                 (pitch_->max_position_ + pitch_->offset_) * search_range_,
+                                                 yaw_->max_scale_, pitch_->max_scale_);
     visual_recognition_sub_ =
         nh_.subscribe<rm_msgs::ExchangerMsg>("/pnp_publisher", 1, &Find::visualRecognitionCallback, this);
     ROS_INFO_STREAM("~~~~~~~~~~~~~FIND~~~~~~~~~~~~~~~~");
@@ -209,6 +311,9 @@ public:
     ProgressBase::init();
     process_ = { SWING };
     initScales();
+    found_count_ = 0;
+    if (planner_)
+      planner_->reset();
   }
   std::vector<double> getGimbalScale()
   {
@@ -218,6 +323,13 @@ public:
   {
     return chassis_scale_;
   }
+  // Result of the vision, from /pnp_publisher or a driver
+  void setDetection(bool is_found, const geometry_msgs::Point& middle_point)
+  {
+    is_found_ = is_found;
+    found_count_ = is_found_ ? found_count_ + 1 : 0;
+    middle_point_ = middle_point;
+  }
   void testAdjust()
   {
     gimbal_scale_[0] = middle_point_.x / 200;
@@ -231,8 +343,11 @@ private:
     {
       case SWING:
       {
-        autoSearch(false, true);
-        if (is_found_)
+        if (planner_)
+          plannedSearch();
+        else
+          autoSearch(false, true);
+        if (found_count_ >= confirm_detections_)
         {
           //            process_ = ADJUST;
           process_ = FINISH;
@@ -285,6 +400,37 @@ private:
       chassis_scale_[1] = gimbal_scale_[1];
     }
   }
+  void plannedSearch()
+  {
+    double chassis_yaw = 0., yaw, pitch, roll_temp, yaw_temp;
+    try
+    {
+      yaw = yawFromQuat(tf_buffer_.lookupTransform("gimbal_base", "yaw", ros::Time(0)).transform.rotation);
+      geometry_msgs::TransformStamped yaw2pitch = tf_buffer_.lookupTransform("yaw", "pitch", ros::Time(0));
+      quatToRPY(yaw2pitch.transform.rotation, roll_temp, pitch, yaw_temp);
+    }
+    catch (tf2::TransformException& ex)
+    {
+      ROS_WARN("%s", ex.what());
+      return;
+    }
+    try
+    {
+      chassis_yaw = yawFromQuat(tf_buffer_.lookupTransform("map", "base_link", ros::Time(0)).transform.rotation);
+    }
+    catch (tf2::TransformException& ex)
+    {
+      // Without odometry the bearings are kept relative to the chassis
+    }
+    if (found_count_ >= confirm_detections_)
+    {
+      planner_->addDetection(chassis_yaw + yaw, pitch);
+      gimbal_scale_[0] = 0.;
+      gimbal_scale_[1] = 0.;
+      return;
+    }
+    planner_->plan(chassis_yaw, yaw, pitch, gimbal_scale_[0], gimbal_scale_[1]);
+  }
   void printProcess() override
   {
     if (process_ == SWING)
@@ -304,11 +450,13 @@ private:
   }
   void visualRecognitionCallback(const rm_msgs::ExchangerMsg ::ConstPtr& msg)
   {
-    is_found_ = msg->flag;
-    middle_point_ = msg->middle_point;
+    setDetection(msg->flag, msg->middle_point);
   }
-  JointInfo *yaw_{}, *pitch_{};
+  std::unique_ptr<JointInfo> yaw_, pitch_;
+  std::unique_ptr<SearchPlanner> planner_;
   bool is_found_{ false };
+  std::atomic<int> found_count_{ 0 };
+  int confirm_detections_{};
   geometry_msgs::Point middle_point_;
   std::vector<double> gimbal_scale_{}, chassis_scale_{};
   ros::Subscriber visual_recognition_sub_{};
@@ -335,6 +483,8 @@ public:
     x_.init(pre_adjust["x"], "x", nh);
     y_.init(pre_adjust["y"], "y", nh);
     yaw_.init(pre_adjust["yaw"], "yaw", nh);
+    reachability_min_score_ = (int)xmlRpcGetDouble(pre_adjust, "reachability_min_score", 0);
+    reachability_search_range_ = xmlRpcGetDouble(pre_adjust, "reachability_search_range", 0.1);
     ROS_INFO_STREAM("~~~~~~~~~~~~~PRE_ADJUST~~~~~~~~~~~~~~~~");
   }
   void init() override
@@ -351,6 +501,8 @@ public:
       case SET_GOAL:
       {
         set_goal();
+        // The first dt of the pids starts here, not at the epoch
+        last_time_ = clock_->now();
         process_ = CHASSIS_X;
       }
       break;
@@ -428,23 +580,25 @@ private:
     quatToRPY(chassis_target_.pose.orientation, roll, pitch, yaw_goal);
     yaw_.error = angles::shortest_angular_distance(yaw_current, yaw_goal);
 
-    ros::Duration dt = ros::Time::now() - last_time_;
+    ros::Duration dt = clock_->now() - last_time_;
     chassis_vel_cmd_.linear.x = x_.computerVel(dt);
     chassis_vel_cmd_.linear.y = y_.computerVel(dt);
     chassis_vel_cmd_.angular.z = yaw_.computerVel(dt);
 
-    last_time_ = ros::Time::now();
+    last_time_ = clock_->now();
   }
   void set_goal()
   {
     geometry_msgs::TransformStamped base2exchange;
     double roll, pitch, yaw;
-    base2exchange = tf_buffer_.lookupTransform("base_link", "exchanger", ros::Time(0));
+    base2exchange = lookupExchanger("base_link");
     quatToRPY(base2exchange.transform.rotation, roll, pitch, yaw);
 
     double goal_x = base2exchange.transform.translation.x - x_.offset_refer_exchanger;
     double goal_y = base2exchange.transform.translation.y - y_.offset_refer_exchanger;
     double goal_yaw = yaw * yaw_.offset_refer_exchanger;
+    if (reachability_min_score_ > 0)
+      selectReachableGoal(base2exchange.transform.translation, goal_x, goal_y, goal_yaw);
     chassis_original_target_.pose.position.x = goal_x;
     chassis_original_target_.pose.position.y = goal_y;
     tf2::Quaternion quat_tf;
@@ -455,7 +609,44 @@ private:
     tf2::doTransform(chassis_target_, chassis_target_, tf_buffer_.lookupTransform("map", "base_link", ros::Time(0)));
   }
 
+  // Move the goal to the nearest one which puts the exchanger in a reachable voxel of the arm
+  void selectReachableGoal(const geometry_msgs::Vector3& exchanger, double& goal_x, double& goal_y, double goal_yaw)
+  {
+    const engineer_middleware::ReachabilityMap& map = engineer_middleware::ReachabilityMap::getInstance();
+    if (!map.isLoaded())
+      return;
+    double step = map.getResolution();
+    int range = (int)(reachability_search_range_ / step);
+    double best_x = goal_x, best_y = goal_y, best_distance = 1e10;
+    for (int i = -range; i <= range; ++i)
+    {
+      for (int j = -range; j <= range; ++j)
+      {
+        double x = goal_x + i * step, y = goal_y + j * step;
+        // Exchanger under base_link after chassis reach this goal
+        double dx = exchanger.x - x, dy = exchanger.y - y;
+        double exchanger_x = cos(goal_yaw) * dx + sin(goal_yaw) * dy;
+        double exchanger_y = -sin(goal_yaw) * dx + cos(goal_yaw) * dy;
+        if (map.getScore(exchanger_x, exchanger_y, exchanger.z) < reachability_min_score_)
+          continue;
+        double distance = std::hypot(i * step, j * step);
+        if (distance < best_distance)
+        {
+          best_distance = distance;
+          best_x = x;
+          best_y = y;
+        }
+      }
+    }
+    if (best_distance == 1e10)
+      ROS_WARN("No reachable chassis goal in %f m", reachability_search_range_);
+    goal_x = best_x;
+    goal_y = best_y;
+  }
+
   bool re_adjusted_{ false };
+  int reachability_min_score_{};
+  double reachability_search_range_{};
   ros::Time last_time_;
   std::string chassis_command_source_frame_{ "base_link" };
   geometry_msgs::Twist chassis_vel_cmd_{};
@@ -463,81 +654,48 @@ private:
   SingleDirectionMove x_, y_, yaw_;
 };
 
+// Aligns all six axes of the tool with the exchanger at the offset of x, then pushes in along x
 class AutoServoMove : public ProgressBase
 {
 public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
   enum ServoMoveProcess
   {
-    YZ,
-    YAW,
-    ROLL,
-    REZ,
-    PITCH,
-    REY,
-    RREZ,
+    ALIGN,
     PUSH,
     FINISH
   };
   AutoServoMove(XmlRpc::XmlRpcValue& auto_servo_move, tf2_ros::Buffer& tf_buffer, ros::NodeHandle& nh)
-    : ProgressBase(auto_servo_move, tf_buffer, nh), joint7_msg_(0.)
+    : ProgressBase(auto_servo_move, tf_buffer, nh)
   {
-    process_ = YZ;
+    process_ = ALIGN;
     last_process_ = process_;
-    process_num_ = 6;
-
-    x_.init(auto_servo_move["x"], "x", nh);
-    y_.init(auto_servo_move["y"], "y", nh);
-    z_.init(auto_servo_move["z"], "z", nh);
-    re_y_.init(auto_servo_move["re_y"], "re_y", nh);
-    re_z_.init(auto_servo_move["re_z"], "re_z", nh);
-    roll_.init(auto_servo_move["roll"], "roll", nh);
-    pitch_.init(auto_servo_move["pitch"], "pitch", nh);
-    yaw_.init(auto_servo_move["yaw"], "yaw", nh);
-    move_gather_.clear();
-    move_gather_.push_back(x_);
-    move_gather_.push_back(y_);
-    move_gather_.push_back(z_);
-    move_gather_.push_back(roll_);
-    move_gather_.push_back(pitch_);
-    move_gather_.push_back(yaw_);
-    move_gather_.push_back(re_y_);
-    move_gather_.push_back(re_z_);
-
-    servo_pid_value_.resize(6, 0.);
-    servo_scales_.resize(6, 0.);
+    process_num_ = 3;
+    // Formerly YZ, YAW, ROLL, REZ, PITCH, REY, RREZ, PUSH
+    translateInternalTimeout("auto_servo_move", { { 0, 1, 2, 3, 4, 5, 6 }, { 7 } });
+    servo_.init(auto_servo_move);
+    align_offset_x_ = servo_.getOffset(PoseServo::X);
     ROS_INFO_STREAM("~~~~~~~~~~~~~SERVO_MOVE~~~~~~~~~~~~~~~~");
   }
   ~AutoServoMove() = default;
   void init() override
   {
     ProgressBase::init();
-    process_ = { YZ };
-    initComputerValue();
-    joint7_msg_ = 0.;
+    process_ = { ALIGN };
+    servo_.setOffset(PoseServo::X, align_offset_x_);
+    servo_.reset();
+    last_time_ = ros::Time();
   }
-  double getJoint7Msg() const
+  // Twist of tools_link, linear then angular
+  const Vector6d& getServoScale() const
   {
-    return joint7_msg_;
-  }
-  std::vector<double> getServoScale()
-  {
-    return servo_scales_;
+    return servo_.getTwist();
   }
 
   void printProcess() override
   {
-    if (process_ == YZ)
-      ROS_INFO_STREAM("YZ");
-    else if (process_ == YAW)
-      ROS_INFO_STREAM("YAW");
-    else if (process_ == ROLL)
-      ROS_INFO_STREAM("ROLL");
-    else if (process_ == PITCH)
-      ROS_INFO_STREAM("PITCH");
-    else if (process_ == REY)
-      ROS_INFO_STREAM("REY");
-    else if (process_ == REZ)
-      ROS_INFO_STREAM("REZ");
+    if (process_ == ALIGN)
+      ROS_INFO_STREAM("ALIGN");
     else if (process_ == PUSH)
       ROS_INFO_STREAM("PUSH");
     else if (process_ == FINISH)
@@ -547,151 +705,42 @@ public:
 private:
   void stateMachine() override
   {
-    computeServoMoveScale();
-    manageServoMoveProcess();
-  }
-  void initComputerValue()
-  {
-    for (int i = 0; i < (int)servo_pid_value_.size(); ++i)
-    {
-      servo_pid_value_[i] = 0.;
-      servo_scales_[i] = 0.;
-    }
-    move_gather_[0] = x_;
-    move_gather_[1] = y_;
-    move_gather_[2] = z_;
-    move_gather_[3] = roll_;
-    move_gather_[4] = pitch_;
-    move_gather_[5] = yaw_;
-    move_gather_[6] = re_y_;
-    move_gather_[7] = re_z_;
-  }
-  void computeServoMoveError()
-  {
-    initComputerValue();
-    double roll, pitch, yaw;
-    std::vector<double> errors;
-    geometry_msgs::TransformStamped tools2exchanger;
-    try
-    {
-      tools2exchanger = tf_buffer_.lookupTransform("tools_link", "exchanger", ros::Time(0));
-      quatToRPY(tools2exchanger.transform.rotation, roll, pitch, yaw);
-    }
-    catch (tf2::TransformException& ex)
-    {
-      ROS_WARN("%s", ex.what());
-    }
-    x_.error = (process_ == PUSH ? (tools2exchanger.transform.translation.x) :
-                                   (tools2exchanger.transform.translation.x - x_.offset_refer_exchanger));
-    y_.error = tools2exchanger.transform.translation.y - y_.offset_refer_exchanger;
-    re_y_.error = y_.error;
-    z_.error = tools2exchanger.transform.translation.z - z_.offset_refer_exchanger;
-    re_z_.error = z_.error;
-    roll_.error = roll * roll_.offset_refer_exchanger;
-    pitch_.error = pitch * pitch_.offset_refer_exchanger;
-    yaw_.error = yaw * yaw_.offset_refer_exchanger;
-
-    ros::Duration dt = ros::Time::now() - last_time_;
-    last_time_ = ros::Time::now();
-
-    servo_pid_value_[0] = x_.computerVel(dt);
-    if (process_ != REY)
-      servo_pid_value_[1] = y_.computerVel(dt);
-    else
-      servo_pid_value_[1] = re_y_.computerVel(dt);
-    if (process_ == REZ || process_ == RREZ)
-      servo_pid_value_[2] = re_z_.computerVel(dt);
-    else
-      servo_pid_value_[2] = z_.computerVel(dt);
-    servo_pid_value_[3] = roll_.computerVel(dt);
-    servo_pid_value_[4] = pitch_.computerVel(dt);
-    servo_pid_value_[5] = yaw_.computerVel(dt);
-  }
-  void computeServoMoveScale()
-  {
-    computeServoMoveError();
     switch (process_)
     {
-      case YZ:
-      {
-        servo_scales_[1] = servo_pid_value_[1];
-        servo_scales_[2] = servo_pid_value_[2];
-      }
-      break;
-      case YAW:
-      {
-        servo_scales_[5] = servo_pid_value_[5];
-      }
-      break;
-      case ROLL:
-      {
-        servo_scales_[3] = servo_pid_value_[3];
-      }
-      break;
-      case REZ:
-      {
-        servo_scales_[2] = servo_pid_value_[2];
-      }
-      break;
-      case PITCH:
-      {
-        joint7_msg_ = pitch_.error;
-      }
-      break;
-      case REY:
-      {
-        servo_scales_[1] = servo_pid_value_[1];
-      }
-      break;
-      case RREZ:
+      case ALIGN:
+      case PUSH:
       {
-        servo_scales_[2] = servo_pid_value_[2];
+        computeServoMoveScale();
+        if (!servo_.isFinish())
+          break;
+        process_++;
+        // Pushing keeps the other axes aligned, only the goal of x moves onto the exchanger
+        servo_.setOffset(PoseServo::X, 0.);
       }
       break;
-      case PUSH:
+      case FINISH:
       {
-        servo_scales_[0] = servo_pid_value_[0];
+        servo_.reset();
+        is_finish_ = true;
       }
       break;
     }
   }
-  void manageServoMoveProcess()
+  void computeServoMoveScale()
   {
-    int move_joint_num = 0, arrived_joint_num = 0;
-    for (int i = 0; i < (int)servo_scales_.size(); ++i)
+    geometry_msgs::TransformStamped tools2exchanger;
+    try
     {
-      if (servo_scales_[i] != 0)
-      {
-        move_joint_num++;
-        if (process_ == YZ)
-        {
-          if (abs(move_gather_[i].error) <= (y_.tolerance + z_.tolerance) / 2)
-            arrived_joint_num++;
-        }
-        else if (process_ == REZ)
-        {
-          if (abs(re_z_.error) <= re_z_.tolerance)
-            arrived_joint_num++;
-        }
-        else if (process_ == REY)
-        {
-          if (abs(re_y_.error) <= re_y_.tolerance)
-            arrived_joint_num++;
-        }
-        else
-        {
-          if (abs(move_gather_[i].error) <= move_gather_[i].tolerance)
-            arrived_joint_num++;
-        }
-      }
+      tools2exchanger = lookupExchanger("tools_link");
     }
-    if (arrived_joint_num == move_joint_num)
+    catch (tf2::TransformException& ex)
     {
-      if (process_ != FINISH)
-        process_++;
-      else
-        is_finish_ = true;
+      ROS_WARN("%s", ex.what());
+      return;
     }
+    ros::Time now = clock_->now();
+    servo_.update(tools2exchanger.transform, last_time_.isZero() ? 0. : (now - last_time_).toSec());
+    last_time_ = now;
   }
   void rectifyForLink7(double theta, double link7_length)
   {
@@ -699,22 +748,22 @@ private:
     rectify_z_ = link7_length_ * sin(theta) * cos(theta) / (tan(M_PI_2 - theta / 2));
   }
 
-  SingleDirectionMove x_, y_, z_, roll_, pitch_, yaw_, re_y_, re_z_;
-  std::vector<SingleDirectionMove> move_gather_{};
+  PoseServo servo_;
   ros::Time last_time_;
-  double link7_length_{}, joint7_msg_{}, rectify_x_, rectify_z_;
-  std::vector<double> servo_errors_{}, servo_scales_{}, servo_pid_value_{};
+  double align_offset_x_{}, link7_length_{}, rectify_x_, rectify_z_;
 };
 
+// Waits for the planned approach, then servos the position of the tool onto the exchanger. When the approach is
+// played back as a reference instead, the position error to the reference is servoed during the motion already, so
+// the tool does not rest between the two.
 class UnionMove : public ProgressBase
 {
 public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
   enum UnionMoveProcess
   {
     MOTION,
-    SERVO_Z,
-    SERVO_Y,
-    SERVO_X,
+    SERVO,
     FINISH
   };
   UnionMove(XmlRpc::XmlRpcValue& union_move, tf2_ros::Buffer& tf_buffer, ros::NodeHandle& nh)
@@ -722,16 +771,12 @@ public:
   {
     process_ = MOTION;
     last_process_ = process_;
-    process_num_ = 4;
+    process_num_ = 3;
+    // Formerly MOTION, SERVO_Z, SERVO_Y, SERVO_X
+    translateInternalTimeout("union_move", { { 0 }, { 1, 2, 3 } });
     motion_name_ = union_move.hasMember("motion_name") ? std::string(union_move["motion_name"]) : "AUTO_EXCHANGE";
-    x_.init(union_move["x"], "x", nh);
-    y_.init(union_move["y"], "y", nh);
-    z_.init(union_move["z"], "z", nh);
-    move_gather_.clear();
-    move_gather_.push_back(x_);
-    move_gather_.push_back(y_);
-    move_gather_.push_back(z_);
-    servo_scales_.resize(3, 0.);
+    // Only x, y and z are configured for the union move
+    servo_.init(union_move);
   }
   std::string getMotionName()
   {
@@ -753,17 +798,47 @@ public:
   {
     is_motion_start_ = state;
   }
-  std::vector<double> getServoScale()
+  // The frame the servo twists are given in, tools_link by default
+  void setServoFrame(const std::string& servo_frame)
   {
-    return servo_scales_;
+    servo_frame_ = servo_frame;
+  }
+  // Keeps the exchanger under frame, in which the references of the approach are given
+  bool startReference(const std::string& frame)
+  {
+    try
+    {
+      tf2::fromMsg(lookupExchanger(frame).transform, frame2exchanger_);
+    }
+    catch (tf2::TransformException& ex)
+    {
+      ROS_WARN("%s", ex.what());
+      return false;
+    }
+    has_reference_ = true;
+    return true;
+  }
+  // Pose of the tool planned for this tick, under the frame of startReference
+  void setReference(const geometry_msgs::Transform& frame2tools)
+  {
+    tf2::Transform tools;
+    tf2::fromMsg(frame2tools, tools);
+    reference_ = tools.inverse() * frame2exchanger_;
+  }
+  // Twist of the servo frame, linear then angular
+  const Vector6d& getServoScale() const
+  {
+    return servo_.getTwist();
   }
   void init() override
   {
     ProgressBase::init();
-    initComputerValue();
+    servo_.reset();
+    last_time_ = ros::Time();
     process_ = MOTION;
     is_motion_start_ = false;
     is_motion_finish_ = false;
+    has_reference_ = false;
   }
 
 private:
@@ -773,101 +848,79 @@ private:
   }
   void stateMachine() override
   {
-    if (is_motion_finish_)
-      process_ = SERVO_Z;
-    if (process_ != MOTION)
-    {
-      computeServoMoveScale();
-      manageServoMoveProcess();
-    }
-  }
-  void initComputerValue()
-  {
-    for (double& servo_scale : servo_scales_)
-    {
-      servo_scale = 0.;
-    }
-    move_gather_[0] = x_;
-    move_gather_[1] = y_;
-    move_gather_[2] = z_;
-  }
-  void computeServoMoveError()
-  {
-    initComputerValue();
-    geometry_msgs::TransformStamped tools2exchanger;
-    try
-    {
-      tools2exchanger = tf_buffer_.lookupTransform("tools_link", "exchanger", ros::Time(0));
-    }
-    catch (tf2::TransformException& ex)
-    {
-      ROS_WARN("%s", ex.what());
-    }
-    x_.error = tools2exchanger.transform.translation.x - x_.offset_refer_exchanger;
-    y_.error = tools2exchanger.transform.translation.y - y_.offset_refer_exchanger;
-    z_.error = tools2exchanger.transform.translation.z - z_.offset_refer_exchanger;
-
-    ros::Duration dt = ros::Time::now() - last_time_;
-    last_time_ = ros::Time::now();
-
-    x_.getPidValue(dt);
-    y_.getPidValue(dt);
-    z_.getPidValue(dt);
-  }
-  void computeServoMoveScale()
-  {
-    computeServoMoveError();
     switch (process_)
     {
-      case SERVO_Z:
+      case MOTION:
       {
-        servo_scales_[0] = 0.;
-        servo_scales_[1] = 0.;
-        servo_scales_[2] = z_.pid_value;
+        if (has_reference_)
+          computeResidualScale();
+        if (is_motion_finish_)
+        {
+          process_ = SERVO;
+          // The error jumps from the reference to the goal, it must not kick the derivative
+          servo_.reset();
+          last_time_ = ros::Time();
+        }
       }
       break;
-      case SERVO_Y:
+      case SERVO:
       {
-        servo_scales_[0] = 0.;
-        servo_scales_[1] = y_.pid_value;
-        servo_scales_[2] = 0.;
+        computeServoMoveScale();
+        if (servo_.isFinish())
+          process_ = FINISH;
       }
       break;
-      case SERVO_X:
+      case FINISH:
       {
-        servo_scales_[0] = x_.pid_value;
-        servo_scales_[1] = 0.;
-        servo_scales_[2] = 0.;
+        servo_.reset();
+        is_finish_ = true;
       }
       break;
     }
   }
-  void manageServoMoveProcess()
+  void computeServoMoveScale()
   {
-    int move_joint_num = 0, arrived_joint_num = 0;
-    for (int i = 0; i < (int)servo_scales_.size(); ++i)
+    geometry_msgs::TransformStamped tools2exchanger;
+    try
     {
-      if (servo_scales_[i] != 0)
-      {
-        move_joint_num++;
-        if (abs(move_gather_[i].error) <= move_gather_[i].tolerance)
-          arrived_joint_num++;
-      }
+      tools2exchanger = lookupExchanger(servo_frame_);
     }
-    if (arrived_joint_num == move_joint_num)
+    catch (tf2::TransformException& ex)
     {
-      if (process_ != FINISH)
-        process_++;
-      else
-        is_finish_ = true;
+      ROS_WARN("%s", ex.what());
+      return;
     }
+    ros::Time now = clock_->now();
+    servo_.update(tools2exchanger.transform, last_time_.isZero() ? 0. : (now - last_time_).toSec());
+    last_time_ = now;
   }
-  bool is_motion_finish_{ false }, is_motion_start_{ false };
+  // The exchanger under the tool against where the reference expects it, which covers both the tracking error and
+  // the exchanger moving since the approach was planned
+  void computeResidualScale()
+  {
+    geometry_msgs::TransformStamped tools2exchanger;
+    try
+    {
+      tools2exchanger = lookupExchanger(servo_frame_);
+    }
+    catch (tf2::TransformException& ex)
+    {
+      ROS_WARN("%s", ex.what());
+      return;
+    }
+    const tf2::Vector3& expected = reference_.getOrigin();
+    Vector6d error = Vector6d::Zero();
+    const geometry_msgs::Vector3& actual = tools2exchanger.transform.translation;
+    error << actual.x - expected.x(), actual.y - expected.y(), actual.z - expected.z(), 0., 0., 0.;
+    ros::Time now = clock_->now();
+    servo_.update(error, last_time_.isZero() ? 0. : (now - last_time_).toSec());
+    last_time_ = now;
+  }
+  bool is_motion_finish_{ false }, is_motion_start_{ false }, has_reference_{ false };
   ros::Time last_time_;
-  SingleDirectionMove x_, y_, z_;
-  std::string motion_name_;
-  std::vector<double> servo_scales_{};
-  std::vector<SingleDirectionMove> move_gather_{};
+  tf2::Transform frame2exchanger_, reference_;
+  PoseServo servo_;
+  std::string motion_name_, servo_frame_{ "tools_link" };
 };
 
 // class MotionMove : public ProgressBase
@@ -917,10 +970,20 @@ public:
     ros::NodeHandle nh_auto_pre_adjust(nh, "auto_pre_adjust");
     ros::NodeHandle nh_auto_servo_move(nh, "auto_servo_move");
     ros::NodeHandle nh_union_move(nh, "union_move");
-    find_ = new Find(auto_exchange["auto_find"], tf_buffer, nh_auto_find);
-    pre_adjusted_ = new ProAdjust(auto_exchange["auto_pre_adjust"], tf_buffer, nh_auto_pre_adjust);
-    auto_servo_move_ = new AutoServoMove(auto_exchange["auto_servo_move"], tf_buffer, nh_auto_servo_move);
-    union_move_ = new UnionMove(auto_exchange["union_move"], tf_buffer, nh_union_move);
+    find_ = std::make_unique<Find>(auto_exchange["auto_find"], tf_buffer, nh_auto_find);
+    pre_adjusted_ = std::make_unique<ProAdjust>(auto_exchange["auto_pre_adjust"], tf_buffer, nh_auto_pre_adjust);
+    auto_servo_move_ =
+        std::make_unique<AutoServoMove>(auto_exchange["auto_servo_move"], tf_buffer, nh_auto_servo_move);
+    union_move_ = std::make_unique<UnionMove>(auto_exchange["union_move"], tf_buffer, nh_union_move);
+    if (auto_exchange.hasMember("exchanger_filter"))
+    {
+      // Owned here, the states only borrow it
+      filter_ = std::make_unique<ExchangerFilter>(auto_exchange["exchanger_filter"], tf_buffer);
+      setExchangerFilter(filter_.get());
+      pre_adjusted_->setExchangerFilter(filter_.get());
+      auto_servo_move_->setExchangerFilter(filter_.get());
+      union_move_->setExchangerFilter(filter_.get());
+    }
     exchanger_tf_update_pub_ = nh_.advertise<std_msgs::Bool>("/is_update_exchanger", 1);
   }
   void init() override
@@ -930,14 +993,29 @@ public:
     find_->init();
     pre_adjusted_->init();
     union_move_->init();
+    if (exchanger_filter_)
+      exchanger_filter_->reset();
     exchangerTfUpdate(true);
   }
+  void setClock(const Clock& clock) override
+  {
+    ProgressBase::setClock(clock);
+    find_->setClock(clock);
+    pre_adjusted_->setClock(clock);
+    auto_servo_move_->setClock(clock);
+    union_move_->setClock(clock);
+  }
+  // Finished by the union move, not by a timeout or a search which found nothing
+  bool getSuccessFlag() const
+  {
+    return is_finish_ && !is_time_out_ && process_ == MOVE;
+  }
 
 public:
-  Find* find_{};
-  ProAdjust* pre_adjusted_{};
-  AutoServoMove* auto_servo_move_{};
-  UnionMove* union_move_{};
+  std::unique_ptr<Find> find_;
+  std::unique_ptr<ProAdjust> pre_adjusted_;
+  std::unique_ptr<AutoServoMove> auto_servo_move_;
+  std::unique_ptr<UnionMove> union_move_;
 
 private:
   void exchangerTfUpdate(bool is_exchanger_tf_update)
@@ -947,6 +1025,9 @@ private:
   }
   void stateMachine() override
   {
+    // Every tick, so the filter has the detections of the search before the servo needs it
+    if (exchanger_filter_)
+      exchanger_filter_->update();
     switch (process_)
     {
       case FIND:
@@ -986,6 +1067,8 @@ private:
         if (union_move_->getFinishFlag())
         {
           is_finish_ = true;
+          // init clears the flag, a union move which timed out must not count as a success
+          is_time_out_ = union_move_->getTimeOutFlag();
           union_move_->init();
         }
       }
@@ -1003,6 +1086,7 @@ private:
     else if (process_ == FINISH)
       ROS_INFO_STREAM("FINISH");
   }
+  std::unique_ptr<ExchangerFilter> filter_;
   // tf update
   std_msgs::Bool is_exchanger_tf_update_{};
   ros::Publisher exchanger_tf_update_pub_;
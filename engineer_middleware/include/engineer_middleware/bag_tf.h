@@ -0,0 +1,74 @@
+//
+// Created by agent on 26-10-18.
+//
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <ros/console.h>
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+#include <tf2/buffer_core.h>
+#include <tf2_msgs/TFMessage.h>
+
+namespace engineer_middleware
+{
+// TF recorded in a bag, for the offline tools which replay it through the controllers of the middleware. The
+// controllers read their pids from the param server and advertise their topics, so the tools still need a roscore
+// with the configs loaded, and remap the topics under ~ so nothing reaches the robot.
+class BagTf
+{
+public:
+  // /tf and /tf_static go into a buffer spanning the whole bag, every other message is passed to callback in order
+  bool load(const std::string& path, const std::function<void(const rosbag::MessageInstance&)>& callback = nullptr)
+  {
+    rosbag::Bag bag;
+    try
+    {
+      bag.open(path, rosbag::bagmode::Read);
+    }
+    catch (rosbag::BagException& ex)
+    {
+      ROS_ERROR("%s", ex.what());
+      return false;
+    }
+    rosbag::View view(bag);
+    begin_time_ = view.getBeginTime();
+    end_time_ = view.getEndTime();
+    buffer_ = std::make_unique<tf2::BufferCore>(end_time_ - begin_time_ + ros::Duration(1.));
+    for (const rosbag::MessageInstance& message : view)
+    {
+      if (message.getTopic() == "/tf" || message.getTopic() == "/tf_static")
+      {
+        tf2_msgs::TFMessage::ConstPtr tf = message.instantiate<tf2_msgs::TFMessage>();
+        if (tf)
+          for (const auto& transform : tf->transforms)
+            buffer_->setTransform(transform, "bag", message.getTopic() == "/tf_static");
+      }
+      else if (callback)
+        callback(message);
+    }
+    return true;
+  }
+  const tf2::BufferCore& getBuffer() const
+  {
+    return *buffer_;
+  }
+  const ros::Time& getBeginTime() const
+  {
+    return begin_time_;
+  }
+  const ros::Time& getEndTime() const
+  {
+    return end_time_;
+  }
+
+private:
+  std::unique_ptr<tf2::BufferCore> buffer_;
+  ros::Time begin_time_, end_time_;
+};
+
+}  // namespace engineer_middleware
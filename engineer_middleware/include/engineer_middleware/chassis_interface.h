@@ -37,6 +37,8 @@
 
 #pragma once
 
+#include <mutex>
+
 #include <rm_common/ori_tool.h>
 
 #include <tf/transform_listener.h>
@@ -46,6 +48,8 @@
 #include <angles/angles.h>
 #include <tf2_geometry_msgs/tf2_geometry_msgs.h>
 
+#include "engineer_middleware/chassis_trajectory.h"
+
 namespace engineer_middleware
 {
 class ChassisInterface
@@ -67,19 +71,45 @@ public:
 
   bool setGoal(const geometry_msgs::PoseStamped& pose)
   {
-    goal_ = pose;
+    geometry_msgs::PoseStamped goal = pose;
     try
     {
-      tf2::doTransform(goal_, goal_, tf_.lookupTransform("map", goal_.header.frame_id, ros::Time(0)));
+      tf2::doTransform(goal, goal, tf_.lookupTransform("map", goal.header.frame_id, ros::Time(0)));
     }
     catch (tf2::TransformException& ex)
     {
       ROS_WARN("%s", ex.what());
     }
+    std::lock_guard<std::mutex> lock(mutex_);
+    goal_ = goal;
+    has_trajectory_ = false;
     error_pos_ = 1e10;
     error_yaw_ = 1e10;
     return true;
   };
+  // Tracks a time optimal trajectory to the goal under the limits: its velocity fed forward, the pids correcting the
+  // error to where it is. Falls back to the goal alone without the current pose.
+  bool setGoal(const geometry_msgs::PoseStamped& pose, const ChassisLimits& limits)
+  {
+    setGoal(pose);
+    geometry_msgs::TransformStamped current;
+    try
+    {
+      current = tf_.lookupTransform("map", "base_link", ros::Time(0));
+    }
+    catch (tf2::TransformException& ex)
+    {
+      ROS_WARN("%s", ex.what());
+      return true;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    trajectory_ = ChassisTrajectory(
+        toPose2D(current.transform.translation.x, current.transform.translation.y, current.transform.rotation),
+        toPose2D(goal_.pose.position.x, goal_.pose.position.y, goal_.pose.orientation), limits);
+    has_trajectory_ = true;
+    elapsed_ = 0.;
+    return true;
+  }
 
   void setCurrentAsGoal()
   {
@@ -89,15 +119,45 @@ public:
     setGoal(current);
   }
 
+  // Read by the steps while run() updates them
   double getErrorPos() const
   {
+    std::lock_guard<std::mutex> lock(mutex_);
     return error_pos_;
   }
   double getErrorYaw() const
   {
+    std::lock_guard<std::mutex> lock(mutex_);
     return error_yaw_;
   }
 
+  // Velocity under base_link from a controller of the caller
+  void setVel(const geometry_msgs::Twist& cmd_vel)
+  {
+    vel_pub_.publish(cmd_vel);
+  }
+  // Last command of run(), for tools which drive the interface offline
+  const geometry_msgs::Twist& getVel() const
+  {
+    return cmd_vel_;
+  }
+  void getGains(control_toolbox::Pid::Gains& x, control_toolbox::Pid::Gains& y, control_toolbox::Pid::Gains& yaw)
+  {
+    x = pid_x_.getGains();
+    y = pid_y_.getGains();
+    yaw = pid_yaw_.getGains();
+  }
+  // Replaces the gains of the param server and clears the pid states
+  void setGains(const control_toolbox::Pid::Gains& x, const control_toolbox::Pid::Gains& y,
+                const control_toolbox::Pid::Gains& yaw)
+  {
+    pid_x_.setGains(x);
+    pid_y_.setGains(y);
+    pid_yaw_.setGains(yaw);
+    pid_x_.reset();
+    pid_y_.reset();
+    pid_yaw_.reset();
+  }
   void stop()
   {
     geometry_msgs::Twist cmd_vel{};
@@ -109,6 +169,7 @@ public:
 
   void run(ros::Duration period)
   {
+    std::lock_guard<std::mutex> lock(mutex_);
     geometry_msgs::TransformStamped current;
     try
     {
@@ -119,39 +180,78 @@ public:
       ROS_WARN("%s", ex.what());
       return;
     }
-    // Transform xy error under map frame to velocity under chassis
-    geometry_msgs::Vector3 error;
-    error.x = goal_.pose.position.x - current.transform.translation.x;
-    error.y = goal_.pose.position.y - current.transform.translation.y;
+    // The reference is the goal, or where the trajectory is by now
+    double roll, pitch, yaw_current, yaw_goal;
+    quatToRPY(current.transform.rotation, roll, pitch, yaw_current);
+    quatToRPY(goal_.pose.orientation, roll, pitch, yaw_goal);
+    geometry_msgs::Pose2D reference;
+    reference.x = goal_.pose.position.x;
+    reference.y = goal_.pose.position.y;
+    reference.theta = yaw_goal;
+    geometry_msgs::Twist feed_forward{};
+    bool is_tracking = false;
+    if (has_trajectory_)
+    {
+      elapsed_ += period.toSec();
+      is_tracking = elapsed_ < trajectory_.getDuration();
+      trajectory_.sample(elapsed_, reference, feed_forward);
+    }
+    // Transform xy errors and the feed forward under map frame to velocity under chassis
+    geometry_msgs::Vector3 error, error_goal;
+    error.x = reference.x - current.transform.translation.x;
+    error.y = reference.y - current.transform.translation.y;
+    error_goal.x = goal_.pose.position.x - current.transform.translation.x;
+    error_goal.y = goal_.pose.position.y - current.transform.translation.y;
     try
     {
-      tf2::doTransform(error, error, tf_.lookupTransform("base_link", "map", ros::Time(0)));
+      geometry_msgs::TransformStamped map2base = tf_.lookupTransform("base_link", "map", ros::Time(0));
+      tf2::doTransform(error, error, map2base);
+      tf2::doTransform(error_goal, error_goal, map2base);
+      tf2::doTransform(feed_forward.linear, feed_forward.linear, map2base);
     }
     catch (tf2::TransformException& ex)
     {
       ROS_WARN("%s", ex.what());
     }
-    double roll, pitch, yaw_current, yaw_goal;
-    quatToRPY(current.transform.rotation, roll, pitch, yaw_current);
-    quatToRPY(goal_.pose.orientation, roll, pitch, yaw_goal);
+    double error_yaw = angles::shortest_angular_distance(yaw_current, reference.theta);
     error_yaw_ = angles::shortest_angular_distance(yaw_current, yaw_goal);
+    // Saturated at max_vel, the yaw below yaw_start_threshold is left out unless a trajectory is tracked
     geometry_msgs::Twist cmd_vel{};
-    cmd_vel.linear.x =
-        abs(pid_x_.computeCommand(error.x, period)) <= max_vel_ ? pid_x_.computeCommand(error.x, period) : 0;
-    cmd_vel.linear.y =
-        abs(pid_y_.computeCommand(error.y, period)) <= max_vel_ ? pid_y_.computeCommand(error.y, period) : 0;
-    cmd_vel.angular.z = abs(pid_yaw_.computeCommand(error_yaw_, period)) >= yaw_start_threshold_ ?
-                            pid_yaw_.computeCommand(error_yaw_, period) :
-                            0;
+    cmd_vel.linear.x = saturate(feed_forward.linear.x + pid_x_.computeCommand(error.x, period), max_vel_);
+    cmd_vel.linear.y = saturate(feed_forward.linear.y + pid_y_.computeCommand(error.y, period), max_vel_);
+    cmd_vel.angular.z = feed_forward.angular.z + pid_yaw_.computeCommand(error_yaw, period);
+    if (!is_tracking && abs(cmd_vel.angular.z) < yaw_start_threshold_)
+      cmd_vel.angular.z = 0.;
     vel_pub_.publish(cmd_vel);
-    error_pos_ = std::abs(error.x) + std::abs(error.y);
+    cmd_vel_ = cmd_vel;
+    error_pos_ = std::abs(error_goal.x) + std::abs(error_goal.y);
     error_yaw_ = std::abs(error_yaw_);
   }
 
+private:
+  static double saturate(double value, double limit)
+  {
+    return std::max(-limit, std::min(limit, value));
+  }
+  static geometry_msgs::Pose2D toPose2D(double x, double y, const geometry_msgs::Quaternion& orientation)
+  {
+    geometry_msgs::Pose2D pose;
+    double roll, pitch;
+    pose.x = x;
+    pose.y = y;
+    quatToRPY(orientation, roll, pitch, pose.theta);
+    return pose;
+  }
+
 private:
   tf2_ros::Buffer& tf_;
   control_toolbox::Pid pid_x_, pid_y_, pid_yaw_;
   geometry_msgs::PoseStamped goal_{};
+  geometry_msgs::Twist cmd_vel_{};
+  ChassisTrajectory trajectory_;
+  bool has_trajectory_{};
+  double elapsed_{};
+  mutable std::mutex mutex_;
   ros::Publisher vel_pub_;
   double error_pos_{}, error_yaw_{};
   double yaw_start_threshold_{}, max_vel_{};
@@ -0,0 +1,131 @@
+//
+// Created by agent on 26-10-18.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include <angles/angles.h>
+#include <geometry_msgs/Pose2D.h>
+#include <geometry_msgs/Twist.h>
+#include <rm_common/ros_utilities.h>
+
+namespace engineer_middleware
+{
+// Linear limits along the path in m/s and m/s^2, angular ones in rad/s and rad/s^2
+struct ChassisLimits
+{
+  ChassisLimits() = default;
+  explicit ChassisLimits(XmlRpc::XmlRpcValue& config)
+  {
+    max_vel = xmlRpcGetDouble(config, "max_vel", max_vel);
+    max_acc = xmlRpcGetDouble(config, "max_acc", max_acc);
+    max_yaw_vel = xmlRpcGetDouble(config, "max_yaw_vel", max_yaw_vel);
+    max_yaw_acc = xmlRpcGetDouble(config, "max_yaw_acc", max_yaw_acc);
+    ROS_ASSERT(max_vel > 0. && max_acc > 0. && max_yaw_vel > 0. && max_yaw_acc > 0.);
+  }
+  double max_vel{ 1. }, max_acc{ 2. }, max_yaw_vel{ 2. }, max_yaw_acc{ 4. };
+};
+
+// Time optimal rest to rest move over a distance: full acceleration, cruise at the velocity limit, full deceleration.
+// Short moves never reach the limit and have no cruise.
+class TrapezoidProfile
+{
+public:
+  TrapezoidProfile() = default;
+  TrapezoidProfile(double distance, double max_vel, double max_acc)
+    : distance_(std::abs(distance)), direction_(distance < 0. ? -1. : 1.), acc_(max_acc)
+  {
+    vel_ = std::min(max_vel, std::sqrt(distance_ * max_acc));
+    duration_ = distance_ > 0. ? distance_ / vel_ + vel_ / acc_ : 0.;
+  }
+  double getDuration() const
+  {
+    return duration_;
+  }
+  // Lowers the cruise velocity so the move takes the given duration, which is not shorter than the optimal one
+  void stretch(double duration)
+  {
+    if (duration <= duration_ || distance_ <= 0.)
+      return;
+    // distance = vel * (duration - vel / acc), the smaller root keeps the acceleration within the duration
+    double discriminant = acc_ * acc_ * duration * duration - 4. * acc_ * distance_;
+    vel_ = (acc_ * duration - std::sqrt(std::max(0., discriminant))) / 2.;
+    duration_ = duration;
+  }
+  void sample(double time, double& position, double& velocity) const
+  {
+    time = std::max(0., std::min(duration_, time));
+    double acc_time = vel_ / acc_;
+    if (time < acc_time)
+    {
+      position = 0.5 * acc_ * time * time;
+      velocity = acc_ * time;
+    }
+    else if (time < duration_ - acc_time)
+    {
+      position = 0.5 * vel_ * acc_time + vel_ * (time - acc_time);
+      velocity = vel_;
+    }
+    else
+    {
+      double remaining = duration_ - time;
+      position = distance_ - 0.5 * acc_ * remaining * remaining;
+      velocity = acc_ * remaining;
+    }
+    position *= direction_;
+    velocity *= direction_;
+  }
+
+private:
+  double distance_{}, direction_{ 1. }, acc_{ 1. }, vel_{}, duration_{};
+};
+
+// Straight line of the chassis in a fixed frame with the yaw turned on the way. Position and yaw each follow a
+// trapezoid profile, the faster one is slowed down so both arrive together.
+class ChassisTrajectory
+{
+public:
+  ChassisTrajectory() = default;
+  ChassisTrajectory(const geometry_msgs::Pose2D& start, const geometry_msgs::Pose2D& goal, const ChassisLimits& limits)
+    : start_(start)
+  {
+    double dx = goal.x - start.x, dy = goal.y - start.y;
+    double distance = std::hypot(dx, dy);
+    direction_x_ = distance > 0. ? dx / distance : 0.;
+    direction_y_ = distance > 0. ? dy / distance : 0.;
+    linear_ = TrapezoidProfile(distance, limits.max_vel, limits.max_acc);
+    angular_ = TrapezoidProfile(angles::shortest_angular_distance(start.theta, goal.theta), limits.max_yaw_vel,
+                                limits.max_yaw_acc);
+    double duration = std::max(linear_.getDuration(), angular_.getDuration());
+    linear_.stretch(duration);
+    angular_.stretch(duration);
+  }
+  double getDuration() const
+  {
+    return std::max(linear_.getDuration(), angular_.getDuration());
+  }
+  // Pose and velocity in the fixed frame at a time from the start, the goal at rest after the end
+  void sample(double time, geometry_msgs::Pose2D& pose, geometry_msgs::Twist& vel) const
+  {
+    double position, speed, angle, angular_speed;
+    linear_.sample(time, position, speed);
+    angular_.sample(time, angle, angular_speed);
+    pose.x = start_.x + direction_x_ * position;
+    pose.y = start_.y + direction_y_ * position;
+    pose.theta = angles::normalize_angle(start_.theta + angle);
+    vel = geometry_msgs::Twist();
+    vel.linear.x = direction_x_ * speed;
+    vel.linear.y = direction_y_ * speed;
+    vel.angular.z = angular_speed;
+  }
+
+private:
+  geometry_msgs::Pose2D start_;
+  double direction_x_{}, direction_y_{};
+  TrapezoidProfile linear_, angular_;
+};
+
+}  // namespace engineer_middleware
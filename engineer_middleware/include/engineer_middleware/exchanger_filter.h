@@ -0,0 +1,203 @@
+//
+// Created by agent on 26-10-18.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+
+#include <Eigen/Geometry>
+#include <rm_common/ros_utilities.h>
+#include <tf2_eigen/tf2_eigen.h>
+#include <tf2_ros/buffer.h>
+
+namespace auto_exchange
+{
+// Constant velocity Kalman filter of the exchanger pose in a fixed frame. A detection is put into the fixed frame with
+// the pose the robot had when the image was taken, arm and chassis odometry are in the TF chain, so a stale detection
+// is no longer a stale pose. The pose is then predicted to the control time and given under a link at its newest
+// pose, at the rate of the control loop instead of the camera.
+//
+// Position and orientation are filtered apart, each state is 3 values and 3 rates. Orientation is kept as a mean
+// quaternion with the error and angular velocity as rotation vectors in the fixed frame.
+class ExchangerFilter
+{
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  using Matrix6d = Eigen::Matrix<double, 6, 6>;
+  using Vector6d = Eigen::Matrix<double, 6, 1>;
+
+  ExchangerFilter(XmlRpc::XmlRpcValue& config, tf2_ros::Buffer& tf_buffer) : tf_buffer_(tf_buffer)
+  {
+    fixed_frame_ = config.hasMember("fixed_frame") ? std::string(config["fixed_frame"]) : "map";
+    exchanger_frame_ = config.hasMember("exchanger_frame") ? std::string(config["exchanger_frame"]) : "exchanger";
+    // Acceleration noise densities and measurement noise, as standard deviations
+    accel_noise_pos_ = std::pow(xmlRpcGetDouble(config, "accel_noise_pos", 0.05), 2);
+    accel_noise_rot_ = std::pow(xmlRpcGetDouble(config, "accel_noise_rot", 0.1), 2);
+    measurement_noise_pos_ = std::pow(xmlRpcGetDouble(config, "measurement_noise_pos", 0.01), 2);
+    measurement_noise_rot_ = std::pow(xmlRpcGetDouble(config, "measurement_noise_rot", 0.03), 2);
+    // Velocities are not extrapolated further than this after the last detection
+    max_prediction_ = xmlRpcGetDouble(config, "max_prediction", 0.3);
+    // Detections further than this many standard deviations are dropped, until max_rejected in a row reset the filter
+    gate_ = std::pow(xmlRpcGetDouble(config, "gate", 4.), 2);
+    max_rejected_ = (int)xmlRpcGetDouble(config, "max_rejected", 3);
+  }
+  void reset()
+  {
+    is_initialized_ = false;
+    rejected_ = 0;
+  }
+  bool isInitialized() const
+  {
+    return is_initialized_;
+  }
+  // Takes the newest detection from TF, if there is one since the last call
+  void update()
+  {
+    geometry_msgs::TransformStamped detection;
+    try
+    {
+      // Time(0) gives the stamp of the detection, with the robot posed as it was then
+      detection = tf_buffer_.lookupTransform(fixed_frame_, exchanger_frame_, ros::Time(0));
+    }
+    catch (tf2::TransformException& ex)
+    {
+      return;
+    }
+    if (is_initialized_ && detection.header.stamp <= stamp_)
+      return;
+    Eigen::Isometry3d pose = tf2::transformToEigen(detection);
+    if (!is_initialized_)
+    {
+      initialize(pose, detection.header.stamp);
+      return;
+    }
+    double dt = (detection.header.stamp - stamp_).toSec();
+    predict(dt);
+    stamp_ = detection.header.stamp;
+    correct(pose);
+  }
+  // Exchanger under frame at time, false before the first detection
+  bool predict(const std::string& frame, const ros::Time& time, geometry_msgs::TransformStamped& transform) const
+  {
+    if (!is_initialized_)
+      return false;
+    Eigen::Isometry3d link;
+    try
+    {
+      link = tf2::transformToEigen(tf_buffer_.lookupTransform(fixed_frame_, frame, ros::Time(0)));
+    }
+    catch (tf2::TransformException& ex)
+    {
+      ROS_WARN("%s", ex.what());
+      return false;
+    }
+    double horizon = std::max(0., std::min((time - stamp_).toSec(), max_prediction_));
+    Eigen::Isometry3d exchanger = Eigen::Isometry3d::Identity();
+    exchanger.translation() = position_.head<3>() + horizon * position_.tail<3>();
+    exchanger.linear() = (exp(horizon * rotation_.tail<3>()) * orientation_).toRotationMatrix();
+    transform = tf2::eigenToTransform(link.inverse() * exchanger);
+    transform.header.stamp = time;
+    transform.header.frame_id = frame;
+    transform.child_frame_id = exchanger_frame_;
+    return true;
+  }
+
+private:
+  void initialize(const Eigen::Isometry3d& pose, const ros::Time& stamp)
+  {
+    position_ << pose.translation(), Eigen::Vector3d::Zero();
+    orientation_ = Eigen::Quaterniond(pose.rotation());
+    rotation_.setZero();
+    covariance_pos_.setZero();
+    covariance_pos_.topLeftCorner<3, 3>().diagonal().setConstant(measurement_noise_pos_);
+    covariance_pos_.bottomRightCorner<3, 3>().diagonal().setConstant(1.);
+    covariance_rot_.setZero();
+    covariance_rot_.topLeftCorner<3, 3>().diagonal().setConstant(measurement_noise_rot_);
+    covariance_rot_.bottomRightCorner<3, 3>().diagonal().setConstant(1.);
+    stamp_ = stamp;
+    rejected_ = 0;
+    is_initialized_ = true;
+  }
+  void predict(double dt)
+  {
+    Matrix6d f = Matrix6d::Identity();
+    f.topRightCorner<3, 3>().diagonal().setConstant(dt);
+    position_ = f * position_;
+    orientation_ = exp(dt * rotation_.tail<3>()) * orientation_;
+    covariance_pos_ = f * covariance_pos_ * f.transpose() + processNoise(dt, accel_noise_pos_);
+    covariance_rot_ = f * covariance_rot_ * f.transpose() + processNoise(dt, accel_noise_rot_);
+  }
+  void correct(const Eigen::Isometry3d& pose)
+  {
+    Eigen::Vector3d innovation_pos = pose.translation() - position_.head<3>();
+    Eigen::Vector3d innovation_rot = log(Eigen::Quaterniond(pose.rotation()) * orientation_.inverse());
+    Eigen::Matrix3d s_pos = covariance_pos_.topLeftCorner<3, 3>() + measurement_noise_pos_ * Eigen::Matrix3d::Identity();
+    Eigen::Matrix3d s_rot = covariance_rot_.topLeftCorner<3, 3>() + measurement_noise_rot_ * Eigen::Matrix3d::Identity();
+    if (innovation_pos.dot(s_pos.ldlt().solve(innovation_pos)) > gate_ ||
+        innovation_rot.dot(s_rot.ldlt().solve(innovation_rot)) > gate_)
+    {
+      if (++rejected_ >= max_rejected_)
+      {
+        ROS_WARN("Exchanger moved, reset its filter");
+        initialize(pose, stamp_);
+      }
+      return;
+    }
+    rejected_ = 0;
+    Vector6d correction_pos = correct(covariance_pos_, s_pos, innovation_pos);
+    Vector6d correction_rot = correct(covariance_rot_, s_rot, innovation_rot);
+    position_ += correction_pos;
+    orientation_ = exp(correction_rot.head<3>()) * orientation_;
+    rotation_.tail<3>() += correction_rot.tail<3>();
+  }
+  // Measures the first 3 states, updates the covariance and gives the correction of the state
+  static Vector6d correct(Matrix6d& covariance, const Eigen::Matrix3d& s, const Eigen::Vector3d& innovation)
+  {
+    Eigen::Matrix<double, 6, 3> gain = covariance.leftCols<3>() * s.inverse();
+    covariance -= gain * covariance.topRows<3>();
+    return gain * innovation;
+  }
+  // White noise acceleration
+  static Matrix6d processNoise(double dt, double density)
+  {
+    Matrix6d q = Matrix6d::Zero();
+    q.topLeftCorner<3, 3>().diagonal().setConstant(dt * dt * dt / 3. * density);
+    q.topRightCorner<3, 3>().diagonal().setConstant(dt * dt / 2. * density);
+    q.bottomLeftCorner<3, 3>().diagonal().setConstant(dt * dt / 2. * density);
+    q.bottomRightCorner<3, 3>().diagonal().setConstant(dt * density);
+    return q;
+  }
+  static Eigen::Quaterniond exp(const Eigen::Vector3d& rotation)
+  {
+    double angle = rotation.norm();
+    if (angle < 1e-12)
+      return Eigen::Quaterniond::Identity();
+    return Eigen::Quaterniond(Eigen::AngleAxisd(angle, rotation / angle));
+  }
+  static Eigen::Vector3d log(const Eigen::Quaterniond& quaternion)
+  {
+    Eigen::AngleAxisd angle_axis(quaternion.normalized());
+    double angle = angle_axis.angle();
+    // Shortest rotation
+    if (angle > M_PI)
+      angle -= 2. * M_PI;
+    return angle * angle_axis.axis();
+  }
+
+  tf2_ros::Buffer& tf_buffer_;
+  std::string fixed_frame_, exchanger_frame_;
+  double accel_noise_pos_{}, accel_noise_rot_{}, measurement_noise_pos_{}, measurement_noise_rot_{};
+  double max_prediction_{}, gate_{};
+  int max_rejected_{}, rejected_{};
+  bool is_initialized_{};
+  ros::Time stamp_;
+  // Position and velocity, orientation error (always zero between updates) and angular velocity
+  Vector6d position_ = Vector6d::Zero(), rotation_ = Vector6d::Zero();
+  Eigen::Quaterniond orientation_ = Eigen::Quaterniond::Identity();
+  Matrix6d covariance_pos_ = Matrix6d::Zero(), covariance_rot_ = Matrix6d::Zero();
+};
+
+}  // namespace auto_exchange
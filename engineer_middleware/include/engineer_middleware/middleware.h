@@ -39,10 +39,11 @@
 
 #include "engineer_middleware/step_queue.h"
 #include "engineer_middleware/planning_scene.h"
+#include "engineer_middleware/resource_scheduler.h"
 
 // ROS
 #include <ros/ros.h>
-#include <actionlib/server/simple_action_server.h>
+#include <actionlib/server/action_server.h>
 #include <controller_manager_msgs/SwitchController.h>
 #include <rm_msgs/EngineerAction.h>
 #include <rm_msgs/GpioData.h>
@@ -51,6 +52,18 @@
 #include <tf2_geometry_msgs/tf2_geometry_msgs.h>
 #include <tf2_ros/transform_listener.h>
 #include <tf2_ros/transform_broadcaster.h>
+#include <std_msgs/String.h>
+#include <std_srvs/Trigger.h>
+
+// STL
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <list>
+#include <map>
+#include <mutex>
+#include <thread>
 
 namespace engineer_middleware
 {
@@ -58,38 +71,69 @@ class Middleware
 {
 public:
   explicit Middleware(ros::NodeHandle& nh);
-  void executeCB(const actionlib::SimpleActionServer<rm_msgs::EngineerAction>::GoalConstPtr& goal)
-  {
-    std::string name;
-    name = goal->step_queue_name;
-    is_middleware_control_ = true;
-    ROS_INFO("Start step queue id %s", name.c_str());
-    auto step_queue = step_queues_.find(name);
-    if (step_queue != step_queues_.end())
-      step_queue->second.run(as_);
-    ROS_INFO("Finish step queue id %s", name.c_str());
-    is_middleware_control_ = false;
-  }
+  ~Middleware();
   void run(ros::Duration period)
   {
-    // TODO chassis run crazily in motion
-    //    if (is_middleware_control_)
-    //      chassis_interface_.run(period);
+    // Chassis motions only get velocity commands when ~chassis_control is set. It is off by default since the loop
+    // drove the real chassis erratically, the benchmark turns it on for the simulated chassis.
+    if (is_chassis_control_ && is_middleware_control_)
+      chassis_interface_.run(period);
   }
 
 private:
+  struct Execution
+  {
+    actionlib::ServerGoalHandle<rm_msgs::EngineerAction> goal;
+    ResourceScheduler::Ticket ticket;
+    std::future<void> future;
+  };
+  // Every goal runs in its own thread, the scheduler decides whether it waits for or preempts the others
+  void goalCB(actionlib::ServerGoalHandle<rm_msgs::EngineerAction> goal);
+  void cancelCB(actionlib::ServerGoalHandle<rm_msgs::EngineerAction> goal);
+  void execute(Execution& execution);
+  // Build the queue on first use, returns nullptr if the steps list has no such queue
+  StepQueue* getStepQueue(const std::string& name);
+  void preloadCB(const std_msgs::StringConstPtr& msg);
+  bool reloadCB(std_srvs::Trigger::Request& req, std_srvs::Trigger::Response& res);
+  // Drop the built queues whose steps changed, returns how many
+  size_t applyReload();
+  static bool isValidStepsList(const XmlRpc::XmlRpcValue& steps_list);
+  void warmUp();
+
   ros::NodeHandle nh_;
-  actionlib::SimpleActionServer<rm_msgs::EngineerAction> as_;
+  actionlib::ActionServer<rm_msgs::EngineerAction> as_;
   moveit::planning_interface::MoveGroupInterface arm_group_;
+  ParallelPlanner parallel_planner_;
   ChassisInterface chassis_interface_;
+  moveit::planning_interface::PlanningSceneInterface planning_scene_interface_;
+  PlanningSceneManager scene_manager_;
   ros::Publisher hand_pub_, end_effector_pub_, gimbal_pub_, gpio_pub_, reversal_pub_, planning_result_pub_,
       stone_num_pub_, point_cloud_pub_, ore_rotate_pub_, ore_lift_pub_, gimbal_lift_pub_, extend_arm_f_pub_,
       extend_arm_b_pub_, silver_lifter_pub_, silver_pusher_pub_, silver_rotator_pub_, gold_pusher_pub_,
       gold_lifter_pub_, middle_pitch_pub_;
+  XmlRpc::XmlRpcValue steps_list_, scenes_list_;
   std::unordered_map<std::string, StepQueue> step_queues_;
+  std::mutex queues_mutex_;
+  // Reloaded lists wait here until the running queue finishes
+  XmlRpc::XmlRpcValue pending_steps_list_, pending_scenes_list_;
+  int running_num_{};
+  bool has_pending_reload_{};
+  ros::ServiceServer reload_server_;
   tf2_ros::Buffer tf_;
   tf2_ros::TransformListener tf_listener_;
-  bool is_middleware_control_;
+  // Set while a running queue holds the chassis, read by the control loop
+  std::atomic<bool> is_middleware_control_;
+  bool is_chassis_control_{};
+  ros::Subscriber preload_sub_;
+  std::deque<std::string> preload_list_;
+  std::mutex preload_mutex_;
+  std::condition_variable preload_cv_;
+  bool is_shutdown_{};
+  std::thread warm_up_thread_;
+  std::map<std::string, int> priorities_;
+  ResourceScheduler scheduler_;
+  std::list<Execution> executions_;
+  std::mutex executions_mutex_;
 };
 
 }  // namespace engineer_middleware
@@ -40,8 +40,11 @@
 #include <rm_common/ros_utilities.h>
 #include <tf2_geometry_msgs/tf2_geometry_msgs.h>
 #include <geometry_msgs/Twist.h>
+#include <geometry_msgs/TwistStamped.h>
 #include <std_msgs/Float64.h>
 #include <moveit/move_group_interface/move_group_interface.h>
+#include <moveit/trajectory_processing/time_optimal_trajectory_generation.h>
+#include <tf2_eigen/tf2_eigen.h>
 #include <rm_msgs/GimbalCmd.h>
 #include <rm_msgs/GpioData.h>
 #include <rm_msgs/MultiDofCmd.h>
@@ -49,21 +52,58 @@
 #include <std_msgs/String.h>
 #include <engineer_middleware/chassis_interface.h>
 #include <engineer_middleware/points.h>
+#include <engineer_middleware/parallel_planner.h>
+#include <engineer_middleware/preempt_flag.h>
+#include <engineer_middleware/auto_exchange.h>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <limits>
+#include <thread>
 
 namespace engineer_middleware
 {
+// Interface-independent base, lets a step keep all kinds of motion in one list
+class Motion
+{
+public:
+  virtual ~Motion() = default;
+  virtual bool move() = 0;
+  virtual bool isFinish() = 0;
+  virtual bool checkTimeout(ros::Duration period) = 0;
+  virtual void stop() = 0;
+  virtual double getTimeout() const = 0;
+  // Blocking calls inside move() give up once the flag of the running queue is set
+  void setPreempt(const PreemptFlag* preempt)
+  {
+    preempt_ = preempt;
+  }
+
+protected:
+  bool isPreempted() const
+  {
+    return preempt_ && preempt_->isRequested();
+  }
+  // Returns false if preempted before the end
+  bool sleep(ros::Duration duration) const
+  {
+    if (preempt_)
+      return preempt_->sleep(duration);
+    duration.sleep();
+    return true;
+  }
+  const PreemptFlag* preempt_{};
+};
+
 template <class Interface>
-class MotionBase
+class MotionBase : public Motion
 {
 public:
   MotionBase(XmlRpc::XmlRpcValue& motion, Interface& interface) : interface_(interface)
   {
     time_out_ = xmlRpcGetDouble(motion["common"], "timeout", 3);
   };
-  ~MotionBase() = default;
-  virtual bool move() = 0;
-  virtual bool isFinish() = 0;
-  bool checkTimeout(ros::Duration period)
+  bool checkTimeout(ros::Duration period) override
   {
     if (period.toSec() > time_out_)
     {
@@ -72,7 +112,10 @@ public:
     }
     return true;
   }
-  virtual void stop() = 0;
+  double getTimeout() const override
+  {
+    return time_out_;
+  }
 
 protected:
   Interface& interface_;
@@ -90,6 +133,13 @@ public:
   }
   bool move() override
   {
+    // A plan given up by a preempted motion may still be running, the interface can not be used before it returns
+    std::future<int>& planning = getPlanning();
+    while (planning.valid() && planning.wait_for(std::chrono::microseconds(200)) != std::future_status::ready)
+      if (isPreempted())
+        return false;
+    if (planning.valid())
+      planning.get();
     interface_.setMaxVelocityScalingFactor(speed_);
     interface_.setMaxAccelerationScalingFactor(accel_);
     countdown_ = 5;
@@ -103,22 +153,58 @@ public:
       countdown_ = 5;
     return countdown_ < 0;
   }
+  // Does not wait for a plan given up on preemption, the next move joins it and sets the scaling factors again
   void stop() override
   {
-    interface_.setMaxVelocityScalingFactor(0.);
-    interface_.setMaxAccelerationScalingFactor(0.);
+    std::future<int>& planning = getPlanning();
+    if (!planning.valid() || planning.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+    {
+      interface_.setMaxVelocityScalingFactor(0.);
+      interface_.setMaxAccelerationScalingFactor(0.);
+    }
     interface_.stop();
   }
   std_msgs::Int32 getPlanningResult()
   {
     return msg_;
   }
-  sensor_msgs::PointCloud2 getPointCloud2()
+  sensor_msgs::PointCloud2ConstPtr getPointCloud2()
   {
     return points_.getPointCloud2();
   }
 
 protected:
+  // MoveGroupInterface::plan can not be canceled, so it runs in another thread which the motion stops waiting for on
+  // preemption, the next use of the interface joins it
+  int planPreemptible(moveit::planning_interface::MoveGroupInterface::Plan& plan)
+  {
+    if (isPreempted())
+      return moveit_msgs::MoveItErrorCodes::PREEMPTED;
+    waitPlanning();
+    auto result = std::make_shared<moveit::planning_interface::MoveGroupInterface::Plan>();
+    std::future<int>& planning = getPlanning();
+    // Only the interface is captured, the motion may be destroyed by a reload before a dropped plan returns
+    planning =
+        std::async(std::launch::async, [&interface = interface_, result]() { return interface.plan(*result).val; });
+    while (planning.wait_for(std::chrono::microseconds(200)) != std::future_status::ready)
+      if (isPreempted())
+        return moveit_msgs::MoveItErrorCodes::PREEMPTED;
+    plan = *result;
+    return planning.get();
+  }
+  // Shared by all arm motions, queues using the arm never run at the same time
+  static std::future<int>& getPlanning()
+  {
+    static std::future<int> planning;
+    return planning;
+  }
+  // Blocks until a dropped plan returns, anything else done with the interface meanwhile races with it
+  static void waitPlanning()
+  {
+    std::future<int>& planning = getPlanning();
+    if (planning.valid())
+      planning.get();
+  }
   virtual bool isReachGoal() = 0;
   double speed_, accel_;
   int countdown_{};
@@ -162,7 +248,8 @@ public:
 
   bool move() override
   {
-    MoveitMotionBase::move();
+    if (!MoveitMotionBase::move())
+      return false;
     geometry_msgs::PoseStamped final_target;
     if (!target_.header.frame_id.empty())
     {
@@ -202,7 +289,9 @@ public:
         interface_.setOrientationTarget(final_target.pose.orientation.x, final_target.pose.orientation.y,
                                         final_target.pose.orientation.z, final_target.pose.orientation.w);
       moveit::planning_interface::MoveGroupInterface::Plan plan;
-      msg_.data = interface_.plan(plan).val;
+      msg_.data = planPreemptible(plan);
+      if (msg_.data == moveit_msgs::MoveItErrorCodes::PREEMPTED)
+        return false;
       return interface_.asyncExecute(plan) == moveit::planning_interface::MoveItErrorCode::SUCCESS;
     }
   }
@@ -233,8 +322,8 @@ class SpaceEeMotion : public EndEffectorMotion
 {
 public:
   SpaceEeMotion(XmlRpc::XmlRpcValue& motion, moveit::planning_interface::MoveGroupInterface& interface,
-                tf2_ros::Buffer& tf)
-    : EndEffectorMotion(motion, interface, tf)
+                tf2_ros::Buffer& tf, ParallelPlanner& parallel_planner)
+    : EndEffectorMotion(motion, interface, tf), parallel_planner_(parallel_planner)
   {
     point_resolution_ = xmlRpcGetDouble(motion, "point_resolution", 0.01);
     radius_ = xmlRpcGetDouble(motion, "radius", 0.1);
@@ -243,6 +332,9 @@ public:
       is_refer_planning_frame_ = motion["is_refer_planning_frame"];
     else
       is_refer_planning_frame_ = false;
+    is_parallel_planning_ = motion.hasMember("parallel_planning") && bool(motion["parallel_planning"]);
+    ik_timeout_ = xmlRpcGetDouble(motion, "ik_timeout", 0.005);
+    min_reachability_ = (uint8_t)xmlRpcGetDouble(motion, "min_reachability", 1);
     if (motion.hasMember("spacial_shape"))
     {
       points_.cleanPoints();
@@ -261,94 +353,43 @@ public:
   {
     points_.cleanPoints();
     points_.generateGeometryPoints();
-    MoveitMotionBase::move();
-    int move_times = (int)points_.getPoints().size();
-    for (int i = 0; i < move_times && i < max_planning_times_; ++i)
+    if (!MoveitMotionBase::move())
+      return false;
+    geometry_msgs::TransformStamped base2exchange;
+    if (!target_.header.frame_id.empty() && is_refer_planning_frame_)
     {
-      if (!target_.header.frame_id.empty())
+      try
       {
-        if (!is_refer_planning_frame_)
-        {
-          //            try
-          //            {
-          //              double roll, pitch, yaw, roll_temp, pitch_temp, yaw_temp;
-          //              geometry_msgs::TransformStamped exchange2base;
-          //              exchange2base = tf_.lookupTransform("base_link", target_.header.frame_id, ros::Time(0));
-          //              quatToRPY(exchange2base.transform.rotation, roll_temp, pitch_temp, yaw_temp);
-          //              quatToRPY(target_.pose.orientation, roll, pitch, yaw);
-          //
-          //              tf2::Quaternion tmp_tf_quaternion;
-          //              tmp_tf_quaternion.setRPY(roll, pitch, yaw);
-          //              geometry_msgs::Quaternion quat_tf = tf2::toMsg(tmp_tf_quaternion);
-          //              quatToRPY(quat_tf, roll, pitch, yaw);
-          //              points_.rectifyForRPY(pitch_temp, yaw_temp, k_x_, k_theta_, k_beta_);
-          //              if (link7_length_)
-          //                points_.rectifyForLink7(pitch_temp, link7_length_);
-          //              target_.pose.position.x = points_.getPoints()[i].x;
-          //              target_.pose.position.y = points_.getPoints()[i].y;
-          //              target_.pose.position.z = points_.getPoints()[i].z;
-          //              geometry_msgs::PoseStamped temp_target;
-          //              temp_target.pose.position = target_.pose.position;
-          //              temp_target.pose.orientation = quat_tf;
-          //              tf2::doTransform(temp_target.pose, final_target_.pose,
-          //                               tf_.lookupTransform(interface_.getPlanningFrame(), target_.header.frame_id,
-          //                               ros::Time(0)));
-          //              final_target_.pose.position.x = final_target_.pose.position.x;
-          //              final_target_.pose.position.y = final_target_.pose.position.y;
-          //              final_target_.pose.position.z = final_target_.pose.position.z;
-          //              final_target_.header.frame_id = interface_.getPlanningFrame();
-          //            }
-          //            catch (tf2::TransformException& ex)
-          //            {
-          //              ROS_WARN("%s", ex.what());
-          //              return false;
-          //            }
-        }
-        else
-        {
-          try
-          {
-            double roll, pitch, yaw, roll_temp, pitch_temp, yaw_temp;
-            geometry_msgs::TransformStamped base2exchange;
-            base2exchange = tf_.lookupTransform("base_link", target_.header.frame_id, ros::Time(0));
-            target_.pose.position.x = points_.getPoints()[i].x;
-            target_.pose.position.y = points_.getPoints()[i].y;
-            target_.pose.position.z = points_.getPoints()[i].z;
-            quatToRPY(base2exchange.transform.rotation, roll, pitch, yaw);
-            quatToRPY(target_.pose.orientation, roll_temp, pitch_temp, yaw_temp);
-            quat_base2exchange_.setW(base2exchange.transform.rotation.w);
-            quat_base2exchange_.setX(base2exchange.transform.rotation.x);
-            quat_base2exchange_.setY(base2exchange.transform.rotation.y);
-            quat_base2exchange_.setZ(base2exchange.transform.rotation.z);
-
-            quat_target_.setW(target_.pose.orientation.w);
-            quat_target_.setX(target_.pose.orientation.x);
-            quat_target_.setY(target_.pose.orientation.y);
-            quat_target_.setZ(target_.pose.orientation.z);
-
-            tf2::Quaternion tf_quaternion;
-            tf_quaternion = quat_base2exchange_ * quat_target_;
-
-            final_target_.pose.position.x = base2exchange.transform.translation.x + target_.pose.position.x;
-            final_target_.pose.position.y = base2exchange.transform.translation.y + target_.pose.position.y;
-            final_target_.pose.position.z = base2exchange.transform.translation.z + target_.pose.position.z;
-            final_target_.pose.orientation.w = tf_quaternion.w();
-            final_target_.pose.orientation.x = tf_quaternion.x();
-            final_target_.pose.orientation.y = tf_quaternion.y();
-            final_target_.pose.orientation.z = tf_quaternion.z();
-
-            final_target_.header.frame_id = interface_.getPlanningFrame();
-          }
-          catch (tf2::TransformException& ex)
-          {
-            ROS_WARN("%s", ex.what());
-            return false;
-          }
-        }
+        base2exchange = tf_.lookupTransform("base_link", target_.header.frame_id, ros::Time(0));
+      }
+      catch (tf2::TransformException& ex)
+      {
+        ROS_WARN("%s", ex.what());
+        return false;
+      }
+    }
+    if (is_refer_planning_frame_ && ReachabilityMap::getInstance().isLoaded())
+    {
+      points_.removeUnreachable(ReachabilityMap::getInstance(), base2exchange.transform.translation.x,
+                                base2exchange.transform.translation.y, base2exchange.transform.translation.z,
+                                min_reachability_);
+      if (points_.getPoints().empty())
+      {
+        ROS_WARN("No point is reachable according to reachability map");
+        msg_.data = moveit_msgs::MoveItErrorCodes::NO_IK_SOLUTION;
+        return false;
       }
+    }
+    if (is_parallel_planning_)
+      return moveParallel(base2exchange);
+    int move_times = (int)points_.getPoints().size();
+    for (int i = 0; i < move_times && i < max_planning_times_; ++i)
+    {
+      if (!computeFinalTarget(points_.getPoints()[i], base2exchange, final_target_))
+        return false;
       interface_.setPoseTarget(final_target_);
       moveit::planning_interface::MoveGroupInterface::Plan plan;
-      msg_.data = interface_.plan(plan).val;
+      msg_.data = planPreemptible(plan);
       if (msg_.data == 1)
         return interface_.asyncExecute(plan) == moveit::planning_interface::MoveItErrorCode::SUCCESS;
     }
@@ -356,6 +397,68 @@ public:
   }
 
 private:
+  // The point is an offset from the target frame when the motion refers to the planning frame, otherwise a position
+  // in the target frame, or in the planning frame without one
+  bool computeFinalTarget(const Points::Point& point, const geometry_msgs::TransformStamped& base2exchange,
+                          geometry_msgs::PoseStamped& final_target)
+  {
+    final_target.header.frame_id = interface_.getPlanningFrame();
+    if (!target_.header.frame_id.empty() && is_refer_planning_frame_)
+    {
+      tf2::Quaternion quat_base2exchange, quat_target;
+      tf2::fromMsg(base2exchange.transform.rotation, quat_base2exchange);
+      tf2::fromMsg(target_.pose.orientation, quat_target);
+      final_target.pose.position.x = base2exchange.transform.translation.x + point.x;
+      final_target.pose.position.y = base2exchange.transform.translation.y + point.y;
+      final_target.pose.position.z = base2exchange.transform.translation.z + point.z;
+      final_target.pose.orientation = tf2::toMsg(quat_base2exchange * quat_target);
+      return true;
+    }
+    geometry_msgs::Pose pose;
+    pose.position.x = point.x;
+    pose.position.y = point.y;
+    pose.position.z = point.z;
+    pose.orientation = target_.pose.orientation;
+    if (target_.header.frame_id.empty() || target_.header.frame_id == final_target.header.frame_id)
+    {
+      final_target.pose = pose;
+      return true;
+    }
+    try
+    {
+      tf2::doTransform(pose, final_target.pose,
+                       tf_.lookupTransform(final_target.header.frame_id, target_.header.frame_id, ros::Time(0)));
+    }
+    catch (tf2::TransformException& ex)
+    {
+      ROS_WARN("%s", ex.what());
+      return false;
+    }
+    return true;
+  }
+  // Filter the candidate points by IK and plan the first max_planning_times_ reachable ones at the same time
+  bool moveParallel(const geometry_msgs::TransformStamped& base2exchange)
+  {
+    std::vector<geometry_msgs::PoseStamped> targets(points_.getPoints().size());
+    for (size_t i = 0; i < targets.size(); ++i)
+      if (!computeFinalTarget(points_.getPoints()[i], base2exchange, targets[i]))
+        return false;
+    std::vector<ParallelPlanner::Candidate> candidates =
+        parallel_planner_.filterReachable(targets, max_planning_times_, ik_timeout_);
+    if (candidates.empty())
+    {
+      ROS_WARN("No reachable point in %zu candidates", targets.size());
+      msg_.data = moveit_msgs::MoveItErrorCodes::NO_IK_SOLUTION;
+      return false;
+    }
+    moveit::planning_interface::MoveGroupInterface::Plan plan;
+    size_t best_index = 0;
+    msg_.data = parallel_planner_.planBest(candidates, speed_, accel_, plan, best_index, preempt_);
+    if (msg_.data != moveit_msgs::MoveItErrorCodes::SUCCESS)
+      return false;
+    final_target_ = candidates[best_index].target;
+    return interface_.asyncExecute(plan) == moveit::planning_interface::MoveItErrorCode::SUCCESS;
+  }
   bool isReachGoal() override
   {
     geometry_msgs::Pose pose = interface_.getCurrentPose().pose;
@@ -371,10 +474,12 @@ private:
                     std::abs(angles::shortest_angular_distance(yaw_current, yaw_goal)) <
                 tolerance_orientation_);
   }
-  bool is_refer_planning_frame_;
+  ParallelPlanner& parallel_planner_;
+  bool is_refer_planning_frame_, is_parallel_planning_;
   geometry_msgs::PoseStamped final_target_;
-  tf2::Quaternion quat_base2exchange_, quat_target_;
   int max_planning_times_{};
+  uint8_t min_reachability_{};
+  double ik_timeout_{};
   double radius_, point_resolution_, x_length_, y_length_, z_length_;
 };
 
@@ -408,8 +513,22 @@ public:
     }
     if (motion.hasMember("record_arm2base"))
       record_arm2base_ = bool(motion["record_arm2base"]);
+    if (motion.hasMember("pass_through"))
+      is_pass_through_ = bool(motion["pass_through"]);
+    blend_tolerance_ = xmlRpcGetDouble(motion, "blend_tolerance", 0.1);
   }
   static geometry_msgs::TransformStamped arm2base;
+  bool isPassThrough() const
+  {
+    return is_pass_through_;
+  }
+  // The next motion is planned and executed together with this one, as one trajectory which only stops at the end
+  // of the chain. Its step is started once the arm went by the target of this one.
+  void blend(JointMotion& next)
+  {
+    next_ = &next;
+    next.previous_ = this;
+  }
   bool move() override
   {
     if (record_arm2base_)
@@ -429,28 +548,123 @@ public:
         return false;
       }
     }
-    final_target_.clear();
+    // Already running as part of the trajectory of the first motion of the chain
+    if (previous_)
+      return is_blended_;
     if (target_.empty())
       return false;
-    MoveitMotionBase::move();
+    if (!MoveitMotionBase::move())
+      return false;
+    resolveTarget(interface_.getCurrentJointValues());
+    if (next_)
+      return moveBlended();
+    interface_.setJointValueTarget(final_target_);
+    moveit::planning_interface::MoveGroupInterface::Plan plan;
+    msg_.data = planPreemptible(plan);
+    if (msg_.data == moveit_msgs::MoveItErrorCodes::PREEMPTED)
+      return false;
+    return (interface_.asyncExecute(plan) == moveit::planning_interface::MoveItErrorCode::SUCCESS);
+  }
+  bool isFinish() override
+  {
+    // No countdown at a pass-through target, the arm is not meant to stop there
+    if (next_ && is_blended_)
+      return ros::Time::now() - blend_start_ >= ros::Duration(pass_time_);
+    return MoveitMotionBase::isFinish();
+  }
+
+private:
+  // KEEP joints stay where the previous target left them
+  void resolveTarget(const std::vector<double>& previous)
+  {
+    final_target_.clear();
     for (int i = 0; i < (int)target_.size(); i++)
     {
       if (!std::isnormal(target_[i]))
       {
-        final_target_.push_back(interface_.getCurrentJointValues()[i]);
+        final_target_.push_back(previous[i]);
       }
       else
       {
         final_target_.push_back(target_[i]);
       }
     }
-    interface_.setJointValueTarget(final_target_);
-    moveit::planning_interface::MoveGroupInterface::Plan plan;
-    msg_.data = interface_.plan(plan).val;
-    return (interface_.asyncExecute(plan) == moveit::planning_interface::MoveItErrorCode::SUCCESS);
   }
-
-private:
+  // Plan every segment of the chain from the end of the one before, then parameterize the joined path at once
+  bool moveBlended()
+  {
+    std::vector<JointMotion*> chain;
+    for (JointMotion* motion = this; motion; motion = motion->next_)
+    {
+      motion->is_blended_ = false;
+      chain.push_back(motion);
+    }
+    moveit::core::RobotState state(*interface_.getCurrentState());
+    robot_trajectory::RobotTrajectory trajectory(interface_.getRobotModel(), interface_.getName());
+    for (size_t i = 0; i < chain.size(); ++i)
+    {
+      if (i > 0)
+        chain[i]->resolveTarget(chain[i - 1]->final_target_);
+      interface_.setStartState(state);
+      interface_.setJointValueTarget(chain[i]->final_target_);
+      moveit::planning_interface::MoveGroupInterface::Plan plan;
+      msg_.data = planPreemptible(plan);
+      if (msg_.data != moveit_msgs::MoveItErrorCodes::SUCCESS)
+      {
+        // A preempted segment may still be planning from the start state set above
+        waitPlanning();
+        interface_.setStartStateToCurrentState();
+        return false;
+      }
+      robot_trajectory::RobotTrajectory segment(interface_.getRobotModel(), interface_.getName());
+      segment.setRobotTrajectoryMsg(state, plan.trajectory_);
+      // The first point of a segment is the last one of the segment before
+      trajectory.append(segment, 0., i > 0 ? 1 : 0);
+      state = segment.getLastWayPoint();
+    }
+    interface_.setStartStateToCurrentState();
+    trajectory_processing::TimeOptimalTrajectoryGeneration totg(blend_tolerance_);
+    if (!totg.computeTimeStamps(trajectory, speed_, accel_))
+    {
+      ROS_WARN("Time parameterization of the blended trajectory failed");
+      return false;
+    }
+    // The path is rounded off at the targets, a target is passed at the closest point after the previous one
+    const moveit::core::JointModelGroup* group = interface_.getRobotModel()->getJointModelGroup(interface_.getName());
+    size_t index = 0;
+    std::vector<double> positions;
+    for (JointMotion* motion : chain)
+    {
+      double min_distance = std::numeric_limits<double>::max();
+      for (size_t i = index; i < trajectory.getWayPointCount(); ++i)
+      {
+        trajectory.getWayPoint(i).copyJointGroupPositions(group, positions);
+        double distance = 0.;
+        for (size_t j = 0; j < positions.size() && j < motion->final_target_.size(); ++j)
+          distance += std::pow(positions[j] - motion->final_target_[j], 2);
+        if (distance < min_distance)
+        {
+          min_distance = distance;
+          index = i;
+        }
+      }
+      motion->pass_time_ = trajectory.getWayPointDurationFromStart(index);
+    }
+    moveit_msgs::RobotTrajectory msg;
+    trajectory.getRobotTrajectoryMsg(msg);
+    if (interface_.asyncExecute(msg) != moveit::planning_interface::MoveItErrorCode::SUCCESS)
+      return false;
+    ros::Time start = ros::Time::now();
+    for (JointMotion* motion : chain)
+    {
+      motion->blend_start_ = start;
+      motion->countdown_ = 5;
+      motion->msg_ = msg_;
+      motion->is_blended_ = true;
+    }
+    ROS_INFO("Blend %zu joint motions into a trajectory of %f s", chain.size(), trajectory.getDuration());
+    return true;
+  }
   bool isReachGoal() override
   {
     std::vector<double> current = interface_.getCurrentJointValues();
@@ -469,6 +683,10 @@ private:
   std::vector<double> target_, final_target_, tolerance_joints_;
   bool record_arm2base_{ false };
   tf2_ros::Buffer& tf_buffer_;
+  bool is_pass_through_{}, is_blended_{};
+  double blend_tolerance_{}, pass_time_{};
+  JointMotion *previous_{}, *next_{};
+  ros::Time blend_start_;
 };
 
 template <class MsgType>
@@ -690,12 +908,18 @@ public:
     interface_.publish(msg_);
     if (msg_.mode == msg_.POSITION)
     {
-      ros::Duration(0.2).sleep();
+      bool is_slept = sleep(ros::Duration(0.2));
       ReversalMotion::setZero();
       interface_.publish(zero_msg_);
+      return is_slept;
     }
     return true;
   }
+  void stop() override
+  {
+    ReversalMotion::setZero();
+    interface_.publish(zero_msg_);
+  }
   bool isFinish() override
   {
     return ((ros::Time::now() - start_time_).toSec() > delay_);
@@ -777,10 +1001,16 @@ public:
       geometry_msgs::Quaternion quat_msg = tf2::toMsg(quat_tf);
       target_.pose.orientation = quat_msg;
     }
+    // Follow a time optimal trajectory under these limits instead of servoing straight to the goal
+    if (motion.hasMember("trajectory"))
+    {
+      limits_ = ChassisLimits(motion["trajectory"]);
+      is_trajectory_ = true;
+    }
   }
   bool move() override
   {
-    interface_.setGoal(target_);
+    setGoal();
     return true;
   }
   bool isFinish() override
@@ -794,8 +1024,18 @@ public:
   }
 
 protected:
+  void setGoal()
+  {
+    if (is_trajectory_)
+      interface_.setGoal(target_, limits_);
+    else
+      interface_.setGoal(target_);
+  }
+
   geometry_msgs::PoseStamped target_;
   double chassis_tolerance_position_, chassis_tolerance_angular_;
+  ChassisLimits limits_;
+  bool is_trajectory_{ false };
 };
 
 class ChassisTargetMotion : public ChassisMotion
@@ -830,7 +1070,7 @@ public:
         quat_tf.setRPY(0, 0, 0);
         geometry_msgs::Quaternion quat_msg = tf2::toMsg(quat_tf);
         target_.pose.orientation = quat_msg;
-        interface_.setGoal(target_);
+        setGoal();
         return true;
       }
       catch (tf2::TransformException& ex)
@@ -858,7 +1098,7 @@ public:
         quat_tf.setRPY(0, 0, yaw * yaw_scale_);
         geometry_msgs::Quaternion quat_msg = tf2::toMsg(quat_tf);
         target_.pose.orientation = quat_msg;
-        interface_.setGoal(target_);
+        setGoal();
         return true;
       }
       catch (tf2::TransformException& ex)
@@ -967,7 +1207,16 @@ public:
 
   bool move() override
   {
-    MoveitMotionBase::move();
+    moveit::planning_interface::MoveGroupInterface::Plan plan;
+    if (!this->plan(plan))
+      return false;
+    return interface_.asyncExecute( plan ) == moveit::planning_interface::MoveItErrorCode::SUCCESS;
+  }
+  // Plans the approach without executing it, for callers which play it back themselves
+  bool plan(moveit::planning_interface::MoveGroupInterface::Plan& plan)
+  {
+    if (!MoveitMotionBase::move())
+      return false;
     if ( !target_mid_.header.frame_id.empty() )
     {
       try
@@ -1000,9 +1249,8 @@ public:
     targets.push_back( plan_target_final_ );
     targets.push_back( plan_target_mid_ );
     interface_.setPoseTargets( targets );
-    moveit::planning_interface::MoveGroupInterface::Plan plan;
-    msg_.data = interface_.plan( plan ).val;
-    return interface_.asyncExecute( plan ) == moveit::planning_interface::MoveItErrorCode::SUCCESS;
+    msg_.data = planPreemptible( plan );
+    return msg_.data == moveit_msgs::MoveItErrorCodes::SUCCESS;
   }
 protected:
   bool isReachGoal() override
@@ -1026,4 +1274,286 @@ protected:
   double tolerance_position_, tolerance_orientation_;
   bool has_p1_, has_p2_;
 };
+
+// Runs the auto_exchange::AutoExchange state machine on its own thread at a fixed rate: the gimbal searches, the
+// chassis pre-adjusts, then the arm approaches and is servoed by MoveIt Servo. Its config lives in the param namespace
+// named by "config", since the pids of the state machines are read from the param server.
+class AutoExchangeServoMotion : public MotionBase<moveit::planning_interface::MoveGroupInterface>
+{
+public:
+  AutoExchangeServoMotion(XmlRpc::XmlRpcValue& motion, moveit::planning_interface::MoveGroupInterface& interface,
+                          tf2_ros::Buffer& tf, ChassisInterface& chassis_interface, ros::Publisher& gimbal_pub)
+    : MotionBase<moveit::planning_interface::MoveGroupInterface>(motion, interface)
+    , chassis_interface_(chassis_interface)
+    , gimbal_pub_(gimbal_pub)
+  {
+    ros::NodeHandle nh(ros::NodeHandle("~"), std::string(motion["config"]));
+    XmlRpc::XmlRpcValue config;
+    if (!nh.getParam(nh.getNamespace(), config) || config.getType() != XmlRpc::XmlRpcValue::TypeStruct)
+      ROS_ERROR("No auto exchange config in %s", nh.getNamespace().c_str());
+    auto_exchange_ = std::make_unique<auto_exchange::AutoExchange>(config, tf, nh);
+    rate_ = xmlRpcGetDouble(motion, "rate", 100.);
+    servo_frame_ = motion.hasMember("servo_frame") ? std::string(motion["servo_frame"]) : "tools_link";
+    auto_exchange_->union_move_->setServoFrame(servo_frame_);
+    servo_pub_ = nh.advertise<geometry_msgs::TwistStamped>(
+        motion.hasMember("servo_topic") ? std::string(motion["servo_topic"]) : "/servo_server/delta_twist_cmds", 1);
+    // The planned approach before servoing, configured like a planned auto_exchange motion
+    if (motion.hasMember("approach"))
+      approach_ = std::make_unique<AutoExchangeMotion>(motion["approach"], interface, tf);
+    // Plays the approach back through the servo with the residual of the union move on top, instead of executing it
+    if (motion.hasMember("feed_forward"))
+      is_feed_forward_ = bool(motion["feed_forward"]);
+  }
+  ~AutoExchangeServoMotion() override
+  {
+    join();
+  }
+  bool move() override
+  {
+    join();
+    auto_exchange_->init();
+    state_ = RUNNING;
+    last_process_ = -1;
+    overruns_ = 0;
+    lookup_failures_ = 0;
+    reference_.reset();
+    starting_ = std::future<bool>();
+    if (approach_)
+      approach_->setPreempt(preempt_);
+    is_running_ = true;
+    thread_ = std::thread(&AutoExchangeServoMotion::loop, this);
+    return true;
+  }
+  bool isFinish() override
+  {
+    return state_ == SUCCEEDED;
+  }
+  bool checkTimeout(ros::Duration period) override
+  {
+    if (state_ == FAILED)
+    {
+      ROS_ERROR("Auto exchange failed");
+      return false;
+    }
+    return MotionBase::checkTimeout(period);
+  }
+  void stop() override
+  {
+    join();
+    halt();
+  }
+
+private:
+  enum State
+  {
+    RUNNING,
+    SUCCEEDED,
+    FAILED
+  };
+
+  void join()
+  {
+    is_running_ = false;
+    if (thread_.joinable())
+      thread_.join();
+  }
+  // Ticks are kept on a steady grid, a late tick is followed by the next one on the grid instead of a burst
+  void loop()
+  {
+    auto period =
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1. / rate_));
+    auto next = std::chrono::steady_clock::now();
+    while (is_running_ && !isPreempted() && ros::ok())
+    {
+      if (!tick())
+        break;
+      next += period;
+      auto now = std::chrono::steady_clock::now();
+      if (next < now)
+      {
+        overruns_++;
+        next += (now - next) / period * period + period;
+      }
+      std::this_thread::sleep_until(next);
+    }
+    halt();
+    if (overruns_)
+      ROS_WARN("Auto exchange loop missed %d ticks of %f s", overruns_, 1. / rate_);
+    if (lookup_failures_)
+      ROS_WARN("Auto exchange loop skipped %d ticks without a transform", lookup_failures_);
+  }
+  bool tick()
+  {
+    // A missing transform, e.g. no exchanger in the filter yet, skips the tick and the outputs are held. The timeout
+    // of the step ends a loop which never gets one.
+    try
+    {
+      auto_exchange_->run();
+    }
+    catch (tf2::TransformException& ex)
+    {
+      ROS_WARN_THROTTLE(1., "%s", ex.what());
+      lookup_failures_++;
+      return true;
+    }
+    if (auto_exchange_->getFinishFlag())
+    {
+      state_ = auto_exchange_->getSuccessFlag() ? SUCCEEDED : FAILED;
+      return false;
+    }
+    int process = auto_exchange_->getProcess();
+    if (process != last_process_)
+      halt();
+    last_process_ = process;
+    switch (process)
+    {
+      case auto_exchange::AutoExchange::FIND:
+      {
+        std::vector<double> scale = auto_exchange_->find_->getGimbalScale();
+        publishGimbal(scale[0], scale[1]);
+      }
+      break;
+      case auto_exchange::AutoExchange::PRE_ADJUST:
+        chassis_interface_.setVel(auto_exchange_->pre_adjusted_->getChassisVelMsg());
+        break;
+      case auto_exchange::AutoExchange::MOVE:
+        moveUnion();
+        break;
+    }
+    return true;
+  }
+  void moveUnion()
+  {
+    auto_exchange::UnionMove* union_move = auto_exchange_->union_move_.get();
+    if (!union_move->getIsMotionStart())
+    {
+      union_move->changeIsMotionStart(true);
+      // The approach is planned beside the loop, which keeps ticking at its rate meanwhile. The state machine is
+      // only touched by the loop, the reference is started once the plan is there.
+      if (approach_)
+        starting_ = std::async(std::launch::async, [this]() {
+          return is_feed_forward_ ? approach_->plan(approach_plan_) : approach_->move();
+        });
+    }
+    if (starting_.valid())
+    {
+      if (starting_.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        return;
+      if (!starting_.get() || (is_feed_forward_ && !startReference(*union_move)))
+      {
+        ROS_ERROR("Auto exchange approach failed");
+        state_ = FAILED;
+        is_running_ = false;
+        return;
+      }
+    }
+    if (!union_move->getIsMotionFinish())
+    {
+      if (reference_)
+      {
+        auto_exchange::Vector6d twist;
+        Eigen::Isometry3d next;
+        if (sampleReference((ros::Time::now() - reference_start_).toSec(), twist, next))
+        {
+          // The residual is computed at the next tick, when the tool should be at next
+          union_move->setReference(tf2::eigenToTransform(next).transform);
+          publishServo(twist + union_move->getServoScale());
+          return;
+        }
+        reference_.reset();
+        union_move->changeIsMotionFinish(true);
+      }
+      else
+      {
+        if (!approach_ || approach_->isFinish())
+          union_move->changeIsMotionFinish(true);
+        return;
+      }
+    }
+    publishServo(union_move->getServoScale());
+  }
+  bool startReference(auto_exchange::UnionMove& union_move)
+  {
+    const moveit::planning_interface::MoveGroupInterface::Plan& plan = approach_plan_;
+    const moveit::core::RobotModelConstPtr& model = interface_.getRobotModel();
+    // Link transforms are in the model frame, which is the planning frame of the group
+    if (!model->hasLinkModel(servo_frame_) || !union_move.startReference(model->getModelFrame()))
+    {
+      ROS_WARN("Can not play the approach back, executing it");
+      return interface_.asyncExecute(plan) == moveit::planning_interface::MoveItErrorCode::SUCCESS;
+    }
+    moveit::core::RobotStatePtr state = interface_.getCurrentState();
+    reference_ = std::make_unique<robot_trajectory::RobotTrajectory>(model, interface_.getName());
+    reference_->setRobotTrajectoryMsg(*state, plan.trajectory_);
+    reference_state_ = std::make_shared<moveit::core::RobotState>(*state);
+    reference_start_ = ros::Time::now();
+    return true;
+  }
+  // Twist of the servo frame along the reference at time, in that frame, and its pose one tick later
+  bool sampleReference(double time, auto_exchange::Vector6d& twist, Eigen::Isometry3d& next)
+  {
+    double duration = reference_->getDuration(), step = 1. / rate_;
+    if (time >= duration)
+      return false;
+    reference_->getStateAtDurationFromStart(time, reference_state_);
+    Eigen::Isometry3d current = reference_state_->getGlobalLinkTransform(servo_frame_);
+    reference_->getStateAtDurationFromStart(std::min(time + step, duration), reference_state_);
+    next = reference_state_->getGlobalLinkTransform(servo_frame_);
+    Eigen::Isometry3d delta = current.inverse() * next;
+    Eigen::AngleAxisd rotation(delta.rotation());
+    twist << delta.translation() / step, rotation.angle() * rotation.axis() / step;
+    return true;
+  }
+  void publishGimbal(double yaw, double pitch)
+  {
+    rm_msgs::GimbalCmd msg;
+    msg.mode = msg.RATE;
+    msg.rate_yaw = yaw;
+    msg.rate_pitch = pitch;
+    gimbal_pub_.publish(msg);
+  }
+  void publishServo(const auto_exchange::Vector6d& twist)
+  {
+    geometry_msgs::TwistStamped msg;
+    msg.header.stamp = ros::Time::now();
+    msg.header.frame_id = servo_frame_;
+    msg.twist.linear.x = twist[0];
+    msg.twist.linear.y = twist[1];
+    msg.twist.linear.z = twist[2];
+    msg.twist.angular.x = twist[3];
+    msg.twist.angular.y = twist[4];
+    msg.twist.angular.z = twist[5];
+    servo_pub_.publish(msg);
+  }
+  // Zero every command, each phase only commands its own actuators
+  void halt()
+  {
+    // The approach can not be stopped while it is still being planned
+    if (starting_.valid())
+      starting_.wait();
+    publishGimbal(0., 0.);
+    chassis_interface_.stop();
+    publishServo(auto_exchange::Vector6d::Zero());
+    if (approach_)
+      approach_->stop();
+  }
+
+  std::unique_ptr<auto_exchange::AutoExchange> auto_exchange_;
+  std::unique_ptr<AutoExchangeMotion> approach_;
+  std::unique_ptr<robot_trajectory::RobotTrajectory> reference_;
+  moveit::core::RobotStatePtr reference_state_;
+  ros::Time reference_start_;
+  std::future<bool> starting_;
+  moveit::planning_interface::MoveGroupInterface::Plan approach_plan_;
+  bool is_feed_forward_{};
+  ChassisInterface& chassis_interface_;
+  ros::Publisher& gimbal_pub_;
+  ros::Publisher servo_pub_;
+  std::string servo_frame_;
+  double rate_{};
+  std::thread thread_;
+  std::atomic<bool> is_running_{ false };
+  std::atomic<int> state_{ RUNNING };
+  int last_process_{ -1 }, overruns_{}, lookup_failures_{};
+};
 };  // namespace engineer_middleware
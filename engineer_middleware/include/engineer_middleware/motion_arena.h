@@ -0,0 +1,79 @@
+//
+// Created by agent on 26-10-18.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace engineer_middleware
+{
+// Owns all motions of a step queue in a few contiguous blocks, they are destroyed together with the queue.
+// Objects never move, so steps can keep plain pointers to them even after the arena itself is moved.
+class MotionArena
+{
+public:
+  static constexpr size_t BLOCK_SIZE = 16 * 1024;
+  MotionArena() = default;
+  MotionArena(const MotionArena&) = delete;
+  MotionArena& operator=(const MotionArena&) = delete;
+  MotionArena(MotionArena&& other) noexcept
+    : blocks_(std::move(other.blocks_))
+    , objects_(std::move(other.objects_))
+    , used_(other.used_)
+    , size_(other.size_)
+    , bytes_(other.bytes_)
+  {
+    other.objects_.clear();
+    other.used_ = other.size_ = other.bytes_ = 0;
+  }
+  MotionArena& operator=(MotionArena&&) = delete;
+  ~MotionArena()
+  {
+    for (auto it = objects_.rbegin(); it != objects_.rend(); ++it)
+      it->second(it->first);
+  }
+
+  template <class T, class... Args>
+  T* create(Args&&... args)
+  {
+    static_assert(alignof(T) <= alignof(std::max_align_t), "Over-aligned motion");
+    T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    objects_.emplace_back(object, [](void* p) { static_cast<T*>(p)->~T(); });
+    return object;
+  }
+  size_t getBytes() const
+  {
+    return bytes_;
+  }
+  size_t getSize() const
+  {
+    return objects_.size();
+  }
+
+private:
+  void* allocate(size_t bytes, size_t align)
+  {
+    size_t offset = (used_ + align - 1) & ~(align - 1);
+    if (blocks_.empty() || offset + bytes > size_)
+    {
+      // Blocks from new[] are aligned for any fundamental type, so offsets only need aligning inside a block
+      size_ = bytes > BLOCK_SIZE ? bytes : BLOCK_SIZE;
+      blocks_.emplace_back(new char[size_]);
+      bytes_ += size_;
+      offset = 0;
+    }
+    used_ = offset + bytes;
+    return blocks_.back().get() + offset;
+  }
+
+  std::vector<std::unique_ptr<char[]>> blocks_;
+  std::vector<std::pair<void*, void (*)(void*)>> objects_;
+  size_t used_{}, size_{}, bytes_{};
+};
+
+}  // namespace engineer_middleware
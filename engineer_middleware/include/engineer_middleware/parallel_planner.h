@@ -0,0 +1,166 @@
+//
+// Created by agent on 26-10-18.
+//
+
+#pragma once
+
+#include <future>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <moveit/move_group_interface/move_group_interface.h>
+#include <moveit/planning_pipeline/planning_pipeline.h>
+#include <moveit/planning_scene_monitor/planning_scene_monitor.h>
+#include <moveit/kinematic_constraints/utils.h>
+#include <moveit/robot_state/conversions.h>
+
+#include "engineer_middleware/preempt_flag.h"
+
+namespace engineer_middleware
+{
+// Plans several candidate targets of one group at the same time with an in-process planning pipeline, instead of
+// calling the blocking MoveGroupInterface::plan once per candidate. The middleware owns one next to the move group
+// interface it plans for.
+class ParallelPlanner
+{
+public:
+  struct Candidate
+  {
+    geometry_msgs::PoseStamped target;
+    std::vector<double> joints;
+  };
+
+  explicit ParallelPlanner(moveit::planning_interface::MoveGroupInterface& interface) : interface_(interface)
+  {
+  }
+
+  // Keep the first max_num targets which have an IK solution out of collision, in the given order
+  std::vector<Candidate> filterReachable(const std::vector<geometry_msgs::PoseStamped>& targets, size_t max_num,
+                                         double ik_timeout)
+  {
+    load();
+    std::vector<Candidate> candidates;
+    moveit::core::RobotStatePtr current = interface_.getCurrentState();
+    if (!current)
+      return candidates;
+    planning_scene::PlanningScenePtr scene = cloneScene(*current);
+    moveit::core::GroupStateValidityCallbackFn is_collision_free =
+        [&scene](moveit::core::RobotState* state, const moveit::core::JointModelGroup* group, const double* values) {
+          state->setJointGroupPositions(group, values);
+          return !scene->isStateColliding(*state, group->getName());
+        };
+    const moveit::core::JointModelGroup* group = current->getJointModelGroup(interface_.getName());
+    moveit::core::RobotState state(*current);
+    for (const auto& target : targets)
+    {
+      state = *current;
+      if (!state.setFromIK(group, target.pose, interface_.getEndEffectorLink(), ik_timeout, is_collision_free))
+        continue;
+      candidates.push_back({ target, {} });
+      state.copyJointGroupPositions(group, candidates.back().joints);
+      if (candidates.size() >= max_num)
+        break;
+    }
+    return candidates;
+  }
+
+  // Plan all candidates concurrently and return the fastest valid trajectory, the result is a MoveItErrorCodes value.
+  // A preempt request terminates the planners.
+  int planBest(const std::vector<Candidate>& candidates, double speed, double accel,
+               moveit::planning_interface::MoveGroupInterface::Plan& plan, size_t& best_index,
+               const PreemptFlag* preempt = nullptr)
+  {
+    load();
+    moveit::core::RobotStatePtr current = interface_.getCurrentState();
+    if (!current || candidates.empty())
+      return moveit_msgs::MoveItErrorCodes::FAILURE;
+    planning_scene::PlanningSceneConstPtr const_scene = cloneScene(*current);
+
+    const moveit::core::JointModelGroup* group = current->getJointModelGroup(interface_.getName());
+    std::vector<std::future<planning_interface::MotionPlanResponse>> results;
+    for (const auto& candidate : candidates)
+    {
+      planning_interface::MotionPlanRequest req;
+      req.group_name = interface_.getName();
+      req.planner_id = interface_.getPlannerId();
+      req.num_planning_attempts = 1;
+      req.allowed_planning_time = interface_.getPlanningTime();
+      req.max_velocity_scaling_factor = speed;
+      req.max_acceleration_scaling_factor = accel;
+      moveit::core::robotStateToRobotStateMsg(*current, req.start_state);
+      moveit::core::RobotState goal_state(*current);
+      goal_state.setJointGroupPositions(group, candidate.joints);
+      req.goal_constraints.push_back(kinematic_constraints::constructGoalConstraints(goal_state, group));
+      results.push_back(std::async(std::launch::async, [this, const_scene, req]() {
+        planning_interface::MotionPlanResponse res;
+        pipeline_->generatePlan(const_scene, req, res);
+        return res;
+      }));
+    }
+
+    if (preempt)
+    {
+      for (const auto& result : results)
+        while (result.wait_for(std::chrono::microseconds(200)) != std::future_status::ready)
+          if (preempt->isRequested())
+          {
+            pipeline_->terminate();
+            for (const auto& other : results)
+              other.wait();
+            return moveit_msgs::MoveItErrorCodes::PREEMPTED;
+          }
+    }
+    int error_code = moveit_msgs::MoveItErrorCodes::PLANNING_FAILED;
+    double best_duration = std::numeric_limits<double>::max();
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+      planning_interface::MotionPlanResponse res = results[i].get();
+      if (res.error_code_.val != moveit_msgs::MoveItErrorCodes::SUCCESS || !res.trajectory_)
+        continue;
+      if (res.trajectory_->getDuration() < best_duration)
+      {
+        best_duration = res.trajectory_->getDuration();
+        best_index = i;
+        res.trajectory_->getRobotTrajectoryMsg(plan.trajectory_);
+        moveit::core::robotStateToRobotStateMsg(res.trajectory_->getFirstWayPoint(), plan.start_state_);
+        plan.planning_time_ = res.planning_time_;
+        error_code = moveit_msgs::MoveItErrorCodes::SUCCESS;
+      }
+    }
+    return error_code;
+  }
+
+private:
+  // A copy of the monitored scene at the given state, the planners and the IK checks do not hold its lock
+  planning_scene::PlanningScenePtr cloneScene(const moveit::core::RobotState& current)
+  {
+    planning_scene::PlanningScenePtr scene;
+    {
+      planning_scene_monitor::LockedPlanningSceneRO locked_scene(scene_monitor_);
+      scene = planning_scene::PlanningScene::clone(locked_scene);
+    }
+    scene->setCurrentState(current);
+    return scene;
+  }
+  // Loading the pipeline is expensive, it happens on the first use by a step which enables parallel planning
+  void load()
+  {
+    std::call_once(load_flag_, [this]() {
+      scene_monitor_ = std::make_shared<planning_scene_monitor::PlanningSceneMonitor>("robot_description");
+      scene_monitor_->startSceneMonitor("/move_group/monitored_planning_scene");
+      scene_monitor_->requestPlanningSceneState("/get_planning_scene");
+      // Reuse the planner configuration loaded for move_group
+      pipeline_ = std::make_shared<planning_pipeline::PlanningPipeline>(
+          scene_monitor_->getRobotModel(), ros::NodeHandle("/move_group"), "planning_plugin", "request_adapters");
+    });
+  }
+
+  moveit::planning_interface::MoveGroupInterface& interface_;
+  std::once_flag load_flag_;
+  planning_scene_monitor::PlanningSceneMonitorPtr scene_monitor_;
+  planning_pipeline::PlanningPipelinePtr pipeline_;
+};
+
+}  // namespace engineer_middleware
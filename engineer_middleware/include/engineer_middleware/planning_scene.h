@@ -6,14 +6,17 @@
 
 #include <moveit/planning_scene_interface/planning_scene_interface.h>
 #include <moveit/move_group_interface/move_group_interface.h>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace engineer_middleware
 {
 class PlanningScene
 {
 public:
-  PlanningScene(const XmlRpc::XmlRpcValue& scene, moveit::planning_interface::MoveGroupInterface& arm_group)
-    : arm_group_(arm_group)
+  explicit PlanningScene(const XmlRpc::XmlRpcValue& scene)
   {
     for (int i = 0; i < scene.size(); i++)
     {
@@ -76,22 +79,144 @@ public:
     return pose;
   }
 
-  void add()
+  const std::vector<moveit_msgs::CollisionObject>& getCollisionObjects() const
   {
-    for (long unsigned int i = 0; i < collision_objects_.size(); i++)
-      collision_objects_[i].operation = collision_objects_[i].ADD;
-    planning_scene_interface_.addCollisionObjects(collision_objects_);
-    if (is_attached_)
+    return collision_objects_;
+  }
+  // Only the first object is attached, to the link named by its frame
+  bool isAttached() const
+  {
+    return is_attached_ && !collision_objects_.empty();
+  }
+
+private:
+  std::vector<moveit_msgs::CollisionObject> collision_objects_;
+  bool is_attached_{ false };
+};
+
+// Keeps track of the objects the middleware put into the world, and changes the world to another scene by sending
+// only the difference in one planning scene diff. Objects framed on a moving frame, like the exchanger, are resolved
+// by move_group when they arrive, so they are sent again on every apply.
+class PlanningSceneManager
+{
+public:
+  PlanningSceneManager(moveit::planning_interface::PlanningSceneInterface& planning_scene_interface,
+                       const std::string& planning_frame)
+    : planning_scene_interface_(planning_scene_interface), planning_frame_(planning_frame)
+  {
+  }
+  void setScenes(const XmlRpc::XmlRpcValue& scenes)
+  {
+    ROS_ASSERT(scenes.getType() == XmlRpc::XmlRpcValue::Type::TypeStruct);
+    scenes_ = scenes;
+    built_scenes_.clear();
+  }
+  bool hasScene(const std::string& name) const
+  {
+    return scenes_.hasMember(name);
+  }
+  void apply(const std::string& name)
+  {
+    if (!hasScene(name))
+      return;
+    // Objects of a scene are only built when a step uses it for the first time
+    auto built_scene = built_scenes_.find(name);
+    if (built_scene == built_scenes_.end())
+      built_scene = built_scenes_.emplace(name, PlanningScene(scenes_[name])).first;
+    const PlanningScene& scene = built_scene->second;
+    std::map<std::string, moveit_msgs::CollisionObject> targets;
+    for (auto object : scene.getCollisionObjects())
     {
-      std::cout << planning_scene_interface_.getAttachedObjects().size() << std::endl;
-      arm_group_.attachObject(collision_objects_[0].id, collision_objects_[0].header.frame_id);
+      object.operation = object.ADD;
+      targets[object.id] = object;
     }
+    std::string attached_id = scene.isAttached() ? scene.getCollisionObjects()[0].id : "";
+
+    moveit_msgs::PlanningScene diff;
+    for (auto it = objects_.begin(); it != objects_.end();)
+    {
+      auto target = targets.find(it->first);
+      bool unchanged = target != targets.end() && target->second == it->second &&
+                       (it->first == attached_id_) == (it->first == attached_id);
+      if (unchanged)
+      {
+        if (it->first != attached_id && it->second.header.frame_id != planning_frame_)
+          add(it->second, false, diff);
+        ++it;
+      }
+      else
+      {
+        // An object which stays in the scene is replaced by its add, or taken out of the world by its attach
+        remove(it->second, target == targets.end(), diff);
+        it = objects_.erase(it);
+      }
+    }
+    for (const auto& target : targets)
+    {
+      if (objects_.count(target.first))
+        continue;
+      add(target.second, target.first == attached_id, diff);
+      objects_.insert(target);
+    }
+    attached_id_ = attached_id;
+    send(diff);
+  }
+  void clear()
+  {
+    moveit_msgs::PlanningScene diff;
+    for (const auto& object : objects_)
+      remove(object.second, true, diff);
+    objects_.clear();
+    attached_id_.clear();
+    send(diff);
   }
 
-  moveit::planning_interface::PlanningSceneInterface planning_scene_interface_;
-  moveit::planning_interface::MoveGroupInterface& arm_group_;
-  std::vector<moveit_msgs::CollisionObject> collision_objects_;
-  bool is_attached_;
+private:
+  void add(const moveit_msgs::CollisionObject& object, bool attach, moveit_msgs::PlanningScene& diff)
+  {
+    if (attach)
+    {
+      moveit_msgs::AttachedCollisionObject attached_object;
+      attached_object.link_name = object.header.frame_id;
+      attached_object.object = object;
+      diff.robot_state.attached_collision_objects.push_back(attached_object);
+    }
+    else
+      diff.world.collision_objects.push_back(object);
+  }
+  void remove(const moveit_msgs::CollisionObject& object, bool from_world, moveit_msgs::PlanningScene& diff)
+  {
+    if (object.id == attached_id_)
+    {
+      // Detach puts the object back to the world, and the removal below takes it away unless it stays there
+      moveit_msgs::AttachedCollisionObject attached_object;
+      attached_object.link_name = object.header.frame_id;
+      attached_object.object.id = object.id;
+      attached_object.object.operation = attached_object.object.REMOVE;
+      diff.robot_state.attached_collision_objects.push_back(attached_object);
+    }
+    if (!from_world)
+      return;
+    moveit_msgs::CollisionObject removed;
+    removed.header.frame_id = object.header.frame_id;
+    removed.id = object.id;
+    removed.operation = removed.REMOVE;
+    diff.world.collision_objects.push_back(removed);
+  }
+  void send(moveit_msgs::PlanningScene& diff)
+  {
+    if (diff.world.collision_objects.empty() && diff.robot_state.attached_collision_objects.empty())
+      return;
+    diff.is_diff = true;
+    diff.robot_state.is_diff = true;
+    planning_scene_interface_.applyPlanningScene(diff);
+  }
+
+  moveit::planning_interface::PlanningSceneInterface& planning_scene_interface_;
+  XmlRpc::XmlRpcValue scenes_;
+  std::unordered_map<std::string, PlanningScene> built_scenes_;
+  std::map<std::string, moveit_msgs::CollisionObject> objects_;
+  std::string planning_frame_, attached_id_;
 };
 
 }  // namespace engineer_middleware
@@ -0,0 +1,124 @@
+//
+// Created by agent on 26-10-18.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <vector>
+
+namespace engineer_middleware
+{
+// Velocity response of one axis to its velocity command: a first order lag with dead time,
+// v' = (gain * u(t - delay) - v) / tau. The default is an ideal axis, the position is then a plain integrator.
+struct Plant
+{
+  double gain{ 1. }, tau{}, delay{};
+  // Mean squared velocity error of the identification, negative when the axis had no excitation
+  double fit{ -1. };
+};
+
+class PlantAxis
+{
+public:
+  PlantAxis(const Plant& plant, double dt)
+    : gain_(plant.gain)
+    , alpha_(plant.tau > 0. ? 1. - std::exp(-dt / plant.tau) : 1.)
+    , queue_((size_t)std::round(plant.delay / dt), 0.)
+  {
+  }
+  double step(double command)
+  {
+    queue_.push_back(command);
+    double delayed = queue_.front();
+    queue_.pop_front();
+    vel_ += alpha_ * (gain_ * delayed - vel_);
+    return vel_;
+  }
+
+private:
+  double gain_, alpha_, vel_{};
+  std::deque<double> queue_;
+};
+
+// Contiguous samples of one axis at a fixed period, starting at rest
+struct PlantSegment
+{
+  std::vector<double> command, velocity;
+};
+
+// Grid search of the delay and tau, the gain of each pair is the least squares one
+inline Plant identifyPlant(const std::vector<PlantSegment>& segments, double dt, double max_delay = 0.3,
+                           double max_tau = 1.)
+{
+  Plant best;
+  double excitation = 0.;
+  for (const auto& segment : segments)
+    for (double command : segment.command)
+      excitation += command * command;
+  if (excitation < 1e-9)
+    return best;
+  for (int delay = 0; delay * dt <= max_delay; ++delay)
+  {
+    // Log spaced from one period, tau 0 is the same as tau of a small fraction of the period
+    for (double tau = dt; tau <= max_tau * 1.0001; tau *= 1.25)
+    {
+      Plant plant;
+      plant.tau = tau;
+      plant.delay = delay * dt;
+      double yy = 0., yv = 0., vv = 0.;
+      for (const auto& segment : segments)
+      {
+        PlantAxis axis(plant, dt);
+        for (size_t i = 0; i < segment.command.size(); ++i)
+        {
+          double y = axis.step(segment.command[i]);
+          yy += y * y;
+          yv += y * segment.velocity[i];
+          vv += segment.velocity[i] * segment.velocity[i];
+        }
+      }
+      if (yy <= 0.)
+        continue;
+      plant.gain = yv / yy;
+      size_t samples = 0;
+      for (const auto& segment : segments)
+        samples += segment.command.size();
+      plant.fit = (vv - yv * yv / yy) / samples;
+      if (best.fit < 0. || plant.fit < best.fit)
+        best = plant;
+    }
+  }
+  return best;
+}
+
+// Settle time is the time after which the error stays inside the tolerance, overshoot the largest error past the
+// goal relative to the step
+struct StepResponse
+{
+  bool is_settled;
+  double settle_time, overshoot;
+};
+
+inline StepResponse evaluateStep(const std::vector<double>& error, double tolerance, double dt)
+{
+  StepResponse response{ false, 0., 0. };
+  if (error.empty())
+    return response;
+  double step = error.front();
+  int last_outside = -1;
+  for (int i = 0; i < (int)error.size(); ++i)
+  {
+    if (std::abs(error[i]) > tolerance)
+      last_outside = i;
+    if (step != 0.)
+      response.overshoot = std::max(response.overshoot, -error[i] / step);
+  }
+  response.is_settled = last_outside < (int)error.size() - 1;
+  response.settle_time = (last_outside + 1) * dt;
+  return response;
+}
+
+}  // namespace engineer_middleware
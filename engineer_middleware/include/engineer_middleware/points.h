@@ -5,10 +5,11 @@
 #pragma once
 
 #include <algorithm>
-#include <sensor_msgs/PointCloud.h>
+#include <boost/make_shared.hpp>
 #include <sensor_msgs/PointCloud2.h>
-#include <sensor_msgs/point_cloud_conversion.h>
+#include <sensor_msgs/point_cloud2_iterator.h>
 #include <tf2_geometry_msgs/tf2_geometry_msgs.h>
+#include <engineer_middleware/reachability_map.h>
 
 namespace engineer_middleware
 {
@@ -34,6 +35,7 @@ public:
   void generateSpherePoints(double center_x, double center_y, double center_z, double r, double point_resolution)
   {
     points_final_.clear();
+    is_cloud_dirty_ = true;
     std::vector<Point> points;
     double angular_resolution = 2 * M_PI * (1 - point_resolution);
 
@@ -61,28 +63,34 @@ public:
                             double yaw, double point_resolution)
   {
     points_final_.clear();
+    is_cloud_dirty_ = true;
     std::vector<Point> points;
   }
-  sensor_msgs::PointCloud2 getPointCloud2()
+  // The cloud is rebuilt in place only after the points change, a new buffer is allocated only when the last one is
+  // still held by a subscriber
+  sensor_msgs::PointCloud2ConstPtr getPointCloud2()
   {
-    sensor_msgs::PointCloud2 cloud2;
-    sensor_msgs::PointCloud cloud;
-    cloud.header.stamp = ros::Time::now();
-    cloud.header.frame_id = "exchanger";
-    cloud.points.resize(points_final_.size());
-
-    cloud.channels.resize(1);
-    cloud.channels[0].name = "motion";
-    cloud.channels[0].values.resize(points_final_.size());
-
-    for (int i = 0; i < (int)points_final_.size(); ++i)
+    if (!is_cloud_dirty_ && cloud_)
+      return cloud_;
+    if (!cloud_ || !cloud_.unique())
+      cloud_ = boost::make_shared<sensor_msgs::PointCloud2>();
+    cloud_->header.stamp = ros::Time::now();
+    cloud_->header.frame_id = "exchanger";
+    sensor_msgs::PointCloud2Modifier modifier(*cloud_);
+    modifier.setPointCloud2FieldsByString(1, "xyz");
+    modifier.resize(points_final_.size());
+    sensor_msgs::PointCloud2Iterator<float> iter_x(*cloud_, "x"), iter_y(*cloud_, "y"), iter_z(*cloud_, "z");
+    for (const auto& point : points_final_)
     {
-      cloud.points[i].x = points_final_[i].x;
-      cloud.points[i].y = points_final_[i].y;
-      cloud.points[i].z = points_final_[i].z;
+      *iter_x = point.x;
+      *iter_y = point.y;
+      *iter_z = point.z;
+      ++iter_x;
+      ++iter_y;
+      ++iter_z;
     }
-    sensor_msgs::convertPointCloudToPointCloud2(cloud, cloud2);
-    return cloud2;
+    is_cloud_dirty_ = false;
+    return cloud_;
   }
   void rectifyForRPY(double theta, double beta, double k_x, double k_theta, double k_beta)
   {
@@ -90,6 +98,7 @@ public:
     rectify.x = abs(points_final_[0].x) * sin(theta) * k_x;
     rectify.y = abs(points_final_[0].x) * sin(beta) * k_beta;
     rectify.z = abs(points_final_[0].x) * sin(theta) * k_theta;
+    is_cloud_dirty_ = true;
     for (int i = 0; i < (int)points_final_.size(); ++i)
     {
       points_final_[i].x += rectify.x;
@@ -99,6 +108,7 @@ public:
   }
   void rectifyForLink7(double theta, double link7_length)
   {
+    is_cloud_dirty_ = true;
     for (int i = 0; i < (int)points_final_.size(); ++i)
     {
       points_final_[i].x -= link7_length * pow(sin(theta), 2) / (tan(M_PI_2 - theta / 2));
@@ -109,6 +119,7 @@ public:
                             double z_length, double point_resolution)
   {
     points_final_.clear();
+    is_cloud_dirty_ = true;
     std::vector<Point> points;
     double resolution = 1 - point_resolution;
     for (double x = center_x - x_length / 2; x <= center_x + x_length / 2; x += x_length * resolution)
@@ -129,11 +140,24 @@ public:
     }
   }
 
+  // Drop the points which the arm can not reach, points are offsets of the given origin in base_link
+  void removeUnreachable(const ReachabilityMap& map, double origin_x, double origin_y, double origin_z,
+                         uint8_t min_score)
+  {
+    points_final_.erase(std::remove_if(points_final_.begin(), points_final_.end(),
+                                       [&](const Point& p) {
+                                         return !map.isReachable(origin_x + p.x, origin_y + p.y, origin_z + p.z,
+                                                                 min_score);
+                                       }),
+                        points_final_.end());
+    is_cloud_dirty_ = true;
+  }
   void cleanPoints()
   {
     points_final_.clear();
+    is_cloud_dirty_ = true;
   }
-  std::vector<Point> getPoints()
+  const std::vector<Point>& getPoints() const
   {
     return points_final_;
   }
@@ -177,6 +201,8 @@ private:
   Geometry shape_;
   geometry_msgs::PoseStamped target_;
   std::vector<Point> points_final_{};
+  sensor_msgs::PointCloud2Ptr cloud_;
+  bool is_cloud_dirty_{ true };
   double target_x_, target_y_, target_z_, x_length_, y_length_, z_length_, point_resolution_, radius_;
 };
 
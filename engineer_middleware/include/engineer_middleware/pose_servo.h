@@ -0,0 +1,154 @@
+//
+// Created by agent on 26-10-18.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include <Eigen/Geometry>
+#include <geometry_msgs/Transform.h>
+#include <rm_common/ros_utilities.h>
+
+namespace auto_exchange
+{
+using Vector6d = Eigen::Matrix<double, 6, 1>;
+
+// Servo of the tool to a goal fixed to the exchanger, all six axes at once. The error is the pose of the exchanger
+// under the tool, position minus the offset and rotation as angle-axis times the axis weight. Each axis has its own
+// gains, the proportional gain is scheduled from p_far at schedule_range or more of error to p at zero error. When
+// an axis would exceed its max_vel the whole twist is scaled down, so the tool keeps heading straight to the goal
+// and all axes arrive together. Everything is fixed size, no allocation per tick.
+//
+// Per axis config, axes without config are not servoed:
+//   { pid: { p, i, d, i_clamp }, p_far, schedule_range, start_vel, max_vel, tolerance, offset_refer_exchanger }
+// offset_refer_exchanger is the goal offset for x, y and z and the weight of roll, pitch and yaw. It defaults to 0,
+// so a rotation is only servoed when its weight is given.
+class PoseServo
+{
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  enum Axis
+  {
+    X,
+    Y,
+    Z,
+    ROLL,
+    PITCH,
+    YAW
+  };
+  void init(XmlRpc::XmlRpcValue& config)
+  {
+    static const char* names[6] = { "x", "y", "z", "roll", "pitch", "yaw" };
+    for (int i = 0; i < 6; ++i)
+    {
+      is_enabled_[i] = config.hasMember(names[i]);
+      if (!is_enabled_[i])
+        continue;
+      XmlRpc::XmlRpcValue& axis = config[names[i]];
+      if (axis.hasMember("pid"))
+      {
+        p_[i] = xmlRpcGetDouble(axis["pid"], "p", 0.);
+        i_[i] = xmlRpcGetDouble(axis["pid"], "i", 0.);
+        d_[i] = xmlRpcGetDouble(axis["pid"], "d", 0.);
+        i_clamp_[i] = xmlRpcGetDouble(axis["pid"], "i_clamp", 0.);
+      }
+      p_far_[i] = xmlRpcGetDouble(axis, "p_far", p_[i]);
+      schedule_range_[i] = xmlRpcGetDouble(axis, "schedule_range", 0.);
+      start_vel_[i] = xmlRpcGetDouble(axis, "start_vel", 0.);
+      max_vel_[i] = xmlRpcGetDouble(axis, "max_vel", 1e10);
+      tolerance_[i] = xmlRpcGetDouble(axis, "tolerance", 1e10);
+      offset_[i] = xmlRpcGetDouble(axis, "offset_refer_exchanger", 0.);
+    }
+    reset();
+  }
+  void reset()
+  {
+    integral_.setZero();
+    last_error_.setZero();
+    error_.setConstant(1e10);
+    twist_.setZero();
+    has_last_error_ = false;
+  }
+  void setOffset(Axis axis, double offset)
+  {
+    offset_[axis] = offset;
+  }
+  double getOffset(Axis axis) const
+  {
+    return offset_[axis];
+  }
+  // dt is the time since the last update, 0 on the first one
+  const Vector6d& update(const geometry_msgs::Transform& tools2exchanger, double dt)
+  {
+    Eigen::AngleAxisd rotation(Eigen::Quaterniond(tools2exchanger.rotation.w, tools2exchanger.rotation.x,
+                                                  tools2exchanger.rotation.y, tools2exchanger.rotation.z)
+                                   .normalized());
+    Eigen::Vector3d angles = rotation.angle() * rotation.axis();
+    error_ << tools2exchanger.translation.x - offset_[X], tools2exchanger.translation.y - offset_[Y],
+        tools2exchanger.translation.z - offset_[Z], angles.x() * offset_[ROLL], angles.y() * offset_[PITCH],
+        angles.z() * offset_[YAW];
+    return update(error_, dt);
+  }
+  const Vector6d& update(const Vector6d& error, double dt)
+  {
+    error_ = error;
+    double scale = 1.;
+    for (int i = 0; i < 6; ++i)
+    {
+      if (!is_enabled_[i])
+      {
+        error_[i] = 0.;
+        twist_[i] = 0.;
+        continue;
+      }
+      double e = error_[i], abs_e = std::abs(e);
+      double p = schedule_range_[i] > 0. ? p_[i] + (p_far_[i] - p_[i]) * std::min(1., abs_e / schedule_range_[i]) :
+                                            p_[i];
+      double derivative = 0.;
+      if (dt > 0.)
+      {
+        integral_[i] = std::max(-i_clamp_[i], std::min(i_clamp_[i], integral_[i] + e * dt));
+        if (has_last_error_)
+          derivative = (e - last_error_[i]) / dt;
+      }
+      double vel = p * e + i_[i] * integral_[i] + d_[i] * derivative;
+      // start_vel gets the axis out of static friction, it is not needed inside the tolerance
+      if (abs_e > tolerance_[i])
+        vel += std::copysign(start_vel_[i], e);
+      twist_[i] = vel;
+      if (std::abs(vel) > max_vel_[i])
+        scale = std::max(scale, std::abs(vel) / max_vel_[i]);
+    }
+    twist_ /= scale;
+    last_error_ = error_;
+    has_last_error_ = true;
+    return twist_;
+  }
+  bool isFinish() const
+  {
+    for (int i = 0; i < 6; ++i)
+      if (is_enabled_[i] && std::abs(error_[i]) > tolerance_[i])
+        return false;
+    return true;
+  }
+  const Vector6d& getError() const
+  {
+    return error_;
+  }
+  const Vector6d& getTwist() const
+  {
+    return twist_;
+  }
+
+private:
+  bool is_enabled_[6]{}, has_last_error_{};
+  Vector6d p_ = Vector6d::Zero(), i_ = Vector6d::Zero(), d_ = Vector6d::Zero(), i_clamp_ = Vector6d::Zero();
+  Vector6d p_far_ = Vector6d::Zero(), schedule_range_ = Vector6d::Zero(), start_vel_ = Vector6d::Zero();
+  Vector6d max_vel_ = Vector6d::Constant(1e10), tolerance_ = Vector6d::Constant(1e10), offset_ = Vector6d::Zero();
+  Vector6d integral_ = Vector6d::Zero(), last_error_ = Vector6d::Zero(), error_ = Vector6d::Zero();
+  Vector6d twist_ = Vector6d::Zero();
+};
+
+}  // namespace auto_exchange
@@ -0,0 +1,55 @@
+//
+// Created by agent on 26-10-18.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include <ros/ros.h>
+
+namespace engineer_middleware
+{
+// Set once by whoever cancels a running queue and polled at every blocking point of its steps. The request time is
+// kept to report how long the robot took to stop.
+class PreemptFlag
+{
+public:
+  void request()
+  {
+    if (requested_)
+      return;
+    stamp_ = ros::WallTime::now().toNSec();
+    requested_ = true;
+  }
+  bool isRequested() const
+  {
+    return requested_;
+  }
+  // Seconds since the first request
+  double getLatency() const
+  {
+    return requested_ ? (ros::WallTime::now().toNSec() - stamp_) * 1e-9 : 0.;
+  }
+  // Sleep in short slices, returns false as soon as a preempt is requested
+  bool sleep(ros::Duration duration) const
+  {
+    // The end follows ros time like ros::Duration::sleep, so simulation still works
+    ros::Time end = ros::Time::now() + duration;
+    while (!requested_)
+    {
+      if (ros::Time::now() >= end)
+        return true;
+      ros::WallDuration(SLICE).sleep();
+    }
+    return false;
+  }
+
+private:
+  static constexpr double SLICE = 2e-4;
+  std::atomic<bool> requested_{ false };
+  std::atomic<uint64_t> stamp_{ 0 };
+};
+
+}  // namespace engineer_middleware
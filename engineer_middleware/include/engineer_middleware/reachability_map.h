@@ -0,0 +1,150 @@
+//
+// Created by agent on 26-10-18.
+//
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <ros/ros.h>
+
+namespace engineer_middleware
+{
+// Voxel grid in base_link, one byte per voxel: 0 is unreachable, 255 means every sampled orientation has an IK
+// solution. The file is the header followed by size_x * size_y * size_z scores, x varies fastest.
+struct ReachabilityMapHeader
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t size_x, size_y, size_z;
+  double origin_x, origin_y, origin_z;
+  double resolution;
+};
+
+class ReachabilityMap
+{
+public:
+  static constexpr uint32_t VERSION = 1;
+  ReachabilityMap() = default;
+  ReachabilityMap(const ReachabilityMap&) = delete;
+  ReachabilityMap& operator=(const ReachabilityMap&) = delete;
+  ~ReachabilityMap()
+  {
+    unload();
+  }
+  // The map generated offline is shared by every motion in the node, it is loaded once by the middleware
+  static ReachabilityMap& getInstance()
+  {
+    static ReachabilityMap map;
+    return map;
+  }
+
+  bool load(const std::string& path)
+  {
+    unload();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+      ROS_ERROR("Can not open reachability map %s", path.c_str());
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(ReachabilityMapHeader))
+    {
+      ROS_ERROR("Reachability map %s is too small", path.c_str());
+      close(fd);
+      return false;
+    }
+    void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+    {
+      ROS_ERROR("Can not map reachability map %s", path.c_str());
+      return false;
+    }
+    mapped_ = addr;
+    mapped_size_ = st.st_size;
+    header_ = static_cast<const ReachabilityMapHeader*>(addr);
+    if (std::strncmp(header_->magic, "RMAP", 4) != 0 || header_->version != VERSION ||
+        mapped_size_ < sizeof(ReachabilityMapHeader) + voxelNum(*header_))
+    {
+      ROS_ERROR("Reachability map %s is broken", path.c_str());
+      unload();
+      return false;
+    }
+    data_ = static_cast<const uint8_t*>(addr) + sizeof(ReachabilityMapHeader);
+    ROS_INFO("Load reachability map %s: %u x %u x %u voxels, resolution %f", path.c_str(), header_->size_x,
+             header_->size_y, header_->size_z, header_->resolution);
+    return true;
+  }
+  void unload()
+  {
+    if (mapped_)
+      munmap(mapped_, mapped_size_);
+    mapped_ = nullptr;
+    mapped_size_ = 0;
+    header_ = nullptr;
+    data_ = nullptr;
+  }
+  bool isLoaded() const
+  {
+    return data_ != nullptr;
+  }
+  double getResolution() const
+  {
+    return header_ ? header_->resolution : 0.;
+  }
+  // Position in base_link, voxels outside the map are unreachable
+  uint8_t getScore(double x, double y, double z) const
+  {
+    if (!data_)
+      return 0;
+    long ix = std::lround(std::floor((x - header_->origin_x) / header_->resolution));
+    long iy = std::lround(std::floor((y - header_->origin_y) / header_->resolution));
+    long iz = std::lround(std::floor((z - header_->origin_z) / header_->resolution));
+    if (ix < 0 || iy < 0 || iz < 0 || ix >= header_->size_x || iy >= header_->size_y || iz >= header_->size_z)
+      return 0;
+    return data_[(iz * header_->size_y + iy) * header_->size_x + ix];
+  }
+  // Every position is reachable when no map is loaded, so motions behave as before
+  bool isReachable(double x, double y, double z, uint8_t min_score) const
+  {
+    return !data_ || getScore(x, y, z) >= min_score;
+  }
+
+  static size_t voxelNum(const ReachabilityMapHeader& header)
+  {
+    return (size_t)header.size_x * header.size_y * header.size_z;
+  }
+  static bool save(const std::string& path, ReachabilityMapHeader header, const std::vector<uint8_t>& data)
+  {
+    std::memcpy(header.magic, "RMAP", 4);
+    header.version = VERSION;
+    if (data.size() != voxelNum(header))
+      return false;
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file)
+      return false;
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(data.data()), data.size());
+    return file.good();
+  }
+
+private:
+  void* mapped_{};
+  size_t mapped_size_{};
+  const ReachabilityMapHeader* header_{};
+  const uint8_t* data_{};
+};
+
+}  // namespace engineer_middleware
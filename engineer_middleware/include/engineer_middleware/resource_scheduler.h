@@ -0,0 +1,84 @@
+//
+// Created by agent on 26-10-18.
+//
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <mutex>
+
+#include "engineer_middleware/preempt_flag.h"
+
+namespace engineer_middleware
+{
+// Lets step queues which drive different actuators run at the same time. A queue waits while any running queue
+// shares an actuator with it, unless its priority is not lower than all of them: then they are preempted, the same
+// as a new goal preempted the old one when only one queue could run.
+class ResourceScheduler
+{
+public:
+  struct Ticket
+  {
+    uint32_t resources;
+    int priority;
+    // Polled by the running queue, set by the scheduler or by a cancel request
+    PreemptFlag preempt;
+    bool is_running{};
+  };
+
+  // Blocks until the resources of the ticket are free, returns false if it is canceled while waiting
+  bool acquire(Ticket& ticket)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    tickets_.push_back(&ticket);
+    while (!ticket.preempt.isRequested())
+    {
+      bool is_blocked = false, is_outranked = false;
+      for (const Ticket* other : tickets_)
+      {
+        if (other == &ticket || !other->is_running || !(other->resources & ticket.resources))
+          continue;
+        is_blocked = true;
+        is_outranked |= other->priority > ticket.priority;
+      }
+      if (!is_blocked)
+      {
+        ticket.is_running = true;
+        return true;
+      }
+      if (!is_outranked)
+        for (Ticket* other : tickets_)
+          if (other != &ticket && other->is_running && (other->resources & ticket.resources))
+            other->preempt.request();
+      cv_.wait(lock);
+    }
+    tickets_.remove(&ticket);
+    return false;
+  }
+  void release(Ticket& ticket)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      tickets_.remove(&ticket);
+    }
+    cv_.notify_all();
+  }
+  // Wake up a waiting ticket after its preempt flag is set from outside
+  void notify()
+  {
+    {
+      // Pairs with the check of the flag before waiting, so the wake up can not be lost
+      std::lock_guard<std::mutex> lock(mutex_);
+    }
+    cv_.notify_all();
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::list<Ticket*> tickets_;
+};
+
+}  // namespace engineer_middleware
@@ -0,0 +1,143 @@
+//
+// Created by agent on 26-10-18.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <angles/angles.h>
+#include <rm_common/ros_utilities.h>
+
+namespace auto_exchange
+{
+// Where the gimbal looks for the exchanger. Bearings of past detections are kept in a histogram over map yaw and
+// gimbal pitch, so they stay valid when the chassis turns between searches. The gimbal heads for the reachable cell
+// with the most probability per second of travel, and a cell passed without a detection keeps only miss_rate of its
+// probability. Every cell also gets prior_weight, so without history the search sweeps the nearest unseen cells.
+//
+// Config: { bin_yaw, bin_pitch, fov_yaw, fov_pitch, prior_weight, miss_rate, decay, yaw_speed, pitch_speed, slow_range }
+// The defaults are tuned on the camera of auto_exchange_driver (fov_yaw 0.5, fov_pitch 0.4), one pitch row covers it.
+class SearchPlanner
+{
+public:
+  // Ranges are the gimbal joint limits in rad, scales the rate commands at full speed
+  SearchPlanner(XmlRpc::XmlRpcValue& config, double yaw_min, double yaw_max, double pitch_min, double pitch_max,
+                double yaw_scale, double pitch_scale)
+    : yaw_min_(yaw_min)
+    , yaw_max_(yaw_max)
+    , pitch_min_(pitch_min)
+    , pitch_max_(pitch_max)
+    , yaw_scale_(yaw_scale)
+    , pitch_scale_(pitch_scale)
+  {
+    yaw_bins_ = std::max(1, (int)std::round(2. * M_PI / xmlRpcGetDouble(config, "bin_yaw", 0.2)));
+    pitch_bins_ = std::max(1, (int)std::ceil((pitch_max - pitch_min) / xmlRpcGetDouble(config, "bin_pitch", 0.6)));
+    prior_weight_ = xmlRpcGetDouble(config, "prior_weight", 3.);
+    miss_rate_ = xmlRpcGetDouble(config, "miss_rate", 0.05);
+    // Older detections count less, the exchanger is not always at the same place
+    decay_ = xmlRpcGetDouble(config, "decay", 0.9);
+    // Gimbal speeds at full scale in rad/s, only their ratio and the travel time matter
+    yaw_speed_ = xmlRpcGetDouble(config, "yaw_speed", 1.);
+    pitch_speed_ = xmlRpcGetDouble(config, "pitch_speed", 1.);
+    // The rate command ramps down inside this distance to the cell center
+    slow_range_ = xmlRpcGetDouble(config, "slow_range", 0.1);
+    // A cell counts as searched with its center this close to the view axis, the camera has to see the whole cell
+    fov_yaw_ = xmlRpcGetDouble(config, "fov_yaw", 0.3);
+    fov_pitch_ = xmlRpcGetDouble(config, "fov_pitch", 0.3);
+    history_.assign(yaw_bins_ * pitch_bins_, 0.);
+    reset();
+  }
+  // Starts a search from the history
+  void reset()
+  {
+    probability_.resize(history_.size());
+    for (size_t i = 0; i < history_.size(); ++i)
+      probability_[i] = prior_weight_ + history_[i];
+    current_ = -1;
+    target_ = -1;
+  }
+  void addDetection(double map_yaw, double pitch)
+  {
+    for (auto& count : history_)
+      count *= decay_;
+    history_[getCell(map_yaw, pitch)] += 1.;
+  }
+  // Rate scales of the gimbal, from the chassis yaw in the map and the gimbal joints
+  void plan(double chassis_yaw, double gimbal_yaw, double pitch, double& yaw_scale, double& pitch_scale)
+  {
+    double map_yaw = chassis_yaw + gimbal_yaw;
+    int cell = getCell(map_yaw, pitch);
+    if (cell != current_ && isSeen(cell, map_yaw, pitch))
+    {
+      probability_[cell] *= miss_rate_;
+      current_ = cell;
+    }
+    if (target_ < 0 || target_ == current_)
+      target_ = selectTarget(chassis_yaw, map_yaw, pitch);
+    if (target_ < 0)
+    {
+      yaw_scale = 0.;
+      pitch_scale = 0.;
+      return;
+    }
+    double yaw_error = angles::shortest_angular_distance(map_yaw, getYaw(target_));
+    double pitch_error = getPitch(target_) - pitch;
+    yaw_scale = yaw_scale_ * std::max(-1., std::min(1., yaw_error / slow_range_));
+    pitch_scale = pitch_scale_ * std::max(-1., std::min(1., pitch_error / slow_range_));
+  }
+
+private:
+  int selectTarget(double chassis_yaw, double map_yaw, double pitch) const
+  {
+    int best = -1;
+    double best_score = 0.;
+    for (int i = 0; i < (int)probability_.size(); ++i)
+    {
+      if (i == current_)
+        continue;
+      double gimbal_yaw = angles::normalize_angle(getYaw(i) - chassis_yaw);
+      if (gimbal_yaw < yaw_min_ || gimbal_yaw > yaw_max_)
+        continue;
+      double travel = std::max(std::abs(angles::shortest_angular_distance(map_yaw, getYaw(i))) / yaw_speed_,
+                               std::abs(getPitch(i) - pitch) / pitch_speed_);
+      // The bias keeps neighbours from winning on travel alone
+      double score = probability_[i] / (travel + 0.1);
+      if (score > best_score)
+      {
+        best_score = score;
+        best = i;
+      }
+    }
+    return best;
+  }
+  // A cell is searched once its center was in the field of view
+  bool isSeen(int cell, double map_yaw, double pitch) const
+  {
+    return std::abs(angles::shortest_angular_distance(map_yaw, getYaw(cell))) < fov_yaw_ &&
+           std::abs(getPitch(cell) - pitch) < fov_pitch_;
+  }
+  int getCell(double map_yaw, double pitch) const
+  {
+    int yaw_bin = (int)std::floor(angles::normalize_angle_positive(map_yaw) / (2. * M_PI) * yaw_bins_) % yaw_bins_;
+    int pitch_bin = (int)std::floor((pitch - pitch_min_) / (pitch_max_ - pitch_min_) * pitch_bins_);
+    return yaw_bin * pitch_bins_ + std::max(0, std::min(pitch_bins_ - 1, pitch_bin));
+  }
+  double getYaw(int cell) const
+  {
+    return (cell / pitch_bins_ + 0.5) * 2. * M_PI / yaw_bins_;
+  }
+  double getPitch(int cell) const
+  {
+    return pitch_min_ + (cell % pitch_bins_ + 0.5) * (pitch_max_ - pitch_min_) / pitch_bins_;
+  }
+
+  double yaw_min_, yaw_max_, pitch_min_, pitch_max_, yaw_scale_, pitch_scale_;
+  int yaw_bins_{}, pitch_bins_{}, current_{ -1 }, target_{ -1 };
+  double prior_weight_{}, miss_rate_{}, decay_{}, yaw_speed_{}, pitch_speed_{}, slow_range_{}, fov_yaw_{}, fov_pitch_{};
+  std::vector<double> history_, probability_;
+};
+
+}  // namespace auto_exchange
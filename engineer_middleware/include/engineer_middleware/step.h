@@ -34,241 +34,413 @@
 #pragma once
 
 #include "engineer_middleware/motion.h"
+#include "engineer_middleware/motion_arena.h"
 #include "engineer_middleware/planning_scene.h"
+#include "engineer_middleware/telemetry.h"
+#include <algorithm>
+#include <cmath>
 #include <string>
 #include <unordered_map>
 #include <iostream>
 #include <memory>
-#include <string>
+#include <vector>
 
 namespace engineer_middleware
 {
 class Step
 {
 public:
-  Step(const XmlRpc::XmlRpcValue& step, const XmlRpc::XmlRpcValue& scenes, tf2_ros::Buffer& tf,
-       moveit::planning_interface::MoveGroupInterface& arm_group, ChassisInterface& chassis_interface,
-       ros::Publisher& hand_pub, ros::Publisher& end_effector_pub, ros::Publisher& gimbal_pub, ros::Publisher& gpio_pub,
+  // Motions run in this order, the planning scene is applied between REVERSAL and ORE_LIFTER
+  enum MotionType : uint8_t
+  {
+    ARM,
+    HAND,
+    END_EFFECTOR,
+    STONE_NUM,
+    CHASSIS,
+    GIMBAL,
+    GPIO,
+    REVERSAL,
+    ORE_LIFTER,
+    ORE_ROTATOR,
+    GIMBAL_LIFTER,
+    EXTEND_ARM_BACK,
+    EXTEND_ARM_FRONT,
+    CHASSIS_TARGET,
+    SILVER_LIFTER,
+    SILVER_PUSHER,
+    SILVER_ROTATOR,
+    GOLD_PUSHER,
+    GOLD_LIFTER,
+    MIDDLE_PITCH,
+    AUTO_EXCHANGE
+  };
+  enum MotionFlag : uint8_t
+  {
+    CHECK_FINISH = 1,
+    CHECK_TIMEOUT = 2,
+    STOP = 4
+  };
+  struct CompiledMotion
+  {
+    MotionType type;
+    uint8_t flags;
+    Motion* motion;
+    // Telemetry of the last run, wait_time stays negative until the motion finishes
+    float move_time;
+    float wait_time;
+  };
+
+  Step(const XmlRpc::XmlRpcValue& step, MotionArena& arena, tf2_ros::Buffer& tf,
+       moveit::planning_interface::MoveGroupInterface& arm_group, ParallelPlanner& parallel_planner,
+       ChassisInterface& chassis_interface, PlanningSceneManager& scene_manager, ros::Publisher& hand_pub,
+       ros::Publisher& end_effector_pub, ros::Publisher& gimbal_pub, ros::Publisher& gpio_pub,
        ros::Publisher& reversal_pub, ros::Publisher& stone_num_pub, ros::Publisher& planning_result_pub,
        ros::Publisher& point_cloud_pub, ros::Publisher& ore_rotate_pub, ros::Publisher& ore_lift_pub,
        ros::Publisher& gimbal_lift_pub, ros::Publisher& extend_arm_f_pub, ros::Publisher& extend_arm_b_pub,
        ros::Publisher& silver_lifter_pub, ros::Publisher& silver_pusher_pub, ros::Publisher& silver_rotator_pub,
        ros::Publisher& gold_pusher_pub, ros::Publisher& gold_lifter_pub, ros::Publisher& middle_pitch_pub)
-    : planning_result_pub_(planning_result_pub), point_cloud_pub_(point_cloud_pub), arm_group_(arm_group)
+    : planning_result_pub_(planning_result_pub), point_cloud_pub_(point_cloud_pub), scene_manager_(scene_manager)
   {
     ROS_ASSERT(step.hasMember("step"));
     step_name_ = static_cast<std::string>(step["step"]);
-    if (step.hasMember("arm"))
-    {
-      if (step["arm"].hasMember("joints"))
-        arm_motion_ = new JointMotion(step["arm"], arm_group, tf);
-      else if (step["arm"].hasMember("spacial_shape"))
-        arm_motion_ = new SpaceEeMotion(step["arm"], arm_group, tf);
-      else
-        arm_motion_ = new EndEffectorMotion(step["arm"], arm_group, tf);
-    }
-    if (step.hasMember("chassis"))
-      chassis_motion_ = new ChassisMotion(step["chassis"], chassis_interface);
-    if (step.hasMember("hand"))
-      hand_motion_ = new HandMotion(step["hand"], hand_pub);
-    if (step.hasMember("end_effector"))
-      end_effector_motion_ = new JointPositionMotion(step["end_effector"], end_effector_pub, tf);
-    if (step.hasMember("stone_num"))
-      stone_num_motion_ = new StoneNumMotion(step["stone_num"], stone_num_pub);
-    if (step.hasMember("gimbal"))
-      gimbal_motion_ = new GimbalMotion(step["gimbal"], gimbal_pub);
-    if (step.hasMember("gripper"))
-      gpio_motion_ = new GpioMotion(step["gripper"], gpio_pub);
-    if (step.hasMember("reversal"))
-      reversal_motion_ = new ReversalMotion(step["reversal"], reversal_pub);
-    if (step.hasMember("scene_name"))
+    // One pass over the members of the step instead of looking up every known motion name
+    for (XmlRpc::XmlRpcValue::ValueStruct::const_iterator it = step.begin(); it != step.end(); ++it)
     {
-      for (XmlRpc::XmlRpcValue::ValueStruct::const_iterator it = scenes.begin(); it != scenes.end(); ++it)
-        if (step["scene_name"] == it->first)
-          planning_scene_ = new PlanningScene(it->second, arm_group);
-    }
-    if (step.hasMember("ore_rotator"))
-      ore_rotate_motion_ = new JointPointMotion(step["ore_rotator"], ore_rotate_pub);
-    if (step.hasMember("ore_lifter"))
-      ore_lift_motion_ = new JointPointMotion(step["ore_lifter"], ore_lift_pub);
-    if (step.hasMember("gimbal_lifter"))
-      gimbal_lift_motion_ = new JointPointMotion(step["gimbal_lifter"], gimbal_lift_pub);
-    if (step.hasMember("extend_arm"))
-    {
-      if (step["extend_arm"].hasMember("front"))
-        extend_arm_front_motion_ = new ExtendMotion(step["extend_arm"], extend_arm_f_pub, true);
-      if (step["extend_arm"].hasMember("back"))
-        extend_arm_back_motion_ = new ExtendMotion(step["extend_arm"], extend_arm_b_pub, false);
+      const std::string& key = it->first;
+      if (key == "scene_name")
+      {
+        scene_name_ = static_cast<std::string>(step["scene_name"]);
+        if (!scene_manager.hasScene(scene_name_))
+        {
+          ROS_WARN("Step %s: no scene named %s", step_name_.c_str(), scene_name_.c_str());
+          scene_name_.clear();
+        }
+        continue;
+      }
+      auto type = getMotionTypes().find(key);
+      if (type == getMotionTypes().end())
+        continue;
+      switch (type->second)
+      {
+        case ARM:
+          if (step["arm"].hasMember("joints"))
+          {
+            joint_motion_ = arena.create<JointMotion>(step["arm"], arm_group, tf);
+            arm_motion_ = joint_motion_;
+          }
+          else if (step["arm"].hasMember("spacial_shape"))
+            arm_motion_ = arena.create<SpaceEeMotion>(step["arm"], arm_group, tf, parallel_planner);
+          else
+            arm_motion_ = arena.create<EndEffectorMotion>(step["arm"], arm_group, tf);
+          add(ARM, CHECK_FINISH | CHECK_TIMEOUT | STOP, arm_motion_);
+          break;
+        case HAND:
+          add(HAND, CHECK_FINISH | CHECK_TIMEOUT | STOP, arena.create<HandMotion>(step["hand"], hand_pub));
+          break;
+        case END_EFFECTOR:
+          add(END_EFFECTOR, CHECK_FINISH | CHECK_TIMEOUT,
+              arena.create<JointPositionMotion>(step["end_effector"], end_effector_pub, tf));
+          break;
+        case STONE_NUM:
+          add(STONE_NUM, 0, arena.create<StoneNumMotion>(step["stone_num"], stone_num_pub));
+          break;
+        case CHASSIS:
+          add(CHASSIS, CHECK_FINISH | CHECK_TIMEOUT | STOP,
+              arena.create<ChassisMotion>(step["chassis"], chassis_interface));
+          break;
+        case GIMBAL:
+          add(GIMBAL, CHECK_FINISH | CHECK_TIMEOUT, arena.create<GimbalMotion>(step["gimbal"], gimbal_pub));
+          break;
+        case GPIO:
+          add(GPIO, CHECK_FINISH, arena.create<GpioMotion>(step["gripper"], gpio_pub));
+          break;
+        case REVERSAL:
+          add(REVERSAL, CHECK_FINISH | STOP, arena.create<ReversalMotion>(step["reversal"], reversal_pub));
+          break;
+        case ORE_LIFTER:
+          add(ORE_LIFTER, 0, arena.create<JointPointMotion>(step["ore_lifter"], ore_lift_pub));
+          break;
+        case ORE_ROTATOR:
+          add(ORE_ROTATOR, 0, arena.create<JointPointMotion>(step["ore_rotator"], ore_rotate_pub));
+          break;
+        case GIMBAL_LIFTER:
+          add(GIMBAL_LIFTER, 0, arena.create<JointPointMotion>(step["gimbal_lifter"], gimbal_lift_pub));
+          break;
+        case EXTEND_ARM_BACK:
+          // Both sides share the extend_arm member
+          if (step["extend_arm"].hasMember("back"))
+            add(EXTEND_ARM_BACK, 0, arena.create<ExtendMotion>(step["extend_arm"], extend_arm_b_pub, false));
+          if (step["extend_arm"].hasMember("front"))
+            add(EXTEND_ARM_FRONT, 0, arena.create<ExtendMotion>(step["extend_arm"], extend_arm_f_pub, true));
+          break;
+        case CHASSIS_TARGET:
+          add(CHASSIS_TARGET, CHECK_FINISH | CHECK_TIMEOUT | STOP,
+              arena.create<ChassisTargetMotion>(step["chassis_target"], chassis_interface, tf));
+          break;
+        case SILVER_LIFTER:
+          add(SILVER_LIFTER, CHECK_FINISH, arena.create<JointPointMotion>(step["silver_lifter"], silver_lifter_pub));
+          break;
+        case SILVER_PUSHER:
+          add(SILVER_PUSHER, CHECK_FINISH, arena.create<JointPointMotion>(step["silver_pusher"], silver_pusher_pub));
+          break;
+        case SILVER_ROTATOR:
+          add(SILVER_ROTATOR, CHECK_FINISH,
+              arena.create<JointPointMotion>(step["silver_rotator"], silver_rotator_pub));
+          break;
+        case GOLD_PUSHER:
+          add(GOLD_PUSHER, CHECK_FINISH, arena.create<JointPointMotion>(step["gold_pusher"], gold_pusher_pub));
+          break;
+        case GOLD_LIFTER:
+          add(GOLD_LIFTER, CHECK_FINISH, arena.create<JointPointMotion>(step["gold_lifter"], gold_lifter_pub));
+          break;
+        case MIDDLE_PITCH:
+          add(MIDDLE_PITCH, CHECK_FINISH, arena.create<JointPointMotion>(step["middle_pitch"], middle_pitch_pub));
+          break;
+        case AUTO_EXCHANGE:
+          if (step["auto_exchange"].hasMember("config"))
+            add(AUTO_EXCHANGE, CHECK_FINISH | CHECK_TIMEOUT | STOP,
+                arena.create<AutoExchangeServoMotion>(step["auto_exchange"], arm_group, tf, chassis_interface,
+                                                      gimbal_pub));
+          else
+            add(AUTO_EXCHANGE, CHECK_FINISH | CHECK_TIMEOUT | STOP,
+                arena.create<AutoExchangeMotion>(step["auto_exchange"], arm_group, tf));
+          break;
+        default:
+          break;
+      }
     }
-    if (step.hasMember("chassis_target"))
-      chassis_target_motion_ = new ChassisTargetMotion(step["chassis_target"], chassis_interface, tf);
-    if (step.hasMember("silver_lifter"))
-      silver_lifter_motion_ = new JointPointMotion(step["silver_lifter"], silver_lifter_pub);
-    if (step.hasMember("silver_pusher"))
-      silver_pusher_motion_ = new JointPointMotion(step["silver_pusher"], silver_pusher_pub);
-    if (step.hasMember("silver_rotator"))
-      silver_rotator_motion_ = new JointPointMotion(step["silver_rotator"], silver_rotator_pub);
-    if (step.hasMember("gold_pusher"))
-      gold_pusher_motion_ = new JointPointMotion(step["gold_pusher"], gold_pusher_pub);
-    if (step.hasMember("gold_lifter"))
-      gold_lifter_motion_ = new JointPointMotion(step["gold_lifter"], gold_lifter_pub);
-    if (step.hasMember("middle_pitch"))
-      middle_pitch_motion_ = new JointPointMotion(step["middle_pitch"], middle_pitch_pub);
+    std::sort(motions_.begin(), motions_.end(),
+              [](const CompiledMotion& a, const CompiledMotion& b) { return a.type < b.type; });
+    motions_.shrink_to_fit();
   }
   bool move()
   {
     bool success = true;
-    if (arm_motion_)
+    bool scene_applied = scene_name_.empty();
+    for (auto& motion : motions_)
     {
-      success &= arm_motion_->move();
-      if (!arm_motion_->getPointCloud2().data.empty())
+      motion.move_time = 0.;
+      motion.wait_time = -1.;
+    }
+    for (auto& motion : motions_)
+    {
+      if (preempt_ && preempt_->isRequested())
+      {
+        move_end_ = ros::WallTime::now();
+        return false;
+      }
+      if (!scene_applied && motion.type >= ORE_LIFTER)
       {
-        sensor_msgs::PointCloud2 point_cloud2 = arm_motion_->getPointCloud2();
-        point_cloud_pub_.publish(point_cloud2);
+        scene_manager_.apply(scene_name_);
+        scene_applied = true;
+      }
+      ros::WallTime start = ros::WallTime::now();
+      success &= motion.motion->move();
+      motion.move_time = (ros::WallTime::now() - start).toSec();
+      if (motion.type == ARM)
+      {
+        if (point_cloud_pub_.getNumSubscribers() > 0)
+        {
+          sensor_msgs::PointCloud2ConstPtr point_cloud2 = arm_motion_->getPointCloud2();
+          if (!point_cloud2->data.empty())
+            point_cloud_pub_.publish(point_cloud2);
+        }
+        std_msgs::Int32 msg = arm_motion_->getPlanningResult();
+        planning_result_pub_.publish(msg);
       }
-      std_msgs::Int32 msg = arm_motion_->getPlanningResult();
-      planning_result_pub_.publish(msg);
     }
-    if (hand_motion_)
-      success &= hand_motion_->move();
-    if (end_effector_motion_)
-      success &= end_effector_motion_->move();
-    if (stone_num_motion_)
-      success &= stone_num_motion_->move();
-    if (chassis_motion_)
-      success &= chassis_motion_->move();
-    if (gimbal_motion_)
-      success &= gimbal_motion_->move();
-    if (gpio_motion_)
-      success &= gpio_motion_->move();
-    if (reversal_motion_)
-      success &= reversal_motion_->move();
-    if (planning_scene_)
-      planning_scene_->add();
-    if (ore_lift_motion_)
-      success &= ore_lift_motion_->move();
-    if (ore_rotate_motion_)
-      success &= ore_rotate_motion_->move();
-    if (gimbal_lift_motion_)
-      success &= gimbal_lift_motion_->move();
-    if (extend_arm_back_motion_)
-      success &= extend_arm_back_motion_->move();
-    if (extend_arm_front_motion_)
-      success &= extend_arm_front_motion_->move();
-    if (chassis_target_motion_)
-      success &= chassis_target_motion_->move();
-    if (silver_lifter_motion_)
-      success &= silver_lifter_motion_->move();
-    if (silver_pusher_motion_)
-      success &= silver_pusher_motion_->move();
-    if (silver_rotator_motion_)
-      success &= silver_rotator_motion_->move();
-    if (gold_pusher_motion_)
-      success &= gold_pusher_motion_->move();
-    if (gold_lifter_motion_)
-      success &= gold_lifter_motion_->move();
-    if (middle_pitch_motion_)
-      success &= middle_pitch_motion_->move();
+    if (!scene_applied)
+      scene_manager_.apply(scene_name_);
+    move_end_ = ros::WallTime::now();
     return success;
   }
+  void setPreempt(const PreemptFlag* preempt)
+  {
+    preempt_ = preempt;
+    for (const auto& motion : motions_)
+      motion.motion->setPreempt(preempt);
+  }
   void stop()
   {
-    if (arm_motion_)
-      arm_motion_->stop();
-    if (hand_motion_)
-      hand_motion_->stop();
-    if (chassis_motion_)
-      chassis_motion_->stop();
-    if (chassis_target_motion_)
-      chassis_target_motion_->stop();
+    for (const auto& motion : motions_)
+      if (motion.flags & STOP)
+        motion.motion->stop();
   }
 
   void deleteScene()
   {
-    std::map<std::string, moveit_msgs::AttachedCollisionObject> attached_objects =
-        planning_scene_interface_.getAttachedObjects();
-    for (auto iter = attached_objects.begin(); iter != attached_objects.end(); ++iter)
-    {
-      arm_group_.detachObject(iter->first);
-    }
-    planning_scene_interface_.removeCollisionObjects(planning_scene_interface_.getKnownObjectNames());
+    scene_manager_.clear();
   }
   bool isFinish()
   {
     bool success = true;
-    if (arm_motion_)
-      success &= arm_motion_->isFinish();
-    if (hand_motion_)
-      success &= hand_motion_->isFinish();
-    if (end_effector_motion_)
-      success &= end_effector_motion_->isFinish();
-    if (chassis_motion_)
-      success &= chassis_motion_->isFinish();
-    if (gimbal_motion_)
-      success &= gimbal_motion_->isFinish();
-    if (reversal_motion_)
-      success &= reversal_motion_->isFinish();
-    if (chassis_target_motion_)
-      success &= chassis_target_motion_->isFinish();
-    if (silver_lifter_motion_)
-      success &= silver_lifter_motion_->isFinish();
-    if (silver_pusher_motion_)
-      success &= silver_pusher_motion_->isFinish();
-    if (silver_rotator_motion_)
-      success &= silver_rotator_motion_->isFinish();
-    if (gpio_motion_)
-      success &= gpio_motion_->isFinish();
-    if (gold_pusher_motion_)
-      success &= gold_pusher_motion_->isFinish();
-    if (gold_lifter_motion_)
-      success &= gold_lifter_motion_->isFinish();
-    if (middle_pitch_motion_)
-      success &= middle_pitch_motion_->isFinish();
+    for (auto& motion : motions_)
+    {
+      if (!(motion.flags & CHECK_FINISH))
+        continue;
+      bool is_finish = motion.motion->isFinish();
+      if (is_finish && motion.wait_time < 0.)
+        motion.wait_time = (ros::WallTime::now() - move_end_).toSec();
+      success &= is_finish;
+    }
     return success;
   }
   bool checkTimeout(ros::Duration period)
   {
     bool success = true;
-    if (arm_motion_)
-      success &= arm_motion_->checkTimeout(period);
-    if (hand_motion_)
-      success &= hand_motion_->checkTimeout(period);
-    if (end_effector_motion_)
-      success &= end_effector_motion_->checkTimeout(period);
-    if (chassis_motion_)
-      success &= chassis_motion_->checkTimeout(period);
-    if (gimbal_motion_)
-      success &= gimbal_motion_->checkTimeout(period);
-    if (chassis_target_motion_)
-      success &= chassis_target_motion_->checkTimeout(period);
+    for (const auto& motion : motions_)
+      if (motion.flags & CHECK_TIMEOUT)
+        success &= motion.motion->checkTimeout(period);
     return success;
   }
 
-  std::string getName()
+  std::string getName() const
   {
     return step_name_;
   }
+  bool isPassThrough() const
+  {
+    return joint_motion_ && joint_motion_->isPassThrough();
+  }
+  // Carry the arm trajectory of this step on into the next step, which has to move the arm joints as well
+  bool blend(Step& next)
+  {
+    if (!isPassThrough() || !next.joint_motion_)
+      return false;
+    joint_motion_->blend(*next.joint_motion_);
+    return true;
+  }
+  // End of the last move(), before it returns this is still the previous one
+  ros::WallTime getMoveEnd() const
+  {
+    return move_end_;
+  }
+  // Smallest timeout left after period, NAN if no motion checks its timeout
+  double getTimeoutMargin(ros::Duration period) const
+  {
+    double margin = NAN;
+    for (const auto& motion : motions_)
+      if (motion.flags & CHECK_TIMEOUT)
+        margin = std::fmin(margin, motion.motion->getTimeout() - period.toSec());
+    return margin;
+  }
+  // Push the record of the step, followed by one for each motion
+  void record(TelemetryRecord step_record) const
+  {
+    Telemetry& telemetry = Telemetry::getInstance();
+    if (!telemetry.isOpen())
+      return;
+    telemetry.record(step_record);
+    for (const auto& motion : motions_)
+    {
+      TelemetryRecord record = step_record;
+      record.motion = motion.type;
+      record.polls = 0;
+      record.move_time = motion.move_time;
+      record.wait_time = motion.wait_time;
+      telemetry.record(record);
+    }
+  }
+  size_t getMotionNum() const
+  {
+    return motions_.size();
+  }
+  // Motions driving the same actuator share one bit
+  static uint32_t getResource(MotionType type)
+  {
+    if (type == END_EFFECTOR)
+      type = ARM;
+    else if (type == CHASSIS_TARGET)
+      type = CHASSIS;
+    // Searches with the gimbal and aligns the chassis before it moves the arm
+    else if (type == AUTO_EXCHANGE)
+      return getResource(ARM) | getResource(CHASSIS) | getResource(GIMBAL);
+    return 1u << type;
+  }
+  // Actuators used by a step config, without building its motions. Same as getResources() of the built step.
+  static uint32_t getResources(const XmlRpc::XmlRpcValue& step)
+  {
+    uint32_t resources = 0;
+    for (XmlRpc::XmlRpcValue::ValueStruct::const_iterator it = step.begin(); it != step.end(); ++it)
+    {
+      if (it->first == "scene_name")
+        resources |= getResource(ARM);
+      MotionType type;
+      if (!getMotionType(it->first, type))
+        continue;
+      if (type == EXTEND_ARM_BACK)
+      {
+        if (it->second.hasMember("back"))
+          resources |= getResource(EXTEND_ARM_BACK);
+        if (it->second.hasMember("front"))
+          resources |= getResource(EXTEND_ARM_FRONT);
+      }
+      else
+        resources |= getResource(type);
+    }
+    return resources;
+  }
+  // Motion type of a member of a step config, extend_arm gives EXTEND_ARM_BACK for both sides
+  static bool getMotionType(const std::string& key, MotionType& type)
+  {
+    auto it = getMotionTypes().find(key);
+    if (it == getMotionTypes().end())
+      return false;
+    type = it->second;
+    return true;
+  }
+  uint32_t getResources() const
+  {
+    // The planning scene is only used by the arm
+    uint32_t resources = scene_name_.empty() ? 0 : getResource(ARM);
+    for (const auto& motion : motions_)
+      resources |= getResource(motion.type);
+    return resources;
+  }
 
 private:
-  std::string step_name_;
+  static const std::unordered_map<std::string, MotionType>& getMotionTypes()
+  {
+    static const std::unordered_map<std::string, MotionType> types{
+      { "arm", ARM },
+      { "hand", HAND },
+      { "end_effector", END_EFFECTOR },
+      { "stone_num", STONE_NUM },
+      { "chassis", CHASSIS },
+      { "gimbal", GIMBAL },
+      { "gripper", GPIO },
+      { "reversal", REVERSAL },
+      { "ore_lifter", ORE_LIFTER },
+      { "ore_rotator", ORE_ROTATOR },
+      { "gimbal_lifter", GIMBAL_LIFTER },
+      { "extend_arm", EXTEND_ARM_BACK },
+      { "chassis_target", CHASSIS_TARGET },
+      { "silver_lifter", SILVER_LIFTER },
+      { "silver_pusher", SILVER_PUSHER },
+      { "silver_rotator", SILVER_ROTATOR },
+      { "gold_pusher", GOLD_PUSHER },
+      { "gold_lifter", GOLD_LIFTER },
+      { "middle_pitch", MIDDLE_PITCH },
+      { "auto_exchange", AUTO_EXCHANGE },
+    };
+    return types;
+  }
+  void add(MotionType type, uint8_t flags, Motion* motion)
+  {
+    motions_.push_back({ type, flags, motion, 0., -1. });
+  }
+
+  std::string step_name_, scene_name_;
   ros::Publisher planning_result_pub_;
   ros::Publisher point_cloud_pub_;
+  // Owned by the arena of the queue
   MoveitMotionBase* arm_motion_{};
-  HandMotion* hand_motion_{};
-  JointPositionMotion* end_effector_motion_{};
-  JointPointMotion *ore_rotate_motion_{}, *ore_lift_motion_{}, *gimbal_lift_motion_{};
-  JointPointMotion *silver_lifter_motion_{}, *silver_pusher_motion_{}, *silver_rotator_motion_{},
-      *gold_pusher_motion_{}, *gold_lifter_motion_{}, *middle_pitch_motion_{};
-  ExtendMotion *extend_arm_front_motion_{}, *extend_arm_back_motion_{};
-  StoneNumMotion* stone_num_motion_{};
-  ChassisMotion* chassis_motion_{};
-  GimbalMotion* gimbal_motion_{};
-  GpioMotion* gpio_motion_{};
-  ReversalMotion* reversal_motion_{};
-  PlanningScene* planning_scene_{};
-  moveit::planning_interface::PlanningSceneInterface planning_scene_interface_;
-  moveit::planning_interface::MoveGroupInterface& arm_group_;
-  ChassisTargetMotion* chassis_target_motion_{};
+  JointMotion* joint_motion_{};
+  std::vector<CompiledMotion> motions_;
+  PlanningSceneManager& scene_manager_;
+  const PreemptFlag* preempt_{};
+  ros::WallTime move_end_;
 };
 
 }  // namespace engineer_middleware
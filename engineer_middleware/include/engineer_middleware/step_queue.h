@@ -40,10 +40,15 @@
 #include "engineer_middleware/step.h"
 
 // STL
+#include <atomic>
+#include <condition_variable>
 #include <deque>
+#include <future>
+#include <mutex>
 #include <string>
+#include <vector>
 
-#include <actionlib/server/simple_action_server.h>
+#include <actionlib/server/action_server.h>
 #include <rm_msgs/EngineerAction.h>
 
 namespace engineer_middleware
@@ -51,67 +56,145 @@ namespace engineer_middleware
 class StepQueue
 {
 public:
-  StepQueue(const XmlRpc::XmlRpcValue& steps, const XmlRpc::XmlRpcValue& scenes, tf2_ros::Buffer& tf,
-            moveit::planning_interface::MoveGroupInterface& arm_group, ChassisInterface& chassis_interface,
-            ros::Publisher& hand_pub, ros::Publisher& end_effector_pub, ros::Publisher& stone_num_pub,
-            ros::Publisher& gimbal_pub, ros::Publisher& gpio_pub, ros::Publisher& reversal_pub,
-            ros::Publisher& planning_result_pub, ros::Publisher& point_cloud_pub, ros::Publisher& ore_rotate_pub,
-            ros::Publisher& ore_lift_pub, ros::Publisher& gimbal_lift_pub, ros::Publisher& extend_arm_f_pub,
-            ros::Publisher& extend_arm_b_pub, ros::Publisher& silver_lifter_pub, ros::Publisher& silver_pusher_pub,
-            ros::Publisher& silver_rotator_pub, ros::Publisher& gold_pusher_pub, ros::Publisher& gold_lifter_pub,
-            ros::Publisher& middle_pitch_pub)
-    : chassis_interface_(chassis_interface)
+  StepQueue(const std::string& name, const XmlRpc::XmlRpcValue& steps, tf2_ros::Buffer& tf,
+            moveit::planning_interface::MoveGroupInterface& arm_group, ParallelPlanner& parallel_planner,
+            ChassisInterface& chassis_interface, PlanningSceneManager& scene_manager, ros::Publisher& hand_pub,
+            ros::Publisher& end_effector_pub, ros::Publisher& stone_num_pub, ros::Publisher& gimbal_pub,
+            ros::Publisher& gpio_pub, ros::Publisher& reversal_pub, ros::Publisher& planning_result_pub,
+            ros::Publisher& point_cloud_pub, ros::Publisher& ore_rotate_pub, ros::Publisher& ore_lift_pub,
+            ros::Publisher& gimbal_lift_pub, ros::Publisher& extend_arm_f_pub, ros::Publisher& extend_arm_b_pub,
+            ros::Publisher& silver_lifter_pub, ros::Publisher& silver_pusher_pub, ros::Publisher& silver_rotator_pub,
+            ros::Publisher& gold_pusher_pub, ros::Publisher& gold_lifter_pub, ros::Publisher& middle_pitch_pub)
+    : name_(name), chassis_interface_(chassis_interface)
   {
     ROS_ASSERT(steps.getType() == XmlRpc::XmlRpcValue::TypeArray);
+    std::vector<const XmlRpc::XmlRpcValue*> nodes;
+    // Without after, a step waits for the whole previous entry of the list, a parallel block counts as one entry
+    std::vector<size_t> previous;
     for (int i = 0; i < steps.size(); ++i)
-      queue_.emplace_back(steps[i], scenes, tf, arm_group, chassis_interface, hand_pub, end_effector_pub, stone_num_pub,
-                          gimbal_pub, gpio_pub, reversal_pub, planning_result_pub, point_cloud_pub, ore_rotate_pub,
-                          ore_lift_pub, gimbal_lift_pub, extend_arm_f_pub, extend_arm_b_pub, silver_lifter_pub,
-                          silver_pusher_pub, silver_rotator_pub, gold_pusher_pub, gold_lifter_pub, middle_pitch_pub);
+    {
+      if (!steps[i].hasMember("parallel"))
+      {
+        addNode(steps[i], previous, nodes);
+        previous = { nodes.size() - 1 };
+        continue;
+      }
+      const XmlRpc::XmlRpcValue& branches = steps[i]["parallel"];
+      ROS_ASSERT(branches.getType() == XmlRpc::XmlRpcValue::TypeArray);
+      std::vector<size_t> group;
+      for (int j = 0; j < branches.size(); ++j)
+      {
+        addNode(branches[j], previous, nodes);
+        group.push_back(nodes.size() - 1);
+      }
+      previous = group;
+    }
+    for (const auto* node : nodes)
+      queue_.emplace_back(*node, arena_, tf, arm_group, parallel_planner, chassis_interface, scene_manager, hand_pub,
+                          end_effector_pub, stone_num_pub, gimbal_pub, gpio_pub, reversal_pub, planning_result_pub,
+                          point_cloud_pub, ore_rotate_pub, ore_lift_pub, gimbal_lift_pub, extend_arm_f_pub,
+                          extend_arm_b_pub, silver_lifter_pub, silver_pusher_pub, silver_rotator_pub, gold_pusher_pub,
+                          gold_lifter_pub, middle_pitch_pub);
+    for (const auto& step : queue_)
+      resources_ |= step.getResources();
+    // A pass-through arm step only blends into the step right after it, which waits for nothing else
+    for (size_t i = 0; i < queue_.size(); ++i)
+      if (queue_[i].isPassThrough() &&
+          (i + 1 == queue_.size() || after_[i + 1] != std::vector<size_t>{ i } || !queue_[i].blend(queue_[i + 1])))
+        ROS_WARN("Step %s can not pass through, the next step does not move the arm joints after it",
+                 queue_[i].getName().c_str());
   }
-  bool run(actionlib::SimpleActionServer<rm_msgs::EngineerAction>& as)
+  // Sets the terminal state of the goal. Steps run as a graph: a step starts once the steps it comes after have
+  // finished and no running step uses one of its actuators. Every running step is moved and polled by its own thread
+  // with its own timeout, so planning in one branch does not hold up another. When a step fails the others are stopped.
+  bool run(actionlib::ServerGoalHandle<rm_msgs::EngineerAction>& goal, const PreemptFlag& preempt)
   {
     if (queue_.empty())
     {
       ROS_WARN("Step queue is empty");
+      goal.setAborted();
       return false;
     }
-    chassis_interface_.setCurrentAsGoal();
+    if (resources_ & Step::getResource(Step::CHASSIS))
+      chassis_interface_.setCurrentAsGoal();
     rm_msgs::EngineerFeedback feedback;
     rm_msgs::EngineerResult result;
     feedback.total_steps = queue_.size();
-    for (size_t i = 0; i < queue_.size(); ++i)
+    for (auto& step : queue_)
+      step.setPreempt(&preempt);
+
+    std::vector<BranchState> states(queue_.size(), WAITING);
+    std::vector<std::future<BranchState>> branches(queue_.size());
+    std::atomic<bool> is_aborted{ false };
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t exited = 0, finished = 0, running = 0;
+    uint32_t running_resources = 0;
+    bool is_failed = false;
+    while (finished < queue_.size())
     {
-      ros::Time start = ros::Time::now();
-      if (!queue_[i].move())
-        return false;
-      ROS_INFO("Start step: %s", queue_[i].getName().c_str());
-      while (!queue_[i].isFinish())
+      for (size_t i = 0; i < queue_.size() && !is_failed; ++i)
+      {
+        if (states[i] != WAITING || (queue_[i].getResources() & running_resources) || !isReady(i, states))
+          continue;
+        states[i] = RUNNING;
+        running++;
+        running_resources |= queue_[i].getResources();
+        branches[i] = std::async(std::launch::async, [this, i, &preempt, &is_aborted, &mutex, &cv, &exited] {
+          BranchState state = runStep(queue_[i], preempt, is_aborted);
+          std::lock_guard<std::mutex> lock(mutex);
+          exited++;
+          cv.notify_one();
+          return state;
+        });
+      }
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait_for(lock, std::chrono::milliseconds(10), [&] { return exited > finished; });
+      }
+      feedback.current_step.clear();
+      for (size_t i = 0; i < queue_.size(); ++i)
       {
-        if (!queue_[i].checkTimeout(ros::Time::now() - start))
+        if (states[i] != RUNNING)
+          continue;
+        if (branches[i].wait_for(std::chrono::seconds(0)) != std::future_status::ready)
         {
-          queue_[i].stop();
-          return false;
+          feedback.current_step += (feedback.current_step.empty() ? "" : ", ") + queue_[i].getName();
+          continue;
         }
-        if (as.isPreemptRequested() || !ros::ok())
+        states[i] = branches[i].get();
+        running--;
+        running_resources &= ~queue_[i].getResources();
+        finished++;
+        if (states[i] != SUCCEEDED)
         {
-          ROS_INFO("Step %s Preempted", queue_[i].getName().c_str());
-          queue_[i].stop();
-          as.setPreempted();
-          return false;
+          is_failed = true;
+          is_aborted = true;
         }
-        feedback.finished_step = i;
-        feedback.current_step = queue_[i].getName();
-        as.publishFeedback(feedback);
-        ros::Duration(0.01).sleep();
       }
-      feedback.finished_step = queue_.size();
-      as.publishFeedback(feedback);
-      ROS_INFO("Finish step: %s", queue_[i].getName().c_str());
+      if (is_failed && !running)
+        break;
+      feedback.finished_step = finished;
+      goal.publishFeedback(feedback);
+    }
+    if (preempt.isRequested() || !ros::ok())
+    {
+      ROS_INFO("Step queue %s preempted, stop %f ms after the request", name_.c_str(), preempt.getLatency() * 1e3);
+      goal.setCanceled();
+      return false;
+    }
+    if (is_failed)
+    {
+      goal.setAborted();
+      return false;
     }
+    feedback.finished_step = queue_.size();
+    goal.publishFeedback(feedback);
     result.finish = true;
-    deleteScene();
-    as.setSucceeded(result);
+    // Scenes belong to the arm, a queue without it must not clear them under a running arm queue
+    if (resources_ & Step::getResource(Step::ARM))
+      deleteScene();
+    goal.setSucceeded(result);
     return true;
   }
   void deleteScene()
@@ -126,9 +209,124 @@ public:
   {
     return queue_.size();
   }
+  const std::string& getName() const
+  {
+    return name_;
+  }
+
+  // One bit per actuator, see Step::getResource
+  uint32_t getResources() const
+  {
+    return resources_;
+  }
+  const MotionArena& getArena() const
+  {
+    return arena_;
+  }
 
 private:
+  enum BranchState
+  {
+    WAITING,
+    RUNNING,
+    SUCCEEDED,
+    FAILED
+  };
+
+  // after names earlier steps of the queue, a single name or a list. Middleware::isValidStepsList has refused a list
+  // naming an unknown step, so every name is found here.
+  void addNode(const XmlRpc::XmlRpcValue& step, const std::vector<size_t>& previous,
+               std::vector<const XmlRpc::XmlRpcValue*>& nodes)
+  {
+    ROS_ASSERT(step.getType() == XmlRpc::XmlRpcValue::TypeStruct && step.hasMember("step"));
+    std::vector<size_t> after = previous;
+    if (step.hasMember("after"))
+    {
+      XmlRpc::XmlRpcValue names = step["after"];
+      if (names.getType() == XmlRpc::XmlRpcValue::TypeString)
+      {
+        XmlRpc::XmlRpcValue list;
+        list[0] = names;
+        names = list;
+      }
+      ROS_ASSERT(names.getType() == XmlRpc::XmlRpcValue::TypeArray);
+      after.clear();
+      for (int i = 0; i < names.size(); ++i)
+      {
+        const std::string name = static_cast<std::string>(names[i]);
+        size_t j = nodes.size();
+        while (j > 0 && static_cast<std::string>((*nodes[j - 1])["step"]) != name)
+          --j;
+        if (j > 0)
+          after.push_back(j - 1);
+        else
+          ROS_ERROR("Step %s comes after unknown step %s", static_cast<std::string>(step["step"]).c_str(),
+                    name.c_str());
+      }
+    }
+    nodes.push_back(&step);
+    after_.push_back(after);
+  }
+  bool isReady(size_t i, const std::vector<BranchState>& states) const
+  {
+    for (size_t j : after_[i])
+      if (states[j] != SUCCEEDED)
+        return false;
+    return true;
+  }
+  // One branch: move the step and wait for it, preempt also stops the step when another branch has failed
+  BranchState runStep(Step& step, const PreemptFlag& preempt, const std::atomic<bool>& is_aborted) const
+  {
+    ros::Time start = ros::Time::now();
+    ros::WallTime wall_start = ros::WallTime::now();
+    uint32_t polls = 0;
+    if (!step.move())
+    {
+      record(step, false, wall_start, polls, ros::Time::now() - start);
+      if (preempt.isRequested() || !ros::ok())
+        step.stop();
+      return FAILED;
+    }
+    ROS_INFO("Start step: %s", step.getName().c_str());
+    while (!step.isFinish())
+    {
+      polls++;
+      if (!step.checkTimeout(ros::Time::now() - start) || preempt.isRequested() || is_aborted || !ros::ok() ||
+          !preempt.sleep(ros::Duration(0.01)))
+      {
+        step.stop();
+        record(step, false, wall_start, polls, ros::Time::now() - start);
+        return FAILED;
+      }
+    }
+    record(step, true, wall_start, polls + 1, ros::Time::now() - start);
+    ROS_INFO("Finish step: %s", step.getName().c_str());
+    return SUCCEEDED;
+  }
+  void record(const Step& step, bool success, ros::WallTime start, uint32_t polls, ros::Duration period) const
+  {
+    if (!Telemetry::getInstance().isOpen())
+      return;
+    ros::WallTime now = ros::WallTime::now();
+    TelemetryRecord record{};
+    record.setNames(name_, step.getName());
+    record.motion = TelemetryRecord::STEP;
+    record.success = success;
+    record.polls = polls;
+    record.stamp = start.toSec();
+    record.move_time = (step.getMoveEnd() - start).toSec();
+    record.wait_time = (now - step.getMoveEnd()).toSec();
+    record.timeout_margin = step.getTimeoutMargin(period);
+    step.record(record);
+  }
+
+  std::string name_;
+  // Declared before the queue, so motions outlive the steps which point to them
+  MotionArena arena_;
   std::deque<Step> queue_;
+  // Indices of the steps each step waits for
+  std::vector<std::vector<size_t>> after_;
   ChassisInterface& chassis_interface_;
+  uint32_t resources_{};
 };
 }  // namespace engineer_middleware
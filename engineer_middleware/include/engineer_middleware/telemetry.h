@@ -0,0 +1,240 @@
+//
+// Created by agent on 26-10-18.
+//
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <ros/ros.h>
+
+namespace engineer_middleware
+{
+// One record per step, plus one per motion of the step. Times are seconds, fixed size so the log can be read back
+// without parsing.
+struct TelemetryRecord
+{
+  static constexpr uint8_t STEP = 255;
+  char queue[32];
+  char step[48];
+  // Step::MotionType, or STEP for the record of the whole step
+  uint8_t motion;
+  uint8_t success;
+  uint16_t reserved;
+  // Polls of isFinish, for step records
+  uint32_t polls;
+  double stamp;
+  // move() of the step or motion, for the arm this is mostly planning
+  float move_time;
+  // From the end of move() until isFinish, for motions the first poll at which they were finished
+  float wait_time;
+  // Smallest timeout left when the step finished, negative after a timeout
+  float timeout_margin;
+  float reserved_time;
+
+  void setNames(const std::string& queue_name, const std::string& step_name)
+  {
+    std::strncpy(queue, queue_name.c_str(), sizeof(queue) - 1);
+    queue[sizeof(queue) - 1] = '\0';
+    std::strncpy(step, step_name.c_str(), sizeof(step) - 1);
+    step[sizeof(step) - 1] = '\0';
+  }
+};
+
+struct TelemetryFileHeader
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t reserved;
+};
+
+// Bounded multi-producer queue of records, producers never block or take a lock. When the writer falls behind,
+// new records are dropped and counted.
+template <size_t N>
+class TelemetryRing
+{
+  static_assert(N && !(N & (N - 1)), "Size must be a power of two");
+
+public:
+  TelemetryRing()
+  {
+    for (size_t i = 0; i < N; ++i)
+      slots_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  bool push(const TelemetryRecord& record)
+  {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    while (true)
+    {
+      Slot& slot = slots_[pos & (N - 1)];
+      size_t sequence = slot.sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+      if (diff == 0)
+      {
+        if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        {
+          slot.record = record;
+          slot.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      }
+      else if (diff < 0)
+      {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      else
+        pos = tail_.load(std::memory_order_relaxed);
+    }
+  }
+  // Single consumer
+  bool pop(TelemetryRecord& record)
+  {
+    Slot& slot = slots_[head_ & (N - 1)];
+    if (slot.sequence.load(std::memory_order_acquire) != head_ + 1)
+      return false;
+    record = slot.record;
+    slot.sequence.store(head_ + N, std::memory_order_release);
+    ++head_;
+    return true;
+  }
+  size_t getDropped() const
+  {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
+private:
+  struct Slot
+  {
+    std::atomic<size_t> sequence;
+    TelemetryRecord record;
+  };
+  Slot slots_[N];
+  std::atomic<size_t> tail_{ 0 };
+  size_t head_{};
+  std::atomic<size_t> dropped_{ 0 };
+};
+
+// Collects the timing of every step of the node. Records are dropped while no log file is open, otherwise a writer
+// thread appends them to it, so the step loops never touch the disk.
+class Telemetry
+{
+public:
+  static constexpr uint32_t VERSION = 1;
+  static Telemetry& getInstance()
+  {
+    static Telemetry telemetry;
+    return telemetry;
+  }
+  ~Telemetry()
+  {
+    close();
+  }
+
+  bool open(const std::string& path)
+  {
+    close();
+    file_.open(path, std::ios::binary | std::ios::app);
+    if (!file_)
+    {
+      ROS_ERROR("Can not open telemetry log %s", path.c_str());
+      return false;
+    }
+    if (file_.tellp() == 0)
+    {
+      TelemetryFileHeader header{};
+      std::memcpy(header.magic, "STEL", 4);
+      header.version = VERSION;
+      header.record_size = sizeof(TelemetryRecord);
+      file_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    }
+    is_running_ = true;
+    writer_ = std::thread(&Telemetry::write, this);
+    ROS_INFO("Write step telemetry to %s", path.c_str());
+    return true;
+  }
+  void close()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      is_running_ = false;
+    }
+    cv_.notify_one();
+    if (writer_.joinable())
+      writer_.join();
+    // A producer may have seen the log open just before it closed, its record still goes to this file
+    while (producers_ > 0)
+      std::this_thread::yield();
+    if (file_.is_open())
+    {
+      drain();
+      file_.close();
+    }
+  }
+  bool isOpen() const
+  {
+    return is_running_;
+  }
+  void record(const TelemetryRecord& record)
+  {
+    producers_++;
+    if (is_running_)
+      ring_.push(record);
+    producers_--;
+  }
+
+  static bool read(const std::string& path, std::vector<TelemetryRecord>& records)
+  {
+    std::ifstream file(path, std::ios::binary);
+    TelemetryFileHeader header{};
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::strncmp(header.magic, "STEL", 4) != 0 ||
+        header.version != VERSION || header.record_size != sizeof(TelemetryRecord))
+      return false;
+    TelemetryRecord record{};
+    while (file.read(reinterpret_cast<char*>(&record), sizeof(record)))
+      records.push_back(record);
+    return true;
+  }
+
+private:
+  void write()
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true)
+    {
+      cv_.wait_for(lock, std::chrono::milliseconds(100));
+      drain();
+      if (!is_running_)
+        break;
+    }
+    if (ring_.getDropped())
+      ROS_WARN("%zu telemetry records dropped", ring_.getDropped());
+  }
+  void drain()
+  {
+    TelemetryRecord record{};
+    while (ring_.pop(record))
+      file_.write(reinterpret_cast<const char*>(&record), sizeof(record));
+    file_.flush();
+  }
+
+  TelemetryRing<1024> ring_;
+  std::ofstream file_;
+  std::thread writer_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::atomic<bool> is_running_{ false };
+  // Producers inside record(), close waits for them before the last drain
+  std::atomic<int> producers_{ 0 };
+};
+
+}  // namespace engineer_middleware
@@ -0,0 +1,315 @@
+//
+// Created by agent on 26-10-18.
+//
+
+// Headless driver of the auto exchange state machines. A synthetic world integrates the gimbal rates, the chassis
+// velocity and the tool twist commanded by auto_exchange::AutoExchange, and writes the TF they read into a local
+// buffer. The exchanger is seen by a camera on the gimbal with a limited view, latency and noise. Time is a
+// ManualClock stepped at ~rate, so trials run as fast as the CPU allows. Every trial starts from a random exchanger
+// pose, chassis yaw and tool pose. The summary gives the success rate, the time to finish, the time spent in each
+// process and the final position error of the tool.
+//
+// Needs the config loaded into ~auto_exchange on a roscore, like the servoed auto exchange motion, see bag_tf.h.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include <ros/ros.h>
+#include <tf2_eigen/tf2_eigen.h>
+#include <tf2_ros/buffer.h>
+
+#include "engineer_middleware/auto_exchange.h"
+
+using auto_exchange::AutoExchange;
+
+struct TrialResult
+{
+  bool success;
+  double time, final_error;
+  double process_time[AutoExchange::FINISH];
+};
+
+class Driver
+{
+public:
+  Driver(ros::NodeHandle& nh, XmlRpc::XmlRpcValue& config)
+    : buffer_(ros::Duration(30.))
+    // The topics of the state machines are kept in the namespace of the driver, away from a running robot
+    , nh_auto_exchange_(ros::NodeHandle(nh, "", { { "/pnp_publisher", "pnp_publisher" },
+                                                  { "/is_update_exchanger", "is_update_exchanger" } }),
+                        "auto_exchange")
+    , auto_exchange_(config, buffer_, nh_auto_exchange_)
+  {
+    auto_exchange_.setClock(clock_);
+    nh.param("rate", rate_, 100.);
+    nh.param("max_time", max_time_, 30.);
+    nh.param("verbose", verbose_, false);
+    int seed;
+    nh.param("seed", seed, 0);
+    random_.seed(seed);
+    // Camera on the gimbal
+    nh.param("camera_rate", camera_rate_, 30.);
+    nh.param("latency", latency_, 0.05);
+    nh.param("noise_position", noise_position_, 0.005);
+    nh.param("noise_angle", noise_angle_, 0.01);
+    nh.param("fov_yaw", fov_yaw_, 0.5);
+    nh.param("fov_pitch", fov_pitch_, 0.4);
+    // Rad/s of the gimbal at a rate scale of 1
+    nh.param("gimbal_rate", gimbal_rate_, 1.);
+    // Start configurations, the exchanger is placed around the chassis and faces away from it
+    nh.param("distance_min", distance_min_, 1.);
+    nh.param("distance_max", distance_max_, 2.);
+    nh.param("bearing_range", bearing_range_, M_PI);
+    nh.param("exchanger_yaw_range", exchanger_yaw_range_, 0.5);
+    nh.param("height_min", height_min_, 0.2);
+    nh.param("height_max", height_max_, 0.6);
+    nh.param("tool_x", tool_x_, 0.4);
+    nh.param("tool_z", tool_z_, 0.3);
+    nh.param("tool_noise", tool_noise_, 0.05);
+    clock_.set(ros::Time(1000.));
+  }
+  bool isVerbose() const
+  {
+    return verbose_;
+  }
+
+  TrialResult runTrial()
+  {
+    reset();
+    TrialResult result{};
+    double dt = 1. / rate_;
+    ros::Time start = clock_.now();
+    auto_exchange_.init();
+    while ((clock_.now() - start).toSec() < max_time_)
+    {
+      clock_.advance(ros::Duration(dt));
+      integrate(dt);
+      publishWorld(clock_.now());
+      see();
+      int process = auto_exchange_.getProcess();
+      try
+      {
+        auto_exchange_.run();
+      }
+      catch (tf2::TransformException& ex)
+      {
+        ROS_WARN("%s", ex.what());
+        break;
+      }
+      if (process < AutoExchange::FINISH)
+        result.process_time[process] += dt;
+      if (auto_exchange_.getFinishFlag())
+      {
+        result.success = auto_exchange_.getSuccessFlag();
+        break;
+      }
+      command();
+    }
+    result.time = (clock_.now() - start).toSec();
+    result.final_error = (world_.base2tools.inverse() * base2map() * world_.map2exchanger).translation().norm();
+    return result;
+  }
+
+private:
+  struct World
+  {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    double chassis_x, chassis_y, chassis_yaw, gimbal_yaw, gimbal_pitch;
+    Eigen::Isometry3d base2tools, map2exchanger;
+  };
+
+  void reset()
+  {
+    std::uniform_real_distribution<double> unit(-1., 1.);
+    world_.chassis_x = 0.;
+    world_.chassis_y = 0.;
+    world_.chassis_yaw = M_PI * unit(random_);
+    world_.gimbal_yaw = 0.;
+    world_.gimbal_pitch = 0.;
+    world_.base2tools = Eigen::Translation3d(tool_x_ + tool_noise_ * unit(random_), tool_noise_ * unit(random_),
+                                             tool_z_ + tool_noise_ * unit(random_)) *
+                        Eigen::AngleAxisd(tool_noise_ * unit(random_), Eigen::Vector3d::UnitZ());
+    double bearing = world_.chassis_yaw + bearing_range_ * unit(random_);
+    double distance = distance_min_ + (distance_max_ - distance_min_) * (unit(random_) + 1.) / 2.;
+    double height = height_min_ + (height_max_ - height_min_) * (unit(random_) + 1.) / 2.;
+    world_.map2exchanger =
+        Eigen::Translation3d(distance * std::cos(bearing), distance * std::sin(bearing), height) *
+        Eigen::AngleAxisd(bearing + exchanger_yaw_range_ * unit(random_), Eigen::Vector3d::UnitZ());
+    gimbal_scale_.assign(2, 0.);
+    chassis_vel_ = geometry_msgs::Twist();
+    tool_twist_.setZero();
+    is_found_ = false;
+    buffer_.clear();
+    // History behind the first detection, which is stamped in the past
+    publishWorld(clock_.now() - ros::Duration(1.));
+    publishWorld(clock_.now());
+    next_frame_ = clock_.now();
+  }
+  // Applies the commands of the last tick
+  void integrate(double dt)
+  {
+    world_.gimbal_yaw += gimbal_scale_[0] * gimbal_rate_ * dt;
+    world_.gimbal_pitch += gimbal_scale_[1] * gimbal_rate_ * dt;
+    double yaw = world_.chassis_yaw;
+    world_.chassis_x += (chassis_vel_.linear.x * std::cos(yaw) - chassis_vel_.linear.y * std::sin(yaw)) * dt;
+    world_.chassis_y += (chassis_vel_.linear.x * std::sin(yaw) + chassis_vel_.linear.y * std::cos(yaw)) * dt;
+    world_.chassis_yaw += chassis_vel_.angular.z * dt;
+    Eigen::Vector3d angular = tool_twist_.tail<3>() * dt;
+    Eigen::Isometry3d delta = Eigen::Isometry3d::Identity();
+    delta.translation() = tool_twist_.head<3>() * dt;
+    if (angular.norm() > 0.)
+      delta.linear() = Eigen::AngleAxisd(angular.norm(), angular.normalized()).toRotationMatrix();
+    world_.base2tools = world_.base2tools * delta;
+  }
+  // Reads the commands like the servoed auto exchange motion, the approach is left out so the union move servos
+  void command()
+  {
+    gimbal_scale_.assign(2, 0.);
+    chassis_vel_ = geometry_msgs::Twist();
+    tool_twist_.setZero();
+    switch (auto_exchange_.getProcess())
+    {
+      case AutoExchange::FIND:
+        gimbal_scale_ = auto_exchange_.find_->getGimbalScale();
+        break;
+      case AutoExchange::PRE_ADJUST:
+        chassis_vel_ = auto_exchange_.pre_adjusted_->getChassisVelMsg();
+        break;
+      case AutoExchange::MOVE:
+      {
+        auto_exchange::UnionMove* union_move = auto_exchange_.union_move_.get();
+        union_move->changeIsMotionStart(true);
+        union_move->changeIsMotionFinish(true);
+        tool_twist_ = union_move->getServoScale();
+      }
+      break;
+    }
+  }
+  // Frames of the camera come at camera_rate, the exchanger is stamped when the image was taken
+  void see()
+  {
+    if (clock_.now() < next_frame_)
+      return;
+    next_frame_ += ros::Duration(1. / camera_rate_);
+    Eigen::Vector3d exchanger = (base2map() * world_.map2exchanger).translation();
+    double yaw = std::atan2(exchanger.y(), exchanger.x());
+    double pitch = std::atan2(-exchanger.z(), std::hypot(exchanger.x(), exchanger.y()));
+    bool is_visible = std::abs(angles::shortest_angular_distance(world_.gimbal_yaw, yaw)) < fov_yaw_ &&
+                      std::abs(pitch - world_.gimbal_pitch) < fov_pitch_;
+    // Once found the camera is taken to follow the exchanger
+    is_found_ |= is_visible;
+    geometry_msgs::Point middle_point;
+    auto_exchange_.find_->setDetection(is_visible, middle_point);
+    if (!is_found_)
+      return;
+    std::normal_distribution<double> position(0., noise_position_), angle(0., noise_angle_);
+    Eigen::Isometry3d detection = world_.map2exchanger *
+                                  Eigen::Translation3d(position(random_), position(random_), position(random_)) *
+                                  Eigen::AngleAxisd(angle(random_), Eigen::Vector3d::UnitZ());
+    geometry_msgs::TransformStamped transform = tf2::eigenToTransform(detection);
+    transform.header.stamp = clock_.now() - ros::Duration(latency_);
+    transform.header.frame_id = "map";
+    transform.child_frame_id = "exchanger";
+    buffer_.setTransform(transform, "driver");
+  }
+  void publishWorld(const ros::Time& stamp)
+  {
+    setTransform(stamp, "map", "base_link",
+                 Eigen::Translation3d(world_.chassis_x, world_.chassis_y, 0.) *
+                     Eigen::AngleAxisd(world_.chassis_yaw, Eigen::Vector3d::UnitZ()));
+    setTransform(stamp, "base_link", "gimbal_base", Eigen::Isometry3d::Identity());
+    setTransform(stamp, "gimbal_base", "yaw",
+                 Eigen::Isometry3d(Eigen::AngleAxisd(world_.gimbal_yaw, Eigen::Vector3d::UnitZ())));
+    setTransform(stamp, "yaw", "pitch",
+                 Eigen::Isometry3d(Eigen::AngleAxisd(world_.gimbal_pitch, Eigen::Vector3d::UnitY())));
+    setTransform(stamp, "base_link", "tools_link", world_.base2tools);
+  }
+  void setTransform(const ros::Time& stamp, const std::string& parent, const std::string& child,
+                    const Eigen::Isometry3d& pose)
+  {
+    geometry_msgs::TransformStamped transform = tf2::eigenToTransform(pose);
+    transform.header.stamp = stamp;
+    transform.header.frame_id = parent;
+    transform.child_frame_id = child;
+    buffer_.setTransform(transform, "driver");
+  }
+  Eigen::Isometry3d base2map() const
+  {
+    return (Eigen::Translation3d(world_.chassis_x, world_.chassis_y, 0.) *
+            Eigen::AngleAxisd(world_.chassis_yaw, Eigen::Vector3d::UnitZ()))
+        .inverse();
+  }
+
+  tf2_ros::Buffer buffer_;
+  auto_exchange::ManualClock clock_;
+  ros::NodeHandle nh_auto_exchange_;
+  AutoExchange auto_exchange_;
+  std::mt19937 random_;
+  World world_;
+  std::vector<double> gimbal_scale_;
+  geometry_msgs::Twist chassis_vel_;
+  auto_exchange::Vector6d tool_twist_ = auto_exchange::Vector6d::Zero();
+  bool is_found_{}, verbose_{};
+  ros::Time next_frame_;
+  double rate_{}, max_time_{}, camera_rate_{}, latency_{}, noise_position_{}, noise_angle_{}, fov_yaw_{}, fov_pitch_{};
+  double gimbal_rate_{}, distance_min_{}, distance_max_{}, bearing_range_{}, exchanger_yaw_range_{}, height_min_{};
+  double height_max_{}, tool_x_{}, tool_z_{}, tool_noise_{};
+};
+
+int main(int argc, char** argv)
+{
+  ros::init(argc, argv, "auto_exchange_driver");
+  ros::NodeHandle nh("~");
+  XmlRpc::XmlRpcValue config;
+  if (!nh.getParam("auto_exchange", config) || config.getType() != XmlRpc::XmlRpcValue::TypeStruct)
+  {
+    ROS_ERROR("Load an auto exchange config into ~auto_exchange first");
+    return 1;
+  }
+  int trials;
+  nh.param("trials", trials, 100);
+  // The state machines log every process change, which would dominate the run time
+  ros::console::set_logger_level(ROSCONSOLE_DEFAULT_NAME, ros::console::levels::Warn);
+  ros::console::notifyLoggerLevelsChanged();
+  Driver driver(nh, config);
+
+  auto wall_start = std::chrono::steady_clock::now();
+  std::vector<double> times;
+  double simulated = 0., final_error = 0., process_time[AutoExchange::FINISH]{};
+  for (int i = 0; i < trials && ros::ok(); ++i)
+  {
+    TrialResult result = driver.runTrial();
+    simulated += result.time;
+    if (driver.isVerbose())
+      std::printf("%4d %s %7.3f s, find %6.3f s, pre adjust %6.3f s, move %6.3f s, error %.4f m\n", i,
+                  result.success ? "ok  " : "fail", result.time, result.process_time[AutoExchange::FIND],
+                  result.process_time[AutoExchange::PRE_ADJUST], result.process_time[AutoExchange::MOVE],
+                  result.final_error);
+    if (!result.success)
+      continue;
+    times.push_back(result.time);
+    final_error += result.final_error;
+    for (int j = 0; j < AutoExchange::FINISH; ++j)
+      process_time[j] += result.process_time[j];
+  }
+  double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+
+  std::printf("%zu of %d trials succeeded, %.1f s simulated in %.2f s wall (%.0fx real time)\n", times.size(), trials,
+              simulated, wall, wall > 0. ? simulated / wall : 0.);
+  if (times.empty())
+    return 0;
+  std::sort(times.begin(), times.end());
+  double mean = 0.;
+  for (double time : times)
+    mean += time / times.size();
+  size_t n = times.size();
+  std::printf("time mean %.3f s, p50 %.3f s, p90 %.3f s, max %.3f s\n", mean, times[n / 2], times[n * 9 / 10],
+              times.back());
+  std::printf("find %.3f s, pre adjust %.3f s, move %.3f s, final error %.4f m (means of succeeded trials)\n",
+              process_time[AutoExchange::FIND] / n, process_time[AutoExchange::PRE_ADJUST] / n,
+              process_time[AutoExchange::MOVE] / n, final_error / n);
+  return 0;
+}
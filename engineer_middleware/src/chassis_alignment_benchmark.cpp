@@ -0,0 +1,513 @@
+//
+// Created by agent on 26-10-18.
+//
+
+// Regression benchmark of the chassis alignment. The map->base_link stream of a bag is cut into cases, one per
+// recorded move: from where the chassis stood still to where it came to rest next. Every case is replayed offline
+// through ChassisInterface::run, in its trajectory mode as well when ~trajectory gives the limits, and through the
+// pre adjust of the auto exchange (ProAdjust). They drive a plant integrating their velocity commands under
+// base_link, optionally with the lag and dead time of ~plant. The localization jitter recorded while the chassis
+// rested at the goal is added to the pose they read, so they see the noise of the robot. Time is a ManualClock, TF
+// a local buffer, nothing is subscribed or published.
+//
+// The report gives per controller how many cases converge, the convergence time (after which the true pose stays
+// within ~chassis_tolerance_position and ~chassis_tolerance_angular), the time the controller itself declares the
+// goal reached, the overshoot past the goal and the number of non zero commands and sign reversals. It exits with 1
+// when a case does not converge or the mean convergence time is slower than ~baseline by more than ~tolerance.
+//
+// Needs ~chassis and ~auto_pre_adjust loaded on a roscore, see BagTf.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <ros/ros.h>
+#include <tf2_ros/buffer.h>
+
+#include "engineer_middleware/auto_exchange.h"
+#include "engineer_middleware/bag_tf.h"
+#include "engineer_middleware/chassis_interface.h"
+#include "engineer_middleware/plant_model.h"
+
+using namespace engineer_middleware;
+
+struct Pose2d
+{
+  double x{}, y{}, yaw{};
+};
+
+struct AlignmentCase
+{
+  Pose2d start, goal;
+  // Localization error at rest, replayed in a loop
+  std::vector<Pose2d> noise;
+};
+
+struct CaseResult
+{
+  bool is_converged;
+  double convergence_time, finish_time, overshoot, overshoot_yaw, final_error;
+  int commands, reversals;
+};
+
+class AlignmentBenchmark
+{
+public:
+  enum Controller
+  {
+    CHASSIS_INTERFACE,
+    CHASSIS_TRAJECTORY,
+    PRE_ADJUST
+  };
+  explicit AlignmentBenchmark(ros::NodeHandle& nh)
+    : buffer_(ros::Duration(30.))
+    , nh_chassis_(nh, "", { { "/cmd_vel", "cmd_vel" } })
+    , chassis_(nh_chassis_, buffer_)
+  {
+    nh.param("rate", rate_, 100.);
+    nh.param("max_time", max_time_, 10.);
+    nh.param("chassis_tolerance_position", tolerance_position_, 0.01);
+    nh.param("chassis_tolerance_angular", tolerance_angular_, 0.01);
+    // A recorded sample is at rest below these speeds, a case needs rest_time of rest on both ends
+    nh.param("rest_speed", rest_speed_, 0.02);
+    nh.param("rest_yaw_rate", rest_yaw_rate_, 0.05);
+    nh.param("rest_time", rest_time_, 0.5);
+    nh.param("min_distance", min_distance_, 0.05);
+    nh.param("min_angle", min_angle_, 0.05);
+    nh.param("replay_noise", replay_noise_, true);
+    nh.param("verbose", verbose_, false);
+    nh.param("tolerance", tolerance_, 0.2);
+    nh.getParam("baseline", baseline_);
+    nh.getParam("output", output_);
+    XmlRpc::XmlRpcValue plant;
+    if (nh.getParam("plant", plant))
+    {
+      static const char* names[3] = { "x", "y", "yaw" };
+      for (int axis = 0; axis < 3; ++axis)
+      {
+        if (!plant.hasMember(names[axis]))
+          continue;
+        plants_[axis].gain = xmlRpcGetDouble(plant[names[axis]], "gain", 1.);
+        plants_[axis].tau = xmlRpcGetDouble(plant[names[axis]], "tau", 0.);
+        plants_[axis].delay = xmlRpcGetDouble(plant[names[axis]], "delay", 0.);
+      }
+    }
+    chassis_.getGains(chassis_gains_[0], chassis_gains_[1], chassis_gains_[2]);
+    // Limits of the trajectory mode of ChassisInterface, which is benchmarked too when given
+    XmlRpc::XmlRpcValue trajectory;
+    if (nh.getParam("trajectory", trajectory))
+    {
+      limits_ = ChassisLimits(trajectory);
+      is_trajectory_ = true;
+    }
+    if (nh.getParam("auto_pre_adjust", pre_adjust_config_) &&
+        pre_adjust_config_.getType() == XmlRpc::XmlRpcValue::TypeStruct)
+    {
+      ros::NodeHandle nh_pre_adjust(nh, "auto_pre_adjust");
+      pre_adjust_ = std::make_unique<auto_exchange::ProAdjust>(pre_adjust_config_, buffer_, nh_pre_adjust);
+      pre_adjust_->setClock(clock_);
+    }
+    else
+      ROS_WARN("No ~auto_pre_adjust, only ChassisInterface is benchmarked");
+    clock_.set(ros::Time(1000.));
+  }
+
+  bool load(const std::string& path)
+  {
+    BagTf bag;
+    if (!bag.load(path))
+      return false;
+    const tf2::BufferCore& buffer = bag.getBuffer();
+    // Samples at the benchmark rate, a gap in the recording breaks the rest runs and the moves across it
+    double dt = 1. / rate_;
+    std::vector<Pose2d> poses;
+    std::vector<bool> is_valid;
+    for (ros::Time time = bag.getBeginTime(); time <= bag.getEndTime(); time += ros::Duration(dt))
+    {
+      Pose2d pose;
+      try
+      {
+        pose = toPose(buffer.lookupTransform("map", "base_link", time));
+      }
+      catch (tf2::TransformException& ex)
+      {
+        poses.push_back(pose);
+        is_valid.push_back(false);
+        continue;
+      }
+      poses.push_back(pose);
+      is_valid.push_back(true);
+    }
+    // Speeds over a tenth of a second, single samples are dominated by the jitter
+    int window = std::max(1, (int)std::round(0.1 * rate_));
+    std::vector<bool> is_rest(poses.size(), false);
+    for (int i = 0; i + window < (int)poses.size(); ++i)
+    {
+      if (!is_valid[i] || !is_valid[i + window])
+        continue;
+      double speed = std::hypot(poses[i + window].x - poses[i].x, poses[i + window].y - poses[i].y) / (window * dt);
+      double yaw_rate =
+          std::abs(angles::shortest_angular_distance(poses[i].yaw, poses[i + window].yaw)) / (window * dt);
+      is_rest[i] = speed < rest_speed_ && yaw_rate < rest_yaw_rate_;
+    }
+    // Runs of rest long enough, as [begin, end)
+    int min_rest = std::max(1, (int)std::round(rest_time_ * rate_));
+    std::vector<std::pair<int, int>> rests;
+    for (int i = 0; i < (int)is_rest.size();)
+    {
+      int j = i;
+      while (j < (int)is_rest.size() && is_rest[j])
+        j++;
+      if (j - i >= min_rest)
+        rests.emplace_back(i, j);
+      i = std::max(i + 1, j);
+    }
+    for (size_t k = 0; k + 1 < rests.size(); ++k)
+    {
+      int begin = rests[k].second - 1, end = rests[k + 1].first;
+      if (std::find(is_valid.begin() + begin, is_valid.begin() + end, false) != is_valid.begin() + end)
+        continue;
+      AlignmentCase alignment;
+      alignment.start = poses[begin];
+      alignment.goal = meanPose(poses, rests[k + 1].first, rests[k + 1].second);
+      for (int i = rests[k + 1].first; i < rests[k + 1].second; ++i)
+      {
+        Pose2d noise;
+        noise.x = poses[i].x - alignment.goal.x;
+        noise.y = poses[i].y - alignment.goal.y;
+        noise.yaw = angles::shortest_angular_distance(alignment.goal.yaw, poses[i].yaw);
+        alignment.noise.push_back(noise);
+      }
+      double distance = std::hypot(alignment.goal.x - alignment.start.x, alignment.goal.y - alignment.start.y);
+      double angle = std::abs(angles::shortest_angular_distance(alignment.start.yaw, alignment.goal.yaw));
+      if (distance >= min_distance_ || angle >= min_angle_)
+        cases_.push_back(alignment);
+    }
+    if (cases_.empty())
+      ROS_ERROR("No move between two rests of the chassis in %s", path.c_str());
+    return !cases_.empty();
+  }
+
+  void run()
+  {
+    for (size_t i = 0; i < cases_.size() && ros::ok(); ++i)
+    {
+      record("chassis_interface", i, runCase(cases_[i], CHASSIS_INTERFACE));
+      if (is_trajectory_)
+        record("chassis_trajectory", i, runCase(cases_[i], CHASSIS_TRAJECTORY));
+      if (pre_adjust_)
+        record("pro_adjust", i, runCase(cases_[i], PRE_ADJUST));
+    }
+  }
+  void report()
+  {
+    std::ofstream file;
+    if (!output_.empty())
+      file.open(output_);
+    std::printf("%zu cases, %.0f Hz, %s replayed noise\n", cases_.size(), rate_, replay_noise_ ? "with" : "without");
+    for (const auto& controller : results_)
+    {
+      const std::vector<CaseResult>& results = controller.second;
+      std::vector<double> times;
+      double finish = 0., overshoot = 0., overshoot_max = 0., overshoot_yaw_max = 0., error = 0.;
+      double commands = 0., reversals = 0.;
+      int finished = 0;
+      for (const auto& result : results)
+      {
+        if (result.is_converged)
+          times.push_back(result.convergence_time);
+        if (result.finish_time >= 0.)
+        {
+          finish += result.finish_time;
+          finished++;
+        }
+        overshoot += result.overshoot / results.size();
+        overshoot_max = std::max(overshoot_max, result.overshoot);
+        overshoot_yaw_max = std::max(overshoot_yaw_max, result.overshoot_yaw);
+        error += result.final_error / results.size();
+        commands += (double)result.commands / results.size();
+        reversals += (double)result.reversals / results.size();
+      }
+      std::sort(times.begin(), times.end());
+      double mean = 0.;
+      for (double time : times)
+        mean += time / times.size();
+      size_t n = times.size();
+      std::printf("%s: %zu of %zu converged, time mean %.3f s, p50 %.3f s, p90 %.3f s, max %.3f s\n",
+                  controller.first.c_str(), n, results.size(), mean, n ? times[n / 2] : 0.,
+                  n ? times[n * 9 / 10] : 0., n ? times.back() : 0.);
+      std::printf("  finished %d, after %.3f s, overshoot mean %.4f m, max %.4f m, yaw max %.4f rad\n", finished,
+                  finished ? finish / finished : 0., overshoot, overshoot_max, overshoot_yaw_max);
+      std::printf("  %.0f commands, %.1f reversals, final error %.4f m (means of all cases)\n", commands, reversals,
+                  error);
+      means_[controller.first] = mean;
+      if (file)
+        file << controller.first << ":\n  cases: " << results.size() << "\n  converged: " << n
+             << "\n  convergence_time: " << mean << "\n  convergence_time_p90: " << (n ? times[n * 9 / 10] : 0.)
+             << "\n  finish_time: " << (finished ? finish / finished : 0.) << "\n  overshoot: " << overshoot
+             << "\n  overshoot_max: " << overshoot_max << "\n  overshoot_yaw_max: " << overshoot_yaw_max
+             << "\n  commands: " << commands << "\n  reversals: " << reversals << "\n  final_error: " << error
+             << "\n";
+    }
+  }
+  bool check()
+  {
+    bool ok = true;
+    for (const auto& controller : results_)
+    {
+      int failed = 0;
+      for (const auto& result : controller.second)
+        failed += !result.is_converged;
+      if (failed)
+      {
+        ROS_ERROR("%s does not converge in %d of %zu cases", controller.first.c_str(), failed,
+                  controller.second.size());
+        ok = false;
+      }
+      auto baseline = baseline_.find(controller.first);
+      if (baseline != baseline_.end() && means_[controller.first] > baseline->second * (1. + tolerance_))
+      {
+        ROS_ERROR("%s converges in %f s, baseline is %f s", controller.first.c_str(), means_[controller.first],
+                  baseline->second);
+        ok = false;
+      }
+    }
+    return ok;
+  }
+
+private:
+  CaseResult runCase(const AlignmentCase& alignment, Controller controller)
+  {
+    double dt = 1. / rate_;
+    PlantAxis plants[3] = { PlantAxis(plants_[0], dt), PlantAxis(plants_[1], dt), PlantAxis(plants_[2], dt) };
+    Pose2d pose = alignment.start;
+    buffer_.clear();
+    // History behind the first lookup
+    publish(pose, clock_.now() - ros::Duration(1.));
+    publish(pose, clock_.now());
+    if (controller == PRE_ADJUST)
+    {
+      placeExchanger(alignment);
+      pre_adjust_->init();
+    }
+    else
+    {
+      // Clears the pid states of the last case
+      chassis_.setGains(chassis_gains_[0], chassis_gains_[1], chassis_gains_[2]);
+      geometry_msgs::PoseStamped goal;
+      goal.header.frame_id = "map";
+      goal.pose.position.x = alignment.goal.x;
+      goal.pose.position.y = alignment.goal.y;
+      tf2::Quaternion quat;
+      quat.setRPY(0., 0., alignment.goal.yaw);
+      goal.pose.orientation = tf2::toMsg(quat);
+      if (controller == CHASSIS_TRAJECTORY)
+        chassis_.setGoal(goal, limits_);
+      else
+        chassis_.setGoal(goal);
+    }
+
+    // Overshoot is measured along the move, in position and in yaw
+    double dx = alignment.goal.x - alignment.start.x, dy = alignment.goal.y - alignment.start.y;
+    double distance = std::hypot(dx, dy);
+    double turn = angles::shortest_angular_distance(alignment.start.yaw, alignment.goal.yaw);
+    CaseResult result{ false, 0., -1., 0., 0., 0., 0, 0 };
+    double last_cmd[3] = { 0., 0., 0. };
+    int steps = (int)(max_time_ * rate_), last_outside = -1;
+    for (int i = 0; i < steps; ++i)
+    {
+      clock_.advance(ros::Duration(dt));
+      Pose2d measured = pose;
+      if (replay_noise_ && !alignment.noise.empty())
+      {
+        const Pose2d& noise = alignment.noise[i % alignment.noise.size()];
+        measured.x += noise.x;
+        measured.y += noise.y;
+        measured.yaw += noise.yaw;
+      }
+      publish(measured, clock_.now());
+
+      geometry_msgs::Twist cmd;
+      if (controller == PRE_ADJUST)
+      {
+        if (!pre_adjust_->getFinishFlag())
+        {
+          try
+          {
+            pre_adjust_->run();
+          }
+          catch (tf2::TransformException& ex)
+          {
+            ROS_WARN("%s", ex.what());
+            break;
+          }
+          if (pre_adjust_->getFinishFlag())
+          {
+            if (!pre_adjust_->getTimeOutFlag())
+              result.finish_time = i * dt;
+          }
+          else
+            cmd = pre_adjust_->getChassisVelMsg();
+        }
+      }
+      else
+      {
+        chassis_.run(ros::Duration(dt));
+        cmd = chassis_.getVel();
+        // The finish condition of ChassisMotion
+        if (result.finish_time < 0. && chassis_.getErrorPos() < tolerance_position_ &&
+            chassis_.getErrorYaw() < tolerance_angular_)
+          result.finish_time = i * dt;
+      }
+      double values[3] = { cmd.linear.x, cmd.linear.y, cmd.angular.z };
+      bool is_command = false;
+      for (int axis = 0; axis < 3; ++axis)
+      {
+        is_command |= values[axis] != 0.;
+        if (values[axis] * last_cmd[axis] < 0.)
+          result.reversals++;
+        if (values[axis] != 0.)
+          last_cmd[axis] = values[axis];
+      }
+      result.commands += is_command;
+
+      // Velocities under base_link
+      double vx = plants[0].step(values[0]), vy = plants[1].step(values[1]);
+      pose.x += (vx * std::cos(pose.yaw) - vy * std::sin(pose.yaw)) * dt;
+      pose.y += (vx * std::sin(pose.yaw) + vy * std::cos(pose.yaw)) * dt;
+      pose.yaw += plants[2].step(values[2]) * dt;
+
+      double error_x = alignment.goal.x - pose.x, error_y = alignment.goal.y - pose.y;
+      double error_yaw = angles::shortest_angular_distance(pose.yaw, alignment.goal.yaw);
+      if (std::hypot(error_x, error_y) > tolerance_position_ || std::abs(error_yaw) > tolerance_angular_)
+        last_outside = i;
+      if (distance > tolerance_position_)
+        result.overshoot = std::max(result.overshoot, -(error_x * dx + error_y * dy) / distance);
+      if (std::abs(turn) > tolerance_angular_)
+        result.overshoot_yaw = std::max(result.overshoot_yaw, turn > 0. ? -error_yaw : error_yaw);
+      result.final_error = std::hypot(error_x, error_y);
+    }
+    result.is_converged = last_outside < steps - 1;
+    result.convergence_time = (last_outside + 1) * dt;
+    return result;
+  }
+  // The pre adjust aims at offset_refer_exchanger in front of the exchanger, with its yaw scaled by the yaw offset.
+  // The exchanger is put where that goal is the one of the case.
+  void placeExchanger(const AlignmentCase& alignment)
+  {
+    double x_offset = offset("x"), y_offset = offset("y"), yaw_scale = offset("yaw");
+    double cos_yaw = std::cos(alignment.start.yaw), sin_yaw = std::sin(alignment.start.yaw);
+    double dx = alignment.goal.x - alignment.start.x, dy = alignment.goal.y - alignment.start.y;
+    // Goal under base_link at the start
+    double goal_x = cos_yaw * dx + sin_yaw * dy, goal_y = -sin_yaw * dx + cos_yaw * dy;
+    double goal_yaw = angles::shortest_angular_distance(alignment.start.yaw, alignment.goal.yaw);
+    if (yaw_scale == 0.)
+      ROS_WARN_ONCE("The yaw offset of the pre adjust is 0, it keeps the yaw and misses the goal yaw of the cases");
+    double exchanger_x = goal_x + x_offset, exchanger_y = goal_y + y_offset;
+    double exchanger_yaw = alignment.start.yaw + (yaw_scale != 0. ? goal_yaw / yaw_scale : 0.);
+    geometry_msgs::TransformStamped transform;
+    transform.header.stamp = clock_.now();
+    transform.header.frame_id = "map";
+    transform.child_frame_id = "exchanger";
+    transform.transform.translation.x = alignment.start.x + cos_yaw * exchanger_x - sin_yaw * exchanger_y;
+    transform.transform.translation.y = alignment.start.y + sin_yaw * exchanger_x + cos_yaw * exchanger_y;
+    tf2::Quaternion quat;
+    quat.setRPY(0., 0., exchanger_yaw);
+    transform.transform.rotation = tf2::toMsg(quat);
+    buffer_.setTransform(transform, "benchmark", true);
+  }
+  double offset(const std::string& axis)
+  {
+    if (!pre_adjust_config_.hasMember(axis))
+      return 0.;
+    return xmlRpcGetDouble(pre_adjust_config_[axis], "offset_refer_exchanger", 0.);
+  }
+  void publish(const Pose2d& pose, const ros::Time& stamp)
+  {
+    geometry_msgs::TransformStamped transform;
+    transform.header.stamp = stamp;
+    transform.header.frame_id = "map";
+    transform.child_frame_id = "base_link";
+    transform.transform.translation.x = pose.x;
+    transform.transform.translation.y = pose.y;
+    tf2::Quaternion quat;
+    quat.setRPY(0., 0., pose.yaw);
+    transform.transform.rotation = tf2::toMsg(quat);
+    buffer_.setTransform(transform, "benchmark");
+  }
+  void record(const std::string& controller, size_t index, const CaseResult& result)
+  {
+    results_[controller].push_back(result);
+    if (verbose_)
+      std::printf("%4zu %-18s %s %7.3f s, finish %7.3f s, overshoot %.4f m %.4f rad, %d commands, %d reversals\n",
+                  index, controller.c_str(), result.is_converged ? "ok  " : "fail", result.convergence_time,
+                  result.finish_time, result.overshoot, result.overshoot_yaw, result.commands, result.reversals);
+  }
+  static Pose2d toPose(const geometry_msgs::TransformStamped& transform)
+  {
+    Pose2d pose;
+    double roll, pitch;
+    pose.x = transform.transform.translation.x;
+    pose.y = transform.transform.translation.y;
+    quatToRPY(transform.transform.rotation, roll, pitch, pose.yaw);
+    return pose;
+  }
+  static Pose2d meanPose(const std::vector<Pose2d>& poses, int begin, int end)
+  {
+    Pose2d mean;
+    double sin_sum = 0., cos_sum = 0.;
+    for (int i = begin; i < end; ++i)
+    {
+      mean.x += poses[i].x / (end - begin);
+      mean.y += poses[i].y / (end - begin);
+      sin_sum += std::sin(poses[i].yaw);
+      cos_sum += std::cos(poses[i].yaw);
+    }
+    mean.yaw = std::atan2(sin_sum, cos_sum);
+    return mean;
+  }
+
+  tf2_ros::Buffer buffer_;
+  auto_exchange::ManualClock clock_;
+  ros::NodeHandle nh_chassis_;
+  ChassisInterface chassis_;
+  control_toolbox::Pid::Gains chassis_gains_[3];
+  XmlRpc::XmlRpcValue pre_adjust_config_;
+  std::unique_ptr<auto_exchange::ProAdjust> pre_adjust_;
+  Plant plants_[3];
+  ChassisLimits limits_;
+  bool is_trajectory_{};
+  std::vector<AlignmentCase> cases_;
+  std::map<std::string, std::vector<CaseResult>> results_;
+  std::map<std::string, double> baseline_, means_;
+  std::string output_;
+  double rate_{}, max_time_{}, tolerance_position_{}, tolerance_angular_{}, rest_speed_{}, rest_yaw_rate_{};
+  double rest_time_{}, min_distance_{}, min_angle_{}, tolerance_{};
+  bool replay_noise_{}, verbose_{};
+};
+
+int main(int argc, char** argv)
+{
+  ros::init(argc, argv, "chassis_alignment_benchmark");
+  ros::NodeHandle nh("~");
+  std::string bag;
+  if (!nh.getParam("bag", bag))
+  {
+    ROS_ERROR("Give a bag with the map->base_link TF of the chassis in ~bag");
+    return 1;
+  }
+  // The pre adjust logs every process change
+  ros::console::set_logger_level(ROSCONSOLE_DEFAULT_NAME, ros::console::levels::Warn);
+  ros::console::notifyLoggerLevelsChanged();
+  AlignmentBenchmark benchmark(nh);
+  if (!benchmark.load(bag))
+    return 1;
+  benchmark.run();
+  benchmark.report();
+  return benchmark.check() ? 0 : 1;
+}
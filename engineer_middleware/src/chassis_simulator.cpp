@@ -0,0 +1,83 @@
+//
+// Created by agent on 26-10-18.
+//
+
+// Kinematic chassis for the benchmark: integrates /cmd_vel, which is given in base_link, and broadcasts map to
+// base_link. There is no dynamics, the velocity is only clamped, so results do not depend on a physics engine.
+
+#include <ros/ros.h>
+#include <geometry_msgs/Twist.h>
+#include <tf2/LinearMath/Quaternion.h>
+#include <tf2_geometry_msgs/tf2_geometry_msgs.h>
+#include <tf2_ros/transform_broadcaster.h>
+
+class ChassisSimulator
+{
+public:
+  explicit ChassisSimulator(ros::NodeHandle& nh)
+  {
+    nh.param("rate", rate_, 200.);
+    nh.param("max_linear_vel", max_linear_vel_, 3.);
+    nh.param("max_angular_vel", max_angular_vel_, 6.);
+    nh.param("cmd_timeout", cmd_timeout_, 0.2);
+    cmd_sub_ = nh.subscribe("/cmd_vel", 1, &ChassisSimulator::cmdCB, this);
+  }
+  void run()
+  {
+    ros::Rate loop_rate(rate_);
+    ros::Time last = ros::Time::now();
+    while (ros::ok())
+    {
+      ros::spinOnce();
+      ros::Time now = ros::Time::now();
+      double dt = (now - last).toSec();
+      last = now;
+      // Stop like the real chassis when the middleware stops sending
+      if ((now - last_cmd_).toSec() > cmd_timeout_)
+        cmd_ = geometry_msgs::Twist();
+      double vx = clamp(cmd_.linear.x, max_linear_vel_), vy = clamp(cmd_.linear.y, max_linear_vel_);
+      x_ += (vx * std::cos(yaw_) - vy * std::sin(yaw_)) * dt;
+      y_ += (vx * std::sin(yaw_) + vy * std::cos(yaw_)) * dt;
+      yaw_ += clamp(cmd_.angular.z, max_angular_vel_) * dt;
+
+      geometry_msgs::TransformStamped transform;
+      transform.header.stamp = now;
+      transform.header.frame_id = "map";
+      transform.child_frame_id = "base_link";
+      transform.transform.translation.x = x_;
+      transform.transform.translation.y = y_;
+      tf2::Quaternion quat;
+      quat.setRPY(0., 0., yaw_);
+      transform.transform.rotation = tf2::toMsg(quat);
+      broadcaster_.sendTransform(transform);
+      loop_rate.sleep();
+    }
+  }
+
+private:
+  void cmdCB(const geometry_msgs::TwistConstPtr& msg)
+  {
+    cmd_ = *msg;
+    last_cmd_ = ros::Time::now();
+  }
+  static double clamp(double value, double limit)
+  {
+    return std::max(-limit, std::min(limit, value));
+  }
+
+  ros::Subscriber cmd_sub_;
+  tf2_ros::TransformBroadcaster broadcaster_;
+  geometry_msgs::Twist cmd_;
+  ros::Time last_cmd_;
+  double rate_{}, max_linear_vel_{}, max_angular_vel_{}, cmd_timeout_{};
+  double x_{}, y_{}, yaw_{};
+};
+
+int main(int argc, char** argv)
+{
+  ros::init(argc, argv, "chassis_simulator");
+  ros::NodeHandle nh("~");
+  ChassisSimulator simulator(nh);
+  simulator.run();
+  return 0;
+}
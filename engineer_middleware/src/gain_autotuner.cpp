@@ -0,0 +1,468 @@
+//
+// Created by agent on 26-10-18.
+//
+
+// Offline gain tuning of the chassis and the exchange servo. A plant per axis is identified from a bag: the
+// velocity commands on ~chassis_cmd_topic and ~servo_cmd_topic against the velocities of base_link in map and of
+// ~servo_frame under ~servo_base_frame, taken from /tf. Then p and d of every axis are searched on a grid around
+// the current gains: the chassis through ChassisInterface::run with the gains of ~chassis, the servo through the
+// PoseServo of AutoServoMove with the axes of ~auto_servo_move. Each candidate is run from every step size of the
+// axis, its cost is the longest settle time, candidates with more overshoot than ~max_overshoot or which do not
+// settle within ~sim_time are dropped. The tuned gains are printed as YAML for chassis/x/pid and friends, and
+// written to ~output when given.
+//
+// Needs ~chassis and ~auto_servo_move loaded on a roscore, see BagTf.
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <ros/ros.h>
+#include <tf2_eigen/tf2_eigen.h>
+#include <tf2_ros/buffer.h>
+
+#include "engineer_middleware/bag_tf.h"
+#include "engineer_middleware/chassis_interface.h"
+#include "engineer_middleware/plant_model.h"
+#include "engineer_middleware/pose_servo.h"
+
+using namespace engineer_middleware;
+
+// Commands of a topic held until the next one or the timeout
+class CommandStream
+{
+public:
+  void add(const ros::Time& stamp, const geometry_msgs::Twist& twist)
+  {
+    stamps_.push_back(stamp);
+    twists_.push_back(twist);
+  }
+  bool empty() const
+  {
+    return stamps_.empty();
+  }
+  ros::Time begin() const
+  {
+    return stamps_.front();
+  }
+  ros::Time end() const
+  {
+    return stamps_.back();
+  }
+  // Axes 0 to 5 are linear then angular, times have to be asked in order
+  double get(const ros::Time& time, int axis, double timeout)
+  {
+    while (next_ < stamps_.size() && stamps_[next_] <= time)
+      next_++;
+    if (next_ == 0 || (time - stamps_[next_ - 1]).toSec() > timeout)
+      return 0.;
+    const geometry_msgs::Twist& twist = twists_[next_ - 1];
+    double values[6] = { twist.linear.x, twist.linear.y, twist.linear.z, twist.angular.x, twist.angular.y,
+                         twist.angular.z };
+    return values[axis];
+  }
+
+private:
+  std::vector<ros::Time> stamps_;
+  std::vector<geometry_msgs::Twist> twists_;
+  size_t next_{};
+};
+
+class GainAutotuner
+{
+public:
+  explicit GainAutotuner(ros::NodeHandle& nh)
+    : nh_chassis_(nh, "", { { "/cmd_vel", "cmd_vel" } }), chassis_(nh_chassis_, chassis_buffer_)
+  {
+    nh.param("chassis_cmd_topic", chassis_cmd_topic_, std::string("/cmd_vel"));
+    nh.param("servo_cmd_topic", servo_cmd_topic_, std::string("/servo_server/delta_twist_cmds"));
+    nh.param("servo_frame", servo_frame_, std::string("tools_link"));
+    nh.param("servo_base_frame", servo_base_frame_, std::string("base_link"));
+    nh.param("cmd_timeout", cmd_timeout_, 0.2);
+    nh.param("identify_rate", identify_rate_, 100.);
+    nh.param("rate", rate_, 100.);
+    nh.param("sim_time", sim_time_, 5.);
+    nh.param("max_overshoot", max_overshoot_, 0.05);
+    nh.param("chassis_tolerance", chassis_tolerance_, 0.01);
+    nh.param("chassis_yaw_tolerance", chassis_yaw_tolerance_, 0.02);
+    if (!nh.getParam("chassis_steps", chassis_steps_))
+      chassis_steps_ = { 0.2, 1. };
+    if (!nh.getParam("chassis_yaw_steps", chassis_yaw_steps_))
+      chassis_yaw_steps_ = { 0.2, 1. };
+    if (!nh.getParam("servo_steps", servo_steps_))
+      servo_steps_ = { 0.02, 0.1 };
+    if (!nh.getParam("servo_angle_steps", servo_angle_steps_))
+      servo_angle_steps_ = { 0.05, 0.2 };
+    nh.getParam("auto_servo_move", servo_config_);
+  }
+
+  bool load(const std::string& path)
+  {
+    BagTf bag;
+    bool is_loaded = bag.load(path, [this](const rosbag::MessageInstance& message) {
+      if (message.getTopic() == chassis_cmd_topic_)
+      {
+        geometry_msgs::Twist::ConstPtr twist = message.instantiate<geometry_msgs::Twist>();
+        if (twist)
+          chassis_cmds_.add(message.getTime(), *twist);
+      }
+      else if (message.getTopic() == servo_cmd_topic_)
+      {
+        geometry_msgs::TwistStamped::ConstPtr twist = message.instantiate<geometry_msgs::TwistStamped>();
+        if (twist)
+          servo_cmds_.add(message.getTime(), twist->twist);
+      }
+    });
+    if (!is_loaded)
+      return false;
+    const tf2::BufferCore& buffer = bag.getBuffer();
+    // Chassis axes are x, y and yaw of base_link in map, servo axes all six of the servo frame
+    identify(buffer, chassis_cmds_, "map", "base_link", { 0, 1, 5 }, chassis_plants_);
+    identify(buffer, servo_cmds_, servo_base_frame_, servo_frame_, { 0, 1, 2, 3, 4, 5 }, servo_plants_);
+    return true;
+  }
+
+  std::string tune()
+  {
+    std::ostringstream yaml;
+    if (!chassis_cmds_.empty())
+      tuneChassis(yaml);
+    else
+      ROS_WARN("No chassis commands on %s, the chassis is not tuned", chassis_cmd_topic_.c_str());
+    if (!servo_cmds_.empty() && servo_config_.getType() == XmlRpc::XmlRpcValue::TypeStruct)
+      tuneServo(yaml);
+    else
+      ROS_WARN("No servo commands on %s or no ~auto_servo_move, the servo is not tuned", servo_cmd_topic_.c_str());
+    return yaml.str();
+  }
+
+private:
+  struct Candidate
+  {
+    double p, d, cost;
+    bool is_feasible;
+  };
+
+  void identify(const tf2::BufferCore& buffer, CommandStream& cmds, const std::string& parent, const std::string& child,
+                const std::vector<int>& axes, Plant plants[6])
+  {
+    if (cmds.empty())
+      return;
+    double dt = 1. / identify_rate_;
+    std::vector<std::vector<PlantSegment>> segments(6);
+    bool is_continuous = false;
+    for (ros::Time time = cmds.begin(); time <= cmds.end() + ros::Duration(1.); time += ros::Duration(dt))
+    {
+      Eigen::Isometry3d current, next;
+      try
+      {
+        current = tf2::transformToEigen(buffer.lookupTransform(parent, child, time));
+        next = tf2::transformToEigen(buffer.lookupTransform(parent, child, time + ros::Duration(dt)));
+      }
+      catch (tf2::TransformException& ex)
+      {
+        is_continuous = false;
+        continue;
+      }
+      // Velocity in the moving frame, where the commands are given
+      Eigen::Isometry3d delta = current.inverse() * next;
+      Eigen::AngleAxisd rotation(delta.rotation());
+      Eigen::Vector3d angular = rotation.angle() * rotation.axis();
+      Eigen::Vector3d linear = delta.translation() / dt;
+      angular /= dt;
+      double velocity[6] = { linear.x(), linear.y(), linear.z(), angular.x(), angular.y(), angular.z() };
+      for (int axis : axes)
+      {
+        if (!is_continuous)
+          segments[axis].emplace_back();
+        segments[axis].back().command.push_back(cmds.get(time, axis, cmd_timeout_));
+        segments[axis].back().velocity.push_back(velocity[axis]);
+      }
+      is_continuous = true;
+    }
+    static const char* names[6] = { "x", "y", "z", "roll", "pitch", "yaw" };
+    for (int axis : axes)
+    {
+      plants[axis] = identifyPlant(segments[axis], dt);
+      if (plants[axis].fit < 0.)
+        ROS_WARN("%s %s: no excitation, taken as ideal", child.c_str(), names[axis]);
+      else
+        ROS_INFO("%s %s: gain %.3f, tau %.3f s, delay %.3f s, rms %.4f", child.c_str(), names[axis],
+                 plants[axis].gain, plants[axis].tau, plants[axis].delay, std::sqrt(plants[axis].fit));
+    }
+  }
+
+  // Chassis
+
+  void tuneChassis(std::ostream& yaml)
+  {
+    control_toolbox::Pid::Gains gains[3];
+    chassis_.getGains(gains[0], gains[1], gains[2]);
+    static const char* names[3] = { "x", "y", "yaw" };
+    yaml << "chassis:\n";
+    for (int axis = 0; axis < 3; ++axis)
+    {
+      double p0 = gains[axis].p_gain_ > 0. ? gains[axis].p_gain_ : 1.;
+      Candidate current = evaluateChassis(gains, axis, gains[axis].p_gain_, gains[axis].d_gain_);
+      Candidate best =
+          search(p0, [&](double p_try, double d_try) { return evaluateChassis(gains, axis, p_try, d_try); });
+      report(std::string("chassis ") + names[axis], current, best);
+      if (best.is_feasible)
+      {
+        gains[axis].p_gain_ = best.p;
+        gains[axis].d_gain_ = best.d;
+      }
+      const control_toolbox::Pid::Gains& g = gains[axis];
+      yaml << "  " << names[axis] << ":\n    pid: { p: " << g.p_gain_ << ", i: " << g.i_gain_ << ", d: " << g.d_gain_
+           << ", i_clamp_max: " << g.i_max_ << ", i_clamp_min: " << g.i_min_
+           << ", antiwindup: " << (g.antiwindup_ ? "true" : "false") << ", publish_state: true }\n";
+    }
+  }
+  Candidate evaluateChassis(const control_toolbox::Pid::Gains gains[3], int axis, double p, double d)
+  {
+    control_toolbox::Pid::Gains tried[3] = { gains[0], gains[1], gains[2] };
+    tried[axis].p_gain_ = p;
+    tried[axis].d_gain_ = d;
+    const std::vector<double>& steps = axis == 2 ? chassis_yaw_steps_ : chassis_steps_;
+    double tolerance = axis == 2 ? chassis_yaw_tolerance_ : chassis_tolerance_;
+    Candidate candidate{ p, d, 0., true };
+    for (double step : steps)
+    {
+      chassis_.setGains(tried[0], tried[1], tried[2]);
+      StepResponse response = evaluateStep(simulateChassis(axis, step), tolerance, 1. / rate_);
+      candidate.cost = std::max(candidate.cost, response.settle_time);
+      candidate.is_feasible &= response.is_settled && response.overshoot <= max_overshoot_;
+    }
+    return candidate;
+  }
+  // Error of the axis while ChassisInterface drives the identified plants from a step away of the goal
+  std::vector<double> simulateChassis(int axis, double step)
+  {
+    double dt = 1. / rate_, pose[3] = { 0., 0., 0. };
+    PlantAxis plants[3] = { PlantAxis(chassis_plants_[0], dt), PlantAxis(chassis_plants_[1], dt),
+                            PlantAxis(chassis_plants_[5], dt) };
+    chassis_buffer_.clear();
+    publishChassis(pose);
+    geometry_msgs::PoseStamped goal;
+    goal.header.frame_id = "map";
+    goal.pose.position.x = axis == 0 ? step : 0.;
+    goal.pose.position.y = axis == 1 ? step : 0.;
+    tf2::Quaternion quat;
+    quat.setRPY(0., 0., axis == 2 ? step : 0.);
+    goal.pose.orientation = tf2::toMsg(quat);
+    chassis_.setGoal(goal);
+    std::vector<double> error;
+    for (int i = 0; i < (int)(sim_time_ * rate_); ++i)
+    {
+      error.push_back(step - pose[axis]);
+      chassis_.run(ros::Duration(dt));
+      const geometry_msgs::Twist& cmd = chassis_.getVel();
+      double vx = plants[0].step(cmd.linear.x), vy = plants[1].step(cmd.linear.y);
+      pose[0] += (vx * std::cos(pose[2]) - vy * std::sin(pose[2])) * dt;
+      pose[1] += (vx * std::sin(pose[2]) + vy * std::cos(pose[2])) * dt;
+      pose[2] += plants[2].step(cmd.angular.z) * dt;
+      chassis_time_ += ros::Duration(dt);
+      publishChassis(pose);
+    }
+    return error;
+  }
+  void publishChassis(const double pose[3])
+  {
+    geometry_msgs::TransformStamped transform;
+    transform.header.stamp = chassis_time_;
+    transform.header.frame_id = "map";
+    transform.child_frame_id = "base_link";
+    transform.transform.translation.x = pose[0];
+    transform.transform.translation.y = pose[1];
+    tf2::Quaternion quat;
+    quat.setRPY(0., 0., pose[2]);
+    transform.transform.rotation = tf2::toMsg(quat);
+    chassis_buffer_.setTransform(transform, "autotuner");
+  }
+
+  // Servo
+
+  void tuneServo(std::ostream& yaml)
+  {
+    static const char* names[6] = { "x", "y", "z", "roll", "pitch", "yaw" };
+    XmlRpc::XmlRpcValue tuned = servo_config_;
+    yaml << "auto_servo_move:\n";
+    for (int axis = 0; axis < 6; ++axis)
+    {
+      if (!tuned.hasMember(names[axis]))
+        continue;
+      XmlRpc::XmlRpcValue& config = tuned[names[axis]];
+      // A rotation without a weight is not servoed, there is nothing to tune
+      if (axis >= 3 && xmlRpcGetDouble(config, "offset_refer_exchanger", 0.) == 0.)
+        continue;
+      double p = config.hasMember("pid") ? xmlRpcGetDouble(config["pid"], "p", 0.) : 0.;
+      double d = config.hasMember("pid") ? xmlRpcGetDouble(config["pid"], "d", 0.) : 0.;
+      Candidate current = evaluateServo(tuned, axis, p, d);
+      Candidate best = search(p > 0. ? p : 1.,
+                              [&](double p_try, double d_try) { return evaluateServo(tuned, axis, p_try, d_try); });
+      report(std::string("servo ") + names[axis], current, best);
+      if (best.is_feasible)
+        setServoGains(config, best.p, best.d);
+      yaml << "  " << names[axis] << ": ";
+      writeYaml(yaml, config);
+      yaml << "\n";
+    }
+  }
+  // p_far keeps its ratio to p, so the schedule keeps its shape
+  static void setServoGains(XmlRpc::XmlRpcValue& config, double p, double d)
+  {
+    double p_old = config.hasMember("pid") ? xmlRpcGetDouble(config["pid"], "p", 0.) : 0.;
+    if (config.hasMember("p_far") && p_old > 0.)
+      config["p_far"] = xmlRpcGetDouble(config, "p_far", p_old) * p / p_old;
+    config["pid"]["p"] = p;
+    config["pid"]["d"] = d;
+  }
+  Candidate evaluateServo(const XmlRpc::XmlRpcValue& config, int axis, double p, double d)
+  {
+    static const char* names[6] = { "x", "y", "z", "roll", "pitch", "yaw" };
+    XmlRpc::XmlRpcValue tried = config;
+    setServoGains(tried[names[axis]], p, d);
+    double tolerance = xmlRpcGetDouble(tried[names[axis]], "tolerance", 0.01);
+    Candidate candidate{ p, d, 0., true };
+    for (double step : axis < 3 ? servo_steps_ : servo_angle_steps_)
+    {
+      StepResponse response = evaluateStep(simulateServo(tried, axis, step), tolerance, 1. / rate_);
+      candidate.cost = std::max(candidate.cost, response.settle_time);
+      candidate.is_feasible &= response.is_settled && response.overshoot <= max_overshoot_;
+    }
+    return candidate;
+  }
+  // Error of the axis while the servo drives the identified plants of the tool from a step away of the goal
+  std::vector<double> simulateServo(XmlRpc::XmlRpcValue& config, int axis, double step)
+  {
+    double dt = 1. / rate_;
+    auto_exchange::PoseServo servo;
+    servo.init(config);
+    std::vector<PlantAxis> plants;
+    for (int i = 0; i < 6; ++i)
+      plants.emplace_back(servo_plants_[i], dt);
+    Eigen::Vector3d offset(servo.getOffset(auto_exchange::PoseServo::X), servo.getOffset(auto_exchange::PoseServo::Y),
+                           servo.getOffset(auto_exchange::PoseServo::Z));
+    // Exchanger under the tool, the goal moved by the step along or about the axis
+    Eigen::Isometry3d tools2exchanger = Eigen::Isometry3d::Identity();
+    tools2exchanger.translation() = offset;
+    if (axis < 3)
+      tools2exchanger.translation()[axis] += step;
+    else
+      tools2exchanger.linear() = Eigen::AngleAxisd(step, Eigen::Vector3d::Unit(axis - 3)).toRotationMatrix();
+    std::vector<double> error;
+    for (int i = 0; i < (int)(sim_time_ * rate_); ++i)
+    {
+      geometry_msgs::Transform transform = tf2::eigenToTransform(tools2exchanger).transform;
+      const auto_exchange::Vector6d& twist = servo.update(transform, i ? dt : 0.);
+      error.push_back(servo.getError()[axis]);
+      Eigen::Vector3d linear, angular;
+      for (int j = 0; j < 3; ++j)
+      {
+        linear[j] = plants[j].step(twist[j]) * dt;
+        angular[j] = plants[j + 3].step(twist[j + 3]) * dt;
+      }
+      Eigen::Isometry3d delta = Eigen::Isometry3d::Identity();
+      delta.translation() = linear;
+      if (angular.norm() > 0.)
+        delta.linear() = Eigen::AngleAxisd(angular.norm(), angular.normalized()).toRotationMatrix();
+      // The tool moves by delta in its own frame
+      tools2exchanger = delta.inverse() * tools2exchanger;
+    }
+    return error;
+  }
+
+  // Log spaced p from a quarter to four times the current one, d from 0 to a fifth of p
+  template <typename Evaluate>
+  static Candidate search(double p0, Evaluate evaluate)
+  {
+    Candidate best{ 0., 0., 1e10, false };
+    for (int i = 0; i <= 24; ++i)
+    {
+      double p = p0 * std::pow(16., i / 24.) / 4.;
+      for (int j = 0; j <= 5; ++j)
+      {
+        Candidate candidate = evaluate(p, p * 0.04 * j);
+        if (candidate.is_feasible && (!best.is_feasible || candidate.cost < best.cost))
+          best = candidate;
+      }
+    }
+    return best;
+  }
+  static void report(const std::string& name, const Candidate& current, const Candidate& best)
+  {
+    std::printf("# %-14s current p %8.3f d %7.3f: %s %.3f s | tuned p %8.3f d %7.3f: %s %.3f s\n", name.c_str(),
+                current.p, current.d, current.is_feasible ? "settles" : "fails  ", current.cost, best.p, best.d,
+                best.is_feasible ? "settles" : "none   ", best.cost);
+  }
+  static void writeYaml(std::ostream& out, XmlRpc::XmlRpcValue& value)
+  {
+    switch (value.getType())
+    {
+      case XmlRpc::XmlRpcValue::TypeStruct:
+      {
+        out << "{ ";
+        bool first = true;
+        for (auto& member : value)
+        {
+          out << (first ? "" : ", ") << member.first << ": ";
+          writeYaml(out, member.second);
+          first = false;
+        }
+        out << " }";
+        break;
+      }
+      case XmlRpc::XmlRpcValue::TypeBoolean:
+        out << (static_cast<bool>(value) ? "true" : "false");
+        break;
+      case XmlRpc::XmlRpcValue::TypeInt:
+        out << static_cast<int>(value);
+        break;
+      case XmlRpc::XmlRpcValue::TypeDouble:
+        out << static_cast<double>(value);
+        break;
+      case XmlRpc::XmlRpcValue::TypeString:
+        out << "\"" << static_cast<std::string>(value) << "\"";
+        break;
+      default:
+        out << "~";
+    }
+  }
+
+  ros::NodeHandle nh_chassis_;
+  tf2_ros::Buffer chassis_buffer_{ ros::Duration(30.) };
+  ChassisInterface chassis_;
+  ros::Time chassis_time_{ 1000. };
+  std::string chassis_cmd_topic_, servo_cmd_topic_, servo_frame_, servo_base_frame_;
+  double cmd_timeout_{}, identify_rate_{}, rate_{}, sim_time_{}, max_overshoot_{};
+  double chassis_tolerance_{}, chassis_yaw_tolerance_{};
+  std::vector<double> chassis_steps_, chassis_yaw_steps_, servo_steps_, servo_angle_steps_;
+  XmlRpc::XmlRpcValue servo_config_;
+  CommandStream chassis_cmds_, servo_cmds_;
+  Plant chassis_plants_[6], servo_plants_[6];
+};
+
+int main(int argc, char** argv)
+{
+  ros::init(argc, argv, "gain_autotuner");
+  ros::NodeHandle nh("~");
+  std::string bag, output;
+  if (!nh.getParam("bag", bag))
+  {
+    ROS_ERROR("Give a bag with /tf and the velocity commands in ~bag");
+    return 1;
+  }
+  GainAutotuner tuner(nh);
+  if (!tuner.load(bag))
+    return 1;
+  std::string yaml = tuner.tune();
+  std::printf("%s", yaml.c_str());
+  if (nh.getParam("output", output))
+  {
+    std::ofstream file(output);
+    file << yaml;
+  }
+  return 0;
+}
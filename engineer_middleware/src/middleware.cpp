@@ -37,14 +37,18 @@
 
 #include "engineer_middleware/middleware.h"
 #include <unistd.h>
+#include <set>
 namespace engineer_middleware
 {
 Middleware::Middleware(ros::NodeHandle& nh)
   : nh_(nh)
   , as_(
-        nh_, "move_steps", [this](auto&& PH1) { executeCB(std::forward<decltype(PH1)>(PH1)); }, false)
+        nh_, "move_steps", [this](auto&& PH1) { goalCB(std::forward<decltype(PH1)>(PH1)); },
+        [this](auto&& PH1) { cancelCB(std::forward<decltype(PH1)>(PH1)); }, false)
   , arm_group_(moveit::planning_interface::MoveGroupInterface("engineer_arm"))
+  , parallel_planner_(arm_group_)
   , chassis_interface_(nh, tf_)
+  , scene_manager_(planning_scene_interface_, arm_group_.getPlanningFrame())
   , hand_pub_(nh.advertise<std_msgs::Float64>("/controllers/hand_controller/command", 10))
   , end_effector_pub_(nh.advertise<std_msgs::Float64>("/controllers/joint7_controller/command", 10))
   , gimbal_pub_(nh.advertise<rm_msgs::GimbalCmd>("/controllers/gimbal_controller/command", 10))
@@ -67,28 +71,297 @@ Middleware::Middleware(ros::NodeHandle& nh)
   , tf_listener_(tf_)
   , is_middleware_control_(false)
 {
+  std::string reachability_map;
+  if (nh.getParam("reachability_map", reachability_map))
+    ReachabilityMap::getInstance().load(reachability_map);
+  std::string telemetry_file;
+  if (nh.getParam("telemetry_file", telemetry_file))
+    Telemetry::getInstance().open(telemetry_file);
+  nh.param("chassis_control", is_chassis_control_, false);
   if (nh.hasParam("steps_list") && nh.hasParam("scenes_list"))
   {
-    XmlRpc::XmlRpcValue steps_list;
-    XmlRpc::XmlRpcValue scenes_list;
-    nh.getParam("steps_list", steps_list);
-    nh.getParam("scenes_list", scenes_list);
-    ROS_ASSERT(steps_list.getType() == XmlRpc::XmlRpcValue::Type::TypeStruct);
-    ROS_ASSERT(scenes_list.getType() == XmlRpc::XmlRpcValue::Type::TypeStruct);
-    for (XmlRpc::XmlRpcValue::ValueStruct::const_iterator it = steps_list.begin(); it != steps_list.end(); ++it)
+    nh.getParam("steps_list", steps_list_);
+    nh.getParam("scenes_list", scenes_list_);
+    // Only check the lists here, motions of a queue are built on its first request or by preloading
+    ROS_ASSERT(isValidStepsList(steps_list_));
+    scene_manager_.setScenes(scenes_list_);
+    ROS_INFO("Find %d step queues", steps_list_.size());
+    // Decide which queue wins when two of them need the same actuator, default 0
+    nh.getParam("priorities", priorities_);
+    bool preload_all = false;
+    nh.param("preload_all", preload_all, false);
+    if (preload_all)
     {
-      step_queues_.insert(std::make_pair(
-          it->first, StepQueue(it->second, scenes_list, tf_, arm_group_, chassis_interface_, hand_pub_,
-                               end_effector_pub_, gimbal_pub_, gpio_pub_, reversal_pub_, stone_num_pub_,
-                               planning_result_pub_, point_cloud_pub_, ore_rotate_pub_, ore_lift_pub_, gimbal_lift_pub_,
-                               extend_arm_f_pub_, extend_arm_b_pub_, silver_lifter_pub_, silver_pusher_pub_,
-                               silver_rotator_pub_, gold_pusher_pub_, gold_lifter_pub_, middle_pitch_pub_)));
+      for (XmlRpc::XmlRpcValue::ValueStruct::const_iterator it = steps_list_.begin(); it != steps_list_.end(); ++it)
+        getStepQueue(it->first);
     }
+    else
+    {
+      // Queues listed in the predicted order of the match are warmed up in background
+      std::vector<std::string> preload;
+      nh.getParam("preload", preload);
+      preload_list_.assign(preload.begin(), preload.end());
+    }
+    preload_sub_ = nh.subscribe<std_msgs::String>("preload", 10, &Middleware::preloadCB, this);
+    reload_server_ = nh.advertiseService("reload", &Middleware::reloadCB, this);
+    warm_up_thread_ = std::thread(&Middleware::warmUp, this);
   }
   else
     ROS_ERROR("no steps list define in yaml");
   as_.start();
 }
+
+Middleware::~Middleware()
+{
+  {
+    std::lock_guard<std::mutex> lock(preload_mutex_);
+    is_shutdown_ = true;
+  }
+  preload_cv_.notify_all();
+  if (warm_up_thread_.joinable())
+    warm_up_thread_.join();
+  std::lock_guard<std::mutex> lock(executions_mutex_);
+  for (auto& execution : executions_)
+    execution.ticket.preempt.request();
+  scheduler_.notify();
+  // Waits for the execution threads
+  executions_.clear();
+}
+
+StepQueue* Middleware::getStepQueue(const std::string& name)
+{
+  std::lock_guard<std::mutex> lock(queues_mutex_);
+  auto step_queue = step_queues_.find(name);
+  if (step_queue != step_queues_.end())
+    return &step_queue->second;
+  if (!steps_list_.hasMember(name))
+    return nullptr;
+  ros::WallTime start = ros::WallTime::now();
+  StepQueue built(name, steps_list_[name], tf_, arm_group_, parallel_planner_, chassis_interface_, scene_manager_,
+                  hand_pub_, end_effector_pub_, gimbal_pub_, gpio_pub_, reversal_pub_, stone_num_pub_,
+                  planning_result_pub_, point_cloud_pub_, ore_rotate_pub_, ore_lift_pub_, gimbal_lift_pub_,
+                  extend_arm_f_pub_, extend_arm_b_pub_, silver_lifter_pub_, silver_pusher_pub_, silver_rotator_pub_,
+                  gold_pusher_pub_, gold_lifter_pub_, middle_pitch_pub_);
+  ROS_INFO("Build step queue %s with %zu steps in %f ms, %zu bytes of motions", name.c_str(), built.size(),
+           (ros::WallTime::now() - start).toSec() * 1e3, built.getArena().getBytes());
+  // Elements of unordered_map never move, so the returned queue stays valid while others are built
+  step_queue = step_queues_.emplace(name, std::move(built)).first;
+  return &step_queue->second;
+}
+
+void Middleware::goalCB(actionlib::ServerGoalHandle<rm_msgs::EngineerAction> goal)
+{
+  goal.setAccepted();
+  std::lock_guard<std::mutex> lock(executions_mutex_);
+  executions_.remove_if([](const Execution& execution) {
+    return execution.future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+  });
+  executions_.emplace_back();
+  Execution& execution = executions_.back();
+  execution.goal = goal;
+  execution.future = std::async(std::launch::async, &Middleware::execute, this, std::ref(execution));
+}
+
+void Middleware::cancelCB(actionlib::ServerGoalHandle<rm_msgs::EngineerAction> goal)
+{
+  std::lock_guard<std::mutex> lock(executions_mutex_);
+  for (auto& execution : executions_)
+    if (execution.goal == goal)
+      execution.ticket.preempt.request();
+  scheduler_.notify();
+}
+
+void Middleware::execute(Execution& execution)
+{
+  std::string name;
+  name = execution.goal.getGoal()->step_queue_name;
+  ROS_INFO("Start step queue id %s", name.c_str());
+  {
+    std::lock_guard<std::mutex> lock(queues_mutex_);
+    running_num_++;
+  }
+  StepQueue* step_queue = getStepQueue(name);
+  if (step_queue)
+  {
+    execution.ticket.resources = step_queue->getResources();
+    auto priority = priorities_.find(name);
+    execution.ticket.priority = priority == priorities_.end() ? 0 : priority->second;
+    if (scheduler_.acquire(execution.ticket))
+    {
+      // The scheduler gives the chassis to one queue at a time, only that queue drives it
+      bool has_chassis = execution.ticket.resources & Step::getResource(Step::CHASSIS);
+      if (has_chassis)
+        is_middleware_control_ = true;
+      step_queue->run(execution.goal, execution.ticket.preempt);
+      if (has_chassis)
+        is_middleware_control_ = false;
+      scheduler_.release(execution.ticket);
+    }
+    else
+    {
+      ROS_INFO("Step queue %s canceled before start", name.c_str());
+      execution.goal.setCanceled();
+    }
+  }
+  else
+  {
+    ROS_WARN("No step queue named %s", name.c_str());
+    execution.goal.setAborted();
+  }
+  {
+    std::lock_guard<std::mutex> lock(queues_mutex_);
+    if (--running_num_ == 0 && has_pending_reload_)
+      applyReload();
+  }
+  ROS_INFO("Finish step queue id %s", name.c_str());
+}
+
+bool Middleware::reloadCB(std_srvs::Trigger::Request& req, std_srvs::Trigger::Response& res)
+{
+  // Reads the lists again from the parameter server, load the edited yaml with rosparam before calling
+  XmlRpc::XmlRpcValue steps_list, scenes_list;
+  if (!nh_.getParam("steps_list", steps_list) || !nh_.getParam("scenes_list", scenes_list) ||
+      !isValidStepsList(steps_list) || scenes_list.getType() != XmlRpc::XmlRpcValue::TypeStruct)
+  {
+    res.success = false;
+    res.message = "Invalid steps list or scenes list, keep the current ones";
+    ROS_ERROR("%s", res.message.c_str());
+    return true;
+  }
+  std::lock_guard<std::mutex> lock(queues_mutex_);
+  pending_steps_list_ = steps_list;
+  pending_scenes_list_ = scenes_list;
+  has_pending_reload_ = true;
+  res.success = true;
+  if (running_num_ > 0)
+    res.message = "A step queue is running, reload after it finishes";
+  else
+    res.message = "Reloaded " + std::to_string(applyReload()) + " step queues";
+  ROS_INFO("%s", res.message.c_str());
+  return true;
+}
+
+size_t Middleware::applyReload()
+{
+  // Called with queues_mutex_ held and no queue running, so no one points to the queues being dropped
+  std::vector<std::string> changed;
+  for (auto it = step_queues_.begin(); it != step_queues_.end();)
+  {
+    if (!pending_steps_list_.hasMember(it->first) || pending_steps_list_[it->first] != steps_list_[it->first])
+    {
+      changed.push_back(it->first);
+      it = step_queues_.erase(it);
+    }
+    else
+      ++it;
+  }
+  steps_list_ = pending_steps_list_;
+  if (pending_scenes_list_ != scenes_list_)
+  {
+    scenes_list_ = pending_scenes_list_;
+    scene_manager_.setScenes(scenes_list_);
+  }
+  has_pending_reload_ = false;
+  {
+    // Changed queues which were in use are built again in background, the others stay lazy
+    std::lock_guard<std::mutex> lock(preload_mutex_);
+    for (const auto& name : changed)
+      if (steps_list_.hasMember(name))
+        preload_list_.push_front(name);
+  }
+  preload_cv_.notify_one();
+  return changed.size();
+}
+
+bool Middleware::isValidStepsList(const XmlRpc::XmlRpcValue& steps_list)
+{
+  if (steps_list.getType() != XmlRpc::XmlRpcValue::TypeStruct)
+    return false;
+  // after names a step which comes earlier in the same queue, a single name or a list of them
+  auto is_valid_step = [](const std::string& queue, const XmlRpc::XmlRpcValue& step, std::set<std::string>& names) {
+    if (step.getType() != XmlRpc::XmlRpcValue::TypeStruct || !step.hasMember("step") ||
+        step["step"].getType() != XmlRpc::XmlRpcValue::TypeString)
+      return false;
+    const std::string name = static_cast<std::string>(step["step"]);
+    if (step.hasMember("after"))
+    {
+      XmlRpc::XmlRpcValue after = step["after"];
+      if (after.getType() == XmlRpc::XmlRpcValue::TypeString)
+      {
+        XmlRpc::XmlRpcValue list;
+        list[0] = after;
+        after = list;
+      }
+      if (after.getType() != XmlRpc::XmlRpcValue::TypeArray)
+      {
+        ROS_ERROR("After of step %s in queue %s is neither a name nor a list", name.c_str(), queue.c_str());
+        return false;
+      }
+      for (int i = 0; i < after.size(); ++i)
+        if (after[i].getType() != XmlRpc::XmlRpcValue::TypeString || !names.count(static_cast<std::string>(after[i])))
+        {
+          ROS_ERROR("Step %s in queue %s comes after an unknown step", name.c_str(), queue.c_str());
+          return false;
+        }
+    }
+    names.insert(name);
+    return true;
+  };
+  for (XmlRpc::XmlRpcValue::ValueStruct::const_iterator it = steps_list.begin(); it != steps_list.end(); ++it)
+  {
+    if (it->second.getType() != XmlRpc::XmlRpcValue::TypeArray)
+      return false;
+    std::set<std::string> names;
+    for (int i = 0; i < it->second.size(); ++i)
+    {
+      const XmlRpc::XmlRpcValue& step = it->second[i];
+      if (step.getType() != XmlRpc::XmlRpcValue::TypeStruct)
+        return false;
+      if (!step.hasMember("parallel"))
+      {
+        if (!is_valid_step(it->first, step, names))
+          return false;
+        continue;
+      }
+      const XmlRpc::XmlRpcValue& branches = step["parallel"];
+      if (branches.getType() != XmlRpc::XmlRpcValue::TypeArray)
+        return false;
+      for (int j = 0; j < branches.size(); ++j)
+        if (!is_valid_step(it->first, branches[j], names))
+          return false;
+    }
+  }
+  return true;
+}
+
+void Middleware::preloadCB(const std_msgs::StringConstPtr& msg)
+{
+  {
+    std::lock_guard<std::mutex> lock(preload_mutex_);
+    // An explicit request goes before the predicted ones
+    preload_list_.push_front(msg->data);
+  }
+  preload_cv_.notify_one();
+}
+
+void Middleware::warmUp()
+{
+  while (true)
+  {
+    std::string name;
+    {
+      std::unique_lock<std::mutex> lock(preload_mutex_);
+      preload_cv_.wait(lock, [this] { return is_shutdown_ || !preload_list_.empty(); });
+      if (is_shutdown_)
+        return;
+      name = preload_list_.front();
+      preload_list_.pop_front();
+    }
+    if (!getStepQueue(name))
+      ROS_WARN("Can not preload step queue %s, it is not in the steps list", name.c_str());
+  }
+}
+
 geometry_msgs::TransformStamped engineer_middleware::JointMotion::arm2base;
 
 }  // namespace engineer_middleware
@@ -0,0 +1,112 @@
+//
+// Created by agent on 26-10-18.
+//
+
+// Offline tool: sample the workspace of the arm and write a reachability map for the middleware. Each voxel scores
+// the fraction of sampled tool orientations which have an IK solution, using the kinematics solver configured for the
+// group (the launch file selects the IKFast plugin).
+
+#include <ros/ros.h>
+#include <moveit/robot_model_loader/robot_model_loader.h>
+#include <moveit/robot_state/robot_state.h>
+#include <Eigen/Geometry>
+
+#include "engineer_middleware/reachability_map.h"
+
+using namespace engineer_middleware;
+
+// Tool orientations: the approach axis (x of the tip link) points along a Fibonacci sphere, rolled around itself
+std::vector<Eigen::Quaterniond> sampleOrientations(int approach_samples, int roll_samples)
+{
+  std::vector<Eigen::Quaterniond> orientations;
+  const double golden_angle = M_PI * (3. - std::sqrt(5.));
+  for (int i = 0; i < approach_samples; ++i)
+  {
+    double z = 1. - 2. * (i + 0.5) / approach_samples;
+    double r = std::sqrt(1. - z * z);
+    Eigen::Vector3d approach(r * std::cos(golden_angle * i), r * std::sin(golden_angle * i), z);
+    Eigen::Quaterniond align = Eigen::Quaterniond::FromTwoVectors(Eigen::Vector3d::UnitX(), approach);
+    for (int j = 0; j < roll_samples; ++j)
+      orientations.push_back(align * Eigen::AngleAxisd(2. * M_PI * j / roll_samples, Eigen::Vector3d::UnitX()));
+  }
+  return orientations;
+}
+
+int main(int argc, char** argv)
+{
+  ros::init(argc, argv, "reachability_map_generator");
+  ros::NodeHandle nh("~");
+  std::string group_name, output;
+  std::vector<double> min, max;
+  double resolution, ik_timeout;
+  int approach_samples, roll_samples;
+  nh.param("group", group_name, std::string("engineer_arm"));
+  nh.param("output", output, std::string("reachability_map.bin"));
+  nh.param("resolution", resolution, 0.05);
+  nh.param("ik_timeout", ik_timeout, 0.005);
+  nh.param("approach_samples", approach_samples, 16);
+  nh.param("roll_samples", roll_samples, 4);
+  if (!nh.getParam("min", min) || !nh.getParam("max", max) || min.size() != 3 || max.size() != 3)
+  {
+    ROS_ERROR("Workspace bound min and max should be [x, y, z] in the model frame");
+    return 1;
+  }
+
+  robot_model_loader::RobotModelLoader loader("robot_description");
+  moveit::core::RobotModelPtr model = loader.getModel();
+  const moveit::core::JointModelGroup* group = model->getJointModelGroup(group_name);
+  if (!group || !group->getSolverInstance())
+  {
+    ROS_ERROR("Group %s has no kinematics solver", group_name.c_str());
+    return 1;
+  }
+  moveit::core::RobotState state(model);
+  state.setToDefaultValues();
+  const std::vector<Eigen::Quaterniond> orientations = sampleOrientations(approach_samples, roll_samples);
+
+  ReachabilityMapHeader header{};
+  header.size_x = std::ceil((max[0] - min[0]) / resolution);
+  header.size_y = std::ceil((max[1] - min[1]) / resolution);
+  header.size_z = std::ceil((max[2] - min[2]) / resolution);
+  header.origin_x = min[0];
+  header.origin_y = min[1];
+  header.origin_z = min[2];
+  header.resolution = resolution;
+  std::vector<uint8_t> data(ReachabilityMap::voxelNum(header), 0);
+  ROS_INFO("Sampling %zu voxels with %zu orientations each", data.size(), orientations.size());
+
+  ros::WallTime start = ros::WallTime::now();
+  size_t index = 0, reachable = 0;
+  for (uint32_t iz = 0; iz < header.size_z; ++iz)
+  {
+    for (uint32_t iy = 0; iy < header.size_y; ++iy)
+    {
+      for (uint32_t ix = 0; ix < header.size_x; ++ix, ++index)
+      {
+        Eigen::Isometry3d pose = Eigen::Isometry3d::Identity();
+        pose.translation() = Eigen::Vector3d(min[0] + (ix + 0.5) * resolution, min[1] + (iy + 0.5) * resolution,
+                                             min[2] + (iz + 0.5) * resolution);
+        int solved = 0;
+        for (const auto& orientation : orientations)
+        {
+          pose.linear() = orientation.toRotationMatrix();
+          solved += state.setFromIK(group, pose, ik_timeout);
+        }
+        data[index] = (uint8_t)std::lround(255. * solved / orientations.size());
+        reachable += solved > 0;
+      }
+      if (!ros::ok())
+        return 1;
+    }
+    ROS_INFO("Layer %u / %u done", iz + 1, header.size_z);
+  }
+
+  if (!ReachabilityMap::save(output, header, data))
+  {
+    ROS_ERROR("Can not write reachability map %s", output.c_str());
+    return 1;
+  }
+  ROS_INFO("Write %s in %f s, %zu of %zu voxels reachable", output.c_str(), (ros::WallTime::now() - start).toSec(),
+           reachable, data.size());
+  return 0;
+}
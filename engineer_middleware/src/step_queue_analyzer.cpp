@@ -0,0 +1,293 @@
+//
+// Created by agent on 26-10-18.
+//
+
+// Offline critical-path analysis of step queues. A step has to wait for the last earlier step sharing an actuator
+// with it and for the steps named in its after, steps on disjoint actuators could overlap. For every queue the tool
+// prints the serial time, the length of the critical path and the steps on it. With ~emit it also prints the queue
+// with consecutive independent steps grouped into parallel blocks.
+//
+// Step times come from a telemetry log when given (mean of the recorded runs), otherwise from the delay of the
+// motions and ~motion_time for the arm and chassis. Couplings through TF are not visible, except that a chassis
+// target following the arm is treated as using the arm.
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <ros/ros.h>
+
+#include "engineer_middleware/step.h"
+#include "engineer_middleware/telemetry.h"
+
+using namespace engineer_middleware;
+
+struct StepNode
+{
+  std::string name;
+  uint32_t resources;
+  double duration;
+  std::vector<int> after;
+  int depend;
+  double finish;
+};
+
+class Analyzer
+{
+public:
+  explicit Analyzer(ros::NodeHandle& nh)
+  {
+    nh.param("motion_time", motion_time_, 1.);
+    nh.param("poll_time", poll_time_, 0.01);
+    std::string telemetry;
+    if (nh.getParam("telemetry", telemetry))
+      loadTelemetry(telemetry);
+  }
+
+  void analyze(const std::string& queue, const XmlRpc::XmlRpcValue& steps, bool emit)
+  {
+    // Parallel blocks are flattened, their order only matters through the actuators
+    std::vector<const XmlRpc::XmlRpcValue*> configs;
+    for (int i = 0; i < steps.size(); ++i)
+    {
+      if (!steps[i].hasMember("parallel"))
+        configs.push_back(&steps[i]);
+      else
+        for (int j = 0; j < steps[i]["parallel"].size(); ++j)
+          configs.push_back(&steps[i]["parallel"][j]);
+    }
+    std::vector<StepNode> nodes;
+    double serial = 0.;
+    for (int i = 0; i < (int)configs.size(); ++i)
+    {
+      const XmlRpc::XmlRpcValue& config = *configs[i];
+      StepNode node;
+      node.name = static_cast<std::string>(config["step"]);
+      node.resources = getResources(config);
+      node.duration = getDuration(queue, node.name, config);
+      node.after = getAfter(config, nodes);
+      // Each actuator is chained on its own, the step waits for the last earlier user of every actuator it takes
+      uint32_t pending = node.resources;
+      for (int j = i - 1; j >= 0 && pending; --j)
+        if (nodes[j].resources & pending)
+        {
+          node.after.push_back(j);
+          pending &= ~nodes[j].resources;
+        }
+      // A step without motions, e.g. only switching the scene, keeps its place
+      if (!node.resources && i > 0)
+        node.after.push_back(i - 1);
+      node.depend = -1;
+      for (int j : node.after)
+        if (node.depend < 0 || nodes[j].finish > nodes[node.depend].finish)
+          node.depend = j;
+      double start = node.depend < 0 ? 0. : nodes[node.depend].finish;
+      node.finish = start + node.duration;
+      serial += node.duration;
+      nodes.push_back(node);
+    }
+    if (nodes.empty())
+      return;
+    int last = 0;
+    for (int i = 0; i < (int)nodes.size(); ++i)
+      if (nodes[i].finish > nodes[last].finish)
+        last = i;
+    std::vector<int> path;
+    for (int i = last; i >= 0; i = nodes[i].depend)
+      path.push_back(i);
+    std::reverse(path.begin(), path.end());
+
+    double critical = nodes[last].finish;
+    std::printf("%s: %zu steps, serial %.3f s, critical path %.3f s, speedup %.2f\n", queue.c_str(), nodes.size(),
+                serial, critical, critical > 0. ? serial / critical : 1.);
+    for (int i : path)
+      std::printf("  %-40s %8.3f s\n", nodes[i].name.c_str(), nodes[i].duration);
+    if (emit)
+      std::printf("%s", group(queue, configs, nodes).c_str());
+  }
+
+private:
+  uint32_t getResources(const XmlRpc::XmlRpcValue& step) const
+  {
+    uint32_t resources = Step::getResources(step);
+    if (step.hasMember("chassis_target") && step["chassis_target"].hasMember("target_frame") &&
+        static_cast<std::string>(step["chassis_target"]["target_frame"]) == "arm")
+      resources |= Step::getResource(Step::ARM);
+    return resources;
+  }
+  static std::vector<int> getAfter(const XmlRpc::XmlRpcValue& step, const std::vector<StepNode>& nodes)
+  {
+    std::vector<int> after;
+    if (!step.hasMember("after"))
+      return after;
+    std::vector<std::string> names;
+    if (step["after"].getType() == XmlRpc::XmlRpcValue::TypeString)
+      names.push_back(static_cast<std::string>(step["after"]));
+    else
+      for (int i = 0; i < step["after"].size(); ++i)
+        names.push_back(static_cast<std::string>(step["after"][i]));
+    for (const auto& name : names)
+      for (int j = (int)nodes.size() - 1; j >= 0; --j)
+        if (nodes[j].name == name)
+        {
+          after.push_back(j);
+          break;
+        }
+    return after;
+  }
+  double getDuration(const std::string& queue, const std::string& name, const XmlRpc::XmlRpcValue& step) const
+  {
+    auto recorded = recorded_.find({ queue, name });
+    if (recorded != recorded_.end())
+      return recorded->second.first / recorded->second.second;
+    double duration = 0.;
+    for (XmlRpc::XmlRpcValue::ValueStruct::const_iterator it = step.begin(); it != step.end(); ++it)
+    {
+      Step::MotionType type;
+      if (!Step::getMotionType(it->first, type))
+        continue;
+      if (it->second.getType() == XmlRpc::XmlRpcValue::TypeStruct && it->second.hasMember("delay"))
+        duration = std::max(duration, xmlRpcGetDouble(it->second, "delay", 0.));
+      else if (type == Step::ARM || type == Step::CHASSIS || type == Step::CHASSIS_TARGET ||
+               type == Step::AUTO_EXCHANGE)
+        duration = std::max(duration, motion_time_);
+    }
+    return duration + poll_time_;
+  }
+  void loadTelemetry(const std::string& path)
+  {
+    std::vector<TelemetryRecord> records;
+    if (!Telemetry::read(path, records))
+    {
+      ROS_ERROR("Can not read telemetry log %s", path.c_str());
+      return;
+    }
+    for (const auto& record : records)
+    {
+      if (record.motion != TelemetryRecord::STEP || !record.success)
+        continue;
+      auto& recorded = recorded_[{ record.queue, record.step }];
+      recorded.first += record.move_time + record.wait_time;
+      recorded.second++;
+    }
+  }
+
+  // Group runs of consecutive independent steps, after is dropped as the order of the list implies it
+  static std::string group(const std::string& queue, const std::vector<const XmlRpc::XmlRpcValue*>& configs,
+                           const std::vector<StepNode>& nodes)
+  {
+    std::ostringstream out;
+    out << queue << "_PARALLEL:\n";
+    size_t i = 0;
+    while (i < nodes.size())
+    {
+      uint32_t resources = nodes[i].resources;
+      size_t j = i + 1;
+      for (; j < nodes.size() && nodes[j].resources && resources && !(nodes[j].resources & resources); ++j)
+      {
+        bool is_after = false;
+        for (int k : nodes[j].after)
+          is_after |= k >= (int)i;
+        if (is_after)
+          break;
+        resources |= nodes[j].resources;
+      }
+      if (j - i == 1)
+      {
+        out << "  - ";
+        writeStep(out, *configs[i]);
+        out << "\n";
+      }
+      else
+      {
+        out << "  - parallel:\n";
+        for (size_t k = i; k < j; ++k)
+        {
+          out << "      - ";
+          writeStep(out, *configs[k]);
+          out << "\n";
+        }
+      }
+      i = j;
+    }
+    return out.str();
+  }
+  static void writeStep(std::ostream& out, const XmlRpc::XmlRpcValue& step)
+  {
+    XmlRpc::XmlRpcValue written;
+    for (XmlRpc::XmlRpcValue::ValueStruct::const_iterator it = step.begin(); it != step.end(); ++it)
+      if (it->first != "after")
+        written[it->first] = it->second;
+    writeYaml(out, written);
+  }
+  static void writeYaml(std::ostream& out, const XmlRpc::XmlRpcValue& value)
+  {
+    switch (value.getType())
+    {
+      case XmlRpc::XmlRpcValue::TypeStruct:
+      {
+        out << "{ ";
+        bool first = true;
+        for (XmlRpc::XmlRpcValue::ValueStruct::const_iterator it = value.begin(); it != value.end(); ++it)
+        {
+          out << (first ? "" : ", ") << it->first << ": ";
+          writeYaml(out, it->second);
+          first = false;
+        }
+        out << " }";
+        break;
+      }
+      case XmlRpc::XmlRpcValue::TypeArray:
+        out << "[ ";
+        for (int i = 0; i < value.size(); ++i)
+        {
+          out << (i ? ", " : "");
+          writeYaml(out, value[i]);
+        }
+        out << " ]";
+        break;
+      case XmlRpc::XmlRpcValue::TypeString:
+        out << "\"" << static_cast<std::string>(const_cast<XmlRpc::XmlRpcValue&>(value)) << "\"";
+        break;
+      case XmlRpc::XmlRpcValue::TypeBoolean:
+        out << (static_cast<bool>(const_cast<XmlRpc::XmlRpcValue&>(value)) ? "true" : "false");
+        break;
+      case XmlRpc::XmlRpcValue::TypeInt:
+        out << static_cast<int>(const_cast<XmlRpc::XmlRpcValue&>(value));
+        break;
+      case XmlRpc::XmlRpcValue::TypeDouble:
+        out << static_cast<double>(const_cast<XmlRpc::XmlRpcValue&>(value));
+        break;
+      default:
+        out << "~";
+    }
+  }
+
+  double motion_time_{}, poll_time_{};
+  // Sum of the recorded times and number of runs of each step
+  std::map<std::pair<std::string, std::string>, std::pair<double, int>> recorded_;
+};
+
+int main(int argc, char** argv)
+{
+  ros::init(argc, argv, "step_queue_analyzer");
+  ros::NodeHandle nh("~");
+  XmlRpc::XmlRpcValue steps_list;
+  if (!nh.getParam("steps_list", steps_list) || steps_list.getType() != XmlRpc::XmlRpcValue::TypeStruct)
+  {
+    ROS_ERROR("Load a steps list into ~steps_list first");
+    return 1;
+  }
+  std::string queue;
+  bool emit;
+  nh.param("queue", queue, std::string());
+  nh.param("emit", emit, false);
+  Analyzer analyzer(nh);
+  for (XmlRpc::XmlRpcValue::ValueStruct::const_iterator it = steps_list.begin(); it != steps_list.end(); ++it)
+    if (queue.empty() || it->first == queue)
+      analyzer.analyze(it->first, it->second, emit);
+  return 0;
+}
@@ -0,0 +1,200 @@
+//
+// Created by agent on 26-10-18.
+//
+
+// Headless benchmark: sends step queues to a running middleware and reports cycle time, per-step latency and planning
+// success rate. Started by benchmark.launch against MoveIt fake controllers and the kinematic chassis, it exits with 1
+// when a queue fails or gets slower than its baseline, so CI can run it.
+
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <ros/ros.h>
+#include <actionlib/client/simple_action_client.h>
+#include <rm_msgs/EngineerAction.h>
+#include <std_msgs/Int32.h>
+
+struct QueueStats
+{
+  int runs{}, succeeded{}, plans{}, planned{};
+  std::vector<double> cycle_times;
+  // Step name, in the order of the queue, to the latencies of every run
+  std::vector<std::pair<std::string, std::vector<double>>> steps;
+};
+
+class Benchmark
+{
+public:
+  explicit Benchmark(ros::NodeHandle& nh)
+    : client_(nh.param("action", std::string("/engineer_middleware/move_steps")), true)
+  {
+    nh.getParam("queues", queues_);
+    nh.param("repeats", repeats_, 5);
+    nh.param("goal_timeout", goal_timeout_, 60.);
+    nh.param("tolerance", tolerance_, 0.2);
+    nh.getParam("baseline", baseline_);
+    nh.getParam("output", output_);
+    planning_result_sub_ = nh.subscribe("/planning_result", 100, &Benchmark::planningResultCB, this);
+  }
+
+  bool run()
+  {
+    if (queues_.empty())
+    {
+      ROS_ERROR("No queue to benchmark, set ~queues");
+      return false;
+    }
+    if (!client_.waitForServer(ros::Duration(60.)))
+    {
+      ROS_ERROR("Middleware action server is not up");
+      return false;
+    }
+    for (int i = 0; i < repeats_ && ros::ok(); ++i)
+      for (const auto& queue : queues_)
+        runOnce(queue);
+    report();
+    return check();
+  }
+
+private:
+  void runOnce(const std::string& queue)
+  {
+    QueueStats& stats = stats_[queue];
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      current_ = &stats;
+    }
+    step_name_.clear();
+    step_index_ = 0;
+    rm_msgs::EngineerGoal goal;
+    goal.step_queue_name = queue;
+    ros::WallTime start = ros::WallTime::now();
+    step_start_ = start;
+    client_.sendGoal(
+        goal, actionlib::SimpleActionClient<rm_msgs::EngineerAction>::SimpleDoneCallback(),
+        actionlib::SimpleActionClient<rm_msgs::EngineerAction>::SimpleActiveCallback(),
+        [this, &stats](const rm_msgs::EngineerFeedbackConstPtr& feedback) { feedbackCB(stats, feedback); });
+    bool finished = client_.waitForResult(ros::Duration(goal_timeout_));
+    ros::WallTime end = ros::WallTime::now();
+    if (!finished)
+      client_.cancelGoal();
+    bool success = finished && client_.getState() == actionlib::SimpleClientGoalState::SUCCEEDED;
+    if (!step_name_.empty())
+      addStep(stats, step_name_, (end - step_start_).toSec());
+    stats.runs++;
+    stats.succeeded += success;
+    if (success)
+      stats.cycle_times.push_back((end - start).toSec());
+    ROS_INFO("%s: %s in %f s", queue.c_str(), success ? "succeeded" : client_.getState().toString().c_str(),
+             (end - start).toSec());
+    std::lock_guard<std::mutex> lock(mutex_);
+    current_ = nullptr;
+  }
+  // Feedback carries the step being waited for, a step lasts until the next one shows up. Steps which finish within
+  // one poll are merged into the next.
+  void feedbackCB(QueueStats& stats, const rm_msgs::EngineerFeedbackConstPtr& feedback)
+  {
+    if (feedback->current_step.empty() || feedback->current_step == step_name_)
+      return;
+    ros::WallTime now = ros::WallTime::now();
+    if (!step_name_.empty())
+      addStep(stats, step_name_, (now - step_start_).toSec());
+    step_name_ = feedback->current_step;
+    step_start_ = now;
+  }
+  void addStep(QueueStats& stats, const std::string& name, double latency)
+  {
+    if (step_index_ >= stats.steps.size())
+      stats.steps.emplace_back(name, std::vector<double>());
+    stats.steps[step_index_++].second.push_back(latency);
+  }
+  void planningResultCB(const std_msgs::Int32ConstPtr& msg)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!current_)
+      return;
+    current_->plans++;
+    current_->planned += msg->data == 1;
+  }
+
+  static double mean(const std::vector<double>& values)
+  {
+    double sum = 0.;
+    for (double value : values)
+      sum += value;
+    return values.empty() ? 0. : sum / values.size();
+  }
+  void report()
+  {
+    std::ofstream file;
+    if (!output_.empty())
+      file.open(output_);
+    for (const auto& queue : queues_)
+    {
+      const QueueStats& stats = stats_[queue];
+      double cycle = mean(stats.cycle_times);
+      double planning_rate = stats.plans ? (double)stats.planned / stats.plans : 1.;
+      std::printf("%s: %d / %d succeeded, cycle %.3f s, planning success %.1f %% (%d plans)\n", queue.c_str(),
+                  stats.succeeded, stats.runs, cycle, planning_rate * 100., stats.plans);
+      for (const auto& step : stats.steps)
+        std::printf("  %-40s %8.3f s\n", step.first.c_str(), mean(step.second));
+      if (file)
+      {
+        file << queue << ":\n  runs: " << stats.runs << "\n  succeeded: " << stats.succeeded
+             << "\n  cycle_time: " << cycle << "\n  planning_success_rate: " << planning_rate << "\n  steps:\n";
+        for (const auto& step : stats.steps)
+          file << "    - { step: \"" << step.first << "\", latency: " << mean(step.second) << " }\n";
+      }
+    }
+  }
+  bool check()
+  {
+    bool ok = true;
+    for (const auto& queue : queues_)
+    {
+      const QueueStats& stats = stats_[queue];
+      if (stats.succeeded != stats.runs)
+      {
+        ROS_ERROR("%s failed %d of %d runs", queue.c_str(), stats.runs - stats.succeeded, stats.runs);
+        ok = false;
+      }
+      auto baseline = baseline_.find(queue);
+      if (baseline != baseline_.end() && mean(stats.cycle_times) > baseline->second * (1. + tolerance_))
+      {
+        ROS_ERROR("%s takes %f s, baseline is %f s", queue.c_str(), mean(stats.cycle_times), baseline->second);
+        ok = false;
+      }
+    }
+    return ok;
+  }
+
+  actionlib::SimpleActionClient<rm_msgs::EngineerAction> client_;
+  ros::Subscriber planning_result_sub_;
+  std::vector<std::string> queues_;
+  std::map<std::string, double> baseline_;
+  std::map<std::string, QueueStats> stats_;
+  std::string output_;
+  int repeats_{};
+  double goal_timeout_{}, tolerance_{};
+  std::mutex mutex_;
+  QueueStats* current_{};
+  std::string step_name_;
+  size_t step_index_{};
+  ros::WallTime step_start_;
+};
+
+int main(int argc, char** argv)
+{
+  ros::init(argc, argv, "step_queue_benchmark");
+  ros::NodeHandle nh("~");
+  ros::AsyncSpinner spinner(2);
+  spinner.start();
+  Benchmark benchmark(nh);
+  bool ok = benchmark.run();
+  ros::shutdown();
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,79 @@
+//
+// Created by agent on 26-10-18.
+//
+
+// Summarize a step telemetry log: steps sorted by the total time they take, so the ones dominating the cycle time are
+// on top. With --csv every record is printed instead, motion records carry Step::MotionType as number.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "engineer_middleware/telemetry.h"
+
+using namespace engineer_middleware;
+
+struct StepSummary
+{
+  std::string queue, step;
+  int count{}, failures{};
+  double move{}, wait{}, max_total{}, polls{};
+  double min_margin = NAN;
+};
+
+int main(int argc, char** argv)
+{
+  if (argc < 2)
+  {
+    std::printf("Usage: telemetry_dump <log> [--csv]\n");
+    return 1;
+  }
+  std::vector<TelemetryRecord> records;
+  if (!Telemetry::read(argv[1], records))
+  {
+    std::printf("Can not read telemetry log %s\n", argv[1]);
+    return 1;
+  }
+  if (argc > 2 && std::string(argv[2]) == "--csv")
+  {
+    std::printf("stamp,queue,step,motion,success,polls,move_time,wait_time,timeout_margin\n");
+    for (const auto& record : records)
+      std::printf("%.6f,%s,%s,%d,%d,%u,%f,%f,%f\n", record.stamp, record.queue, record.step,
+                  record.motion == TelemetryRecord::STEP ? -1 : record.motion, record.success, record.polls,
+                  record.move_time, record.wait_time, record.timeout_margin);
+    return 0;
+  }
+
+  std::map<std::pair<std::string, std::string>, StepSummary> summaries;
+  for (const auto& record : records)
+  {
+    if (record.motion != TelemetryRecord::STEP)
+      continue;
+    StepSummary& summary = summaries[{ record.queue, record.step }];
+    summary.queue = record.queue;
+    summary.step = record.step;
+    summary.count++;
+    summary.failures += !record.success;
+    summary.move += record.move_time;
+    summary.wait += record.wait_time;
+    summary.polls += record.polls;
+    summary.max_total = std::max(summary.max_total, (double)record.move_time + record.wait_time);
+    summary.min_margin = std::fmin(summary.min_margin, record.timeout_margin);
+  }
+  std::vector<StepSummary> sorted;
+  for (const auto& summary : summaries)
+    sorted.push_back(summary.second);
+  std::sort(sorted.begin(), sorted.end(), [](const StepSummary& a, const StepSummary& b) {
+    return a.move + a.wait > b.move + b.wait;
+  });
+  std::printf("%-24s %-32s %6s %5s %10s %10s %10s %10s %8s %10s\n", "queue", "step", "runs", "fail", "sum(s)",
+              "move(s)", "wait(s)", "max(s)", "polls", "margin(s)");
+  for (const auto& s : sorted)
+    std::printf("%-24s %-32s %6d %5d %10.3f %10.3f %10.3f %10.3f %8.1f %10.3f\n", s.queue.c_str(), s.step.c_str(),
+                s.count, s.failures, s.move + s.wait, s.move / s.count, s.wait / s.count, s.max_total,
+                s.polls / s.count, s.min_margin);
+  return 0;
+}